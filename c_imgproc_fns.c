@@ -52,8 +52,8 @@ void imgproc_squash( struct Image *input_img, struct Image *output_img, int32_t
   // Iterate over all pixels in output image and calculate expanded from input image
   for (int32_t i = 0; i < output_img->height; i++) {
     for (int32_t j = 0; j < output_img->width; j++) {
-      int32_t index = compute_index(output_img, i, j);
-      output_img->data[index] = squash_pixel(input_img, index, xfac, yfac);
+      int32_t index = i * output_img->width + j;
+      output_img->data[compute_index_inline(output_img, i, j)] = squash_pixel(input_img, index, xfac, yfac);
     }
   }
 }
@@ -72,9 +72,11 @@ void imgproc_squash( struct Image *input_img, struct Image *output_img, int32_t
 //! @param output_img pointer to the output Image (in which the
 //!                   transformed pixels should be stored)
 void imgproc_color_rot( struct Image *input_img, struct Image *output_img) {
-  int32_t num_pixels = input_img->width * input_img->height;
-  for (int32_t i = 0; i < num_pixels; i++) {
-    output_img->data[i] = rot_colors(input_img, i);
+  for (int32_t r = 0; r < input_img->height; r++) {
+    for (int32_t c = 0; c < input_img->width; c++) {
+      int32_t index = compute_index_inline(input_img, r, c);
+      output_img->data[compute_index_inline(output_img, r, c)] = rot_colors(input_img, index);
+    }
   }
 }
 
@@ -109,7 +111,7 @@ void imgproc_blur( struct Image *input_img, struct Image *output_img, int32_t bl
   // Iterate over all pixels in input image and blur each one
   for (int32_t r = 0; r < input_img->height; r++) {
     for (int32_t c = 0; c < input_img->width; c++) {
-      int32_t index = compute_index(input_img, r, c);
+      int32_t index = compute_index_inline(output_img, r, c);
       output_img->data[index] = blur_pixel(input_img, r, c, blur_dist);
     }
   }
@@ -162,8 +164,8 @@ void imgproc_expand( struct Image *input_img, struct Image *output_img) {
   // Iterate over all pixels in output image and calculate expanded from input image
   for (int32_t i = 0; i < output_img->height; i++) {
     for (int32_t j = 0; j < output_img->width; j++) {
-      int32_t index = compute_index(output_img, i, j);
-      output_img->data[index] = expand_pixel(input_img, index);
+      int32_t index = i * output_img->width + j;
+      output_img->data[compute_index_inline(output_img, i, j)] = expand_pixel(input_img, index);
     }
   }
 }
@@ -173,8 +175,7 @@ void imgproc_expand( struct Image *input_img, struct Image *output_img) {
 // @param pixel color in RGBA format
 // @return 8-bit red value
 uint32_t get_r(uint32_t pixel) {
-  uint32_t r_mask = 0xFFU << 24;
-  return (pixel & r_mask) >> 24;
+  return get_r_inline(pixel);
 }
 
 // Gets the 8 bits corresponding to the green component value
@@ -182,8 +183,7 @@ uint32_t get_r(uint32_t pixel) {
 // @param pixel color in RGBA format
 // @return 8-bit green value
 uint32_t get_g(uint32_t pixel) {
-  uint32_t g_mask = 0xFFU << 16;
-  return (pixel & g_mask) >> 16;
+  return get_g_inline(pixel);
 }
 
 // Gets the 8 bits corresponding to the blue component value
@@ -191,8 +191,7 @@ uint32_t get_g(uint32_t pixel) {
 // @param pixel color in RGBA format
 // @return 8-bit blue value
 uint32_t get_b(uint32_t pixel) {
-  uint32_t b_mask = 0xFFU << 8;
-  return (pixel & b_mask) >> 8;
+  return get_b_inline(pixel);
 }
 
 // Gets the 8 bits corresponding to the alpha component value
@@ -200,8 +199,7 @@ uint32_t get_b(uint32_t pixel) {
 // @param pixel color in RGBA format
 // @return 8-bit alpha value
 uint32_t get_a(uint32_t pixel) {
-  uint32_t a_mask = 0xFFU;
-  return pixel & a_mask;
+  return get_a_inline(pixel);
 }
 
 // Combine individual component values into RGBA color
@@ -212,33 +210,33 @@ uint32_t get_a(uint32_t pixel) {
 // @param a alpha component value
 // @return pixel color in RGBA format
 uint32_t make_pixel(uint32_t r, uint32_t g, uint32_t b, uint32_t a) {
-  uint32_t pixel = 0x0U | (r << 24) | (g << 16) | (b << 8) | a;
-  return pixel;
+  return make_pixel_inline(r, g, b, a);
 }
 
 // Rotates the color of the pixel at the given index
 //
 // @param img pointer to Image whose pixel we want to color rotate
-// @param index row-major linear index of the pixel to be rotated
+// @param index index in img's data of the pixel to be rotated (see compute_index)
 // @return color in RGBA format after rotation
 uint32_t rot_colors(struct Image *img, int32_t index) {
   uint32_t pixel = img->data[index];
-  uint32_t r = get_r(pixel);
-  uint32_t g = get_g(pixel);
-  uint32_t b = get_b(pixel);
-  uint32_t a = get_a(pixel);
+  uint32_t r = get_r_inline(pixel);
+  uint32_t g = get_g_inline(pixel);
+  uint32_t b = get_b_inline(pixel);
+  uint32_t a = get_a_inline(pixel);
 
-  return make_pixel(b, r, g, a);
+  return make_pixel_inline(b, r, g, a);
 }
 
-// Gets the row-major linear index for a pixel at position (row, col)
+// Gets the index in the Image's data of the pixel at position (row, col),
+// whose rows are the Image's stride apart
 //
 // @param img pointer to Image
 // @param row row of target pixel (starting with row 0 as top row)
 // @param col column of target pixel (starting with column 0 as leftmost column)
-// @return linear index of target pixel
+// @return index of target pixel
 int32_t compute_index(struct Image *img, int32_t row, int32_t col) {
-  return row * img->width + col;
+  return compute_index_inline(img, row, col);
 }
 
 // Determines if the position (row, col) is valid for the given Image
@@ -248,7 +246,7 @@ int32_t compute_index(struct Image *img, int32_t row, int32_t col) {
 // @param col column of target pixel (starting with column 0 as leftmost column)
 // @return true if position is valid, false otherwise
 bool valid_position(struct Image *img, int32_t row, int32_t col) {
-  return (row >= 0) && (row < img->height) && (col < img->width) && (col >= 0);
+  return valid_position_inline(img, row, col);
 }
 
 // Initialize a PixelAverager instance. All fields initially set to 0
@@ -267,10 +265,10 @@ void pa_init(struct PixelAverager *pa) {
 // @param pa pointer to PixelAverager instance
 // @param pixel color in RGBA format
 void pa_update(struct PixelAverager *pa, uint32_t pixel) {
-  pa->r += get_r(pixel);
-  pa->g += get_g(pixel);
-  pa->b += get_b(pixel);
-  pa->a += get_a(pixel);
+  pa->r += get_r_inline(pixel);
+  pa->g += get_g_inline(pixel);
+  pa->b += get_b_inline(pixel);
+  pa->a += get_a_inline(pixel);
   pa->count++;
 }
 
@@ -282,8 +280,8 @@ void pa_update(struct PixelAverager *pa, uint32_t pixel) {
 // @param row row of target pixel (starting with row 0 as top row)
 // @param col column of target pixel (starting with column 0 as leftmost column)
 void pa_update_from_img(struct PixelAverager *pa, struct Image *img, int32_t row, int32_t col) {
-  if (valid_position(img, row, col)) {
-    int32_t i = compute_index(img, row, col);
+  if (valid_position_inline(img, row, col)) {
+    int32_t i = compute_index_inline(img, row, col);
     pa_update(pa, img->data[i]);
   }
 }
@@ -299,7 +297,7 @@ uint32_t pa_avg_pixel(struct PixelAverager *pa) {
   uint32_t b = pa->b / pa->count;
   uint32_t a = pa->a / pa->count;
 
-  return make_pixel(r, g, b, a);
+  return make_pixel_inline(r, g, b, a);
 }
 
 // Blur the pixel at the given position
@@ -313,27 +311,33 @@ uint32_t blur_pixel(struct Image *img, int32_t row, int32_t col, int32_t blur_di
   struct PixelAverager pa;
   pa_init(&pa);
 
-  // Update PixelAverager with all pixels within blur distance
-  for (int32_t r = row - blur_dist; r <= row + blur_dist; r++) {
-    for (int32_t c = col - blur_dist; c <= col + blur_dist; c++) {
-      pa_update_from_img(&pa, img, r, c);
+  // Update PixelAverager with all pixels within blur distance, clipped
+  // to the image so that each row can be walked through a pointer
+  int32_t r_lo = row - blur_dist < 0 ? 0 : row - blur_dist;
+  int32_t r_hi = row + blur_dist >= img->height ? img->height - 1 : row + blur_dist;
+  int32_t c_lo = col - blur_dist < 0 ? 0 : col - blur_dist;
+  int32_t c_hi = col + blur_dist >= img->width ? img->width - 1 : col + blur_dist;
+  for (int32_t r = r_lo; r <= r_hi; r++) {
+    const uint32_t *pixels = img_row(img, r);
+    for (int32_t c = c_lo; c <= c_hi; c++) {
+      pa_update(&pa, pixels[c]);
     }
   }
 
   // Compute blurred pixel values
   uint32_t pixel = pa_avg_pixel(&pa);
-  uint32_t r = get_r(pixel);
-  uint32_t g = get_g(pixel);
-  uint32_t b = get_b(pixel);
+  uint32_t r = get_r_inline(pixel);
+  uint32_t g = get_g_inline(pixel);
+  uint32_t b = get_b_inline(pixel);
   // Alpha value should not be averaged, so get alpha value of target pixel
-  uint32_t a = get_a(img->data[compute_index(img, row, col)]);
-  return make_pixel(r, g, b, a);
+  uint32_t a = get_a_inline(img->data[compute_index_inline(img, row, col)]);
+  return make_pixel_inline(r, g, b, a);
 }
 
 // Compute expanded pixel at output position (i, j)
 //
 // @param img pointer to input Image
-// @param index linear index in output Image
+// @param index row-major linear index in output Image (i * output width + j)
 // @return expanded pixel value
 uint32_t expand_pixel(struct Image *img, int32_t index) {
   // Retrieve input image baseline
@@ -345,7 +349,7 @@ uint32_t expand_pixel(struct Image *img, int32_t index) {
 
   // Case where both i and j are even
   if ((i % 2 == 0) && (j % 2 == 0)) {
-    int32_t index = compute_index(img, base_r, base_c);
+    int32_t index = compute_index_inline(img, base_r, base_c);
     return img->data[index];
   }
 
@@ -377,7 +381,7 @@ uint32_t expand_pixel(struct Image *img, int32_t index) {
 // Compute squashed pixel at output position (i, j)
 //
 // @param img pointer to input Image
-// @param i linear index of pixel
+// @param i row-major linear index in output Image (row * output width + col)
 // @param xfac xfactor of squash
 // @param yfac yfactor of squash
 // @return squashed pixel value
@@ -390,6 +394,6 @@ uint32_t squash_pixel(struct Image *img, int32_t i, int32_t xfac, int32_t yfac)
   int32_t base_c = c * xfac;
 
   // Compute squashed pixel
-  int32_t index = compute_index(img, base_r, base_c);
+  int32_t index = compute_index_inline(img, base_r, base_c);
   return img->data[index];
 }
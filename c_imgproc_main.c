@@ -11,6 +11,17 @@ struct Transformation {
   const char *name;
   int (*apply)( struct Image *input_img, struct Image *output_img, int argc, char **argv );
   int (*out_dimensions)( struct Image *input_img, int argc, char **argv, int32_t *out_w, int32_t *out_h );
+  // For transformations which can be applied a block of rows at a time
+  // (see stream_transformation): gets the number of input rows each step
+  // consumes, the number of output rows it produces, and the number of
+  // following input rows it also looks at. NULL if the transformation
+  // needs the whole input image, or has a read_transformed function
+  // (which stores less than a window of input rows would).
+  int (*row_footprint)( int argc, char **argv, int32_t *in_rows, int32_t *out_rows, int32_t *lookahead );
+  // For transformations which only select pixels of the input image:
+  // reads the selected pixels of the named image file straight into
+  // output_img, so the others are never stored. NULL otherwise.
+  int (*read_transformed)( const char *filename, struct Image *output_img, int argc, char **argv );
 };
 
 int apply_squash( struct Image *input_img, struct Image *output_img, int argc, char **argv );
@@ -21,18 +32,35 @@ int apply_expand( struct Image *input_img, struct Image *output_img, int argc, c
 int out_dimensions_squash( struct Image *input_img, int argc, char **argv, int32_t *out_w, int32_t *out_h );
 int out_dimensions_expand( struct Image *input_img, int argc, char **argv, int32_t *out_w, int32_t *out_h );
 int out_dimensions_same( struct Image *input_img, int argc, char **argv, int32_t *out_w, int32_t *out_h );
+int out_dimensions_blur( struct Image *input_img, int argc, char **argv, int32_t *out_w, int32_t *out_h );
+
+int row_footprint_expand( int argc, char **argv, int32_t *in_rows, int32_t *out_rows, int32_t *lookahead );
+int row_footprint_same( int argc, char **argv, int32_t *in_rows, int32_t *out_rows, int32_t *lookahead );
+
+int read_squashed( const char *filename, struct Image *output_img, int argc, char **argv );
 
 static const struct Transformation s_transformations[] = {
-  { "squash", apply_squash, out_dimensions_squash },
-  { "color_rot", apply_rot, out_dimensions_same },
-  { "blur", apply_blur, out_dimensions_same },
-  { "expand", apply_expand, out_dimensions_expand },
+  { "squash", apply_squash, out_dimensions_squash, NULL, read_squashed },
+  { "color_rot", apply_rot, out_dimensions_same, row_footprint_same, NULL },
+  { "blur", apply_blur, out_dimensions_blur, NULL, NULL },
+  { "expand", apply_expand, out_dimensions_expand, row_footprint_expand, NULL },
   { NULL, NULL },
 };
 
+// Number of input rows a streamed transformation is applied to at a
+// time (at least one step's worth)
+#define STREAM_BATCH_ROWS 32
+
+// Largest input or output image, in pixels: the PNG encoder keeps the
+// compressed image, which can be as large as the RGBA data, in a buffer
+// whose size is an unsigned int
+#define MAX_IMAGE_PIXELS ( UINT32_MAX / 4 )
+
 void usage( const char *progname ) {
   fprintf( stderr, "Error: invalid command-line arguments\n" );
-  fprintf( stderr, "Usage: %s <transform> <input img> <output img> [args...]\n", progname );
+  fprintf( stderr, "Usage: %s [-p <profile>] [-j <threads>] [-r <rows>] [-s] <transform> <input img> <output img> [args...]\n", progname );
+  fprintf( stderr, "Profiles: stored, fast, balanced (default), small\n" );
+  fprintf( stderr, "-s streams color_rot and expand a block of rows at a time\n" );
   exit( 1 );
 }
 
@@ -84,6 +112,45 @@ struct Image *create_output_img( struct Image *input_img, int argc, char **argv,
   return out_img;
 }
 
+// Check the header of the input image without decoding it: img_read
+// must be able to decode it, it must be small enough that it (and the
+// output image) can be held in memory, and the transformation's
+// arguments must be valid. Stores the input image's dimensions in
+// *input_dims (with no pixel data). Returns 1 if successful, 0
+// otherwise (after printing an error message).
+int probe_input( const struct Transformation *xform, const char *input_filename,
+                 struct Image *input_dims, int argc, char **argv ) {
+  struct ImageInfo info;
+  int32_t out_w, out_h;
+
+  if ( img_probe( input_filename, &info ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: couldn't read input image\n" );
+    return 0;
+  }
+  if ( !info.truecolor ) {
+    fprintf( stderr, "Error: input image is interlaced or of an unknown pixel format\n" );
+    return 0;
+  }
+  if ( info.width <= 0 || info.height <= 0 || (int64_t) info.width * info.height > MAX_IMAGE_PIXELS ) {
+    fprintf( stderr, "Error: input image is too large\n" );
+    return 0;
+  }
+
+  input_dims->width = info.width;
+  input_dims->height = info.height;
+  input_dims->data = NULL;
+  input_dims->stride = info.width;
+  input_dims->is_view = 0;
+
+  if ( !xform->out_dimensions( input_dims, argc, argv, &out_w, &out_h )
+       || (int64_t) out_w * out_h > MAX_IMAGE_PIXELS ) {
+    fprintf( stderr, "Error: couldn't create output image object\n" );
+    return 0;
+  }
+
+  return 1;
+}
+
 // Free memory allocated to given Image object
 void cleanup_image( struct Image *img ) {
   if ( img != NULL ) {
@@ -92,7 +159,158 @@ void cleanup_image( struct Image *img ) {
   }
 }
 
+// Apply a transformation a block of rows at a time, decoding input rows
+// as they are needed and encoding output rows as they are produced, so
+// only a window of STREAM_BATCH_ROWS or so input rows (and the output
+// rows computed from them) is ever in memory, however large the images
+// are. The rows looked ahead at by one block stay in the window as the
+// first rows of the next. Returns 1 if successful, 0 otherwise (after
+// printing an error message).
+int stream_transformation( const struct Transformation *xform, const char *input_filename,
+                           const char *output_filename, int profile, int argc, char **argv ) {
+  int32_t in_rows, out_rows, lookahead;
+  if ( !xform->row_footprint( argc, argv, &in_rows, &out_rows, &lookahead ) ) {
+    fprintf( stderr, "Error: couldn't create output image object\n" );
+    return 0;
+  }
+
+  struct ImageReader reader;
+  if ( img_read_begin( input_filename, &reader ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: couldn't read input image\n" );
+    return 0;
+  }
+
+  int32_t steps = STREAM_BATCH_ROWS / in_rows;
+  if ( steps < 1 )
+    steps = 1;
+
+  // out_dimensions only looks at the dimensions of the input image, so
+  // it also gives the size of the output window
+  struct Image input_dims = { reader.width, reader.height, NULL, reader.width };
+  struct Image window = { reader.width, steps * in_rows + lookahead, NULL, reader.width };
+  struct Image out_window = { 0, 0, NULL, 0 };
+  int32_t out_w, out_h;
+  if ( !xform->out_dimensions( &input_dims, argc, argv, &out_w, &out_h )
+       || !xform->out_dimensions( &window, argc, argv, &out_window.width, &out_window.height ) ) {
+    fprintf( stderr, "Error: couldn't create output image object\n" );
+    img_read_end( &reader );
+    return 0;
+  }
+  out_window.stride = out_window.width;
+
+  window.data = (uint32_t *) malloc( (size_t) window.width * window.height * sizeof( uint32_t ) );
+  out_window.data = (uint32_t *) malloc( (size_t) out_window.width * out_window.height * sizeof( uint32_t ) );
+  if ( window.data == NULL || out_window.data == NULL ) {
+    fprintf( stderr, "Error: couldn't create output image object\n" );
+    free( window.data );
+    free( out_window.data );
+    img_read_end( &reader );
+    return 0;
+  }
+
+  struct ImageWriter writer;
+  if ( img_write_begin( output_filename, &writer, out_w, out_h, profile ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: couldn't write output image\n" );
+    free( window.data );
+    free( out_window.data );
+    img_read_end( &reader );
+    return 0;
+  }
+
+  int32_t window_rows = window.height;
+  int32_t have = 0;
+  int at_end = 0;
+  int success = 1;
+
+  while ( success && writer.row < out_h ) {
+    // fill the window (only the last one is short)
+    while ( have < window_rows && !at_end ) {
+      int n = img_read_rows( &reader, window.data + (size_t) have * window.width, window_rows - have );
+      if ( n < 0 ) {
+        fprintf( stderr, "Error: couldn't read input image\n" );
+        success = 0;
+        break;
+      }
+      at_end = ( n == 0 );
+      have += n;
+    }
+    if ( !success )
+      break;
+
+    int32_t consumed = at_end ? have : steps * in_rows;
+    int32_t emit = consumed / in_rows * out_rows;
+    if ( emit > out_h - writer.row )
+      emit = out_h - writer.row;
+
+    window.height = have;
+    if ( emit <= 0 || !xform->apply( &window, &out_window, argc, argv ) ) {
+      fprintf( stderr, "Error: couldn't apply transformation\n" );
+      success = 0;
+      break;
+    }
+
+    if ( img_write_rows( &writer, out_window.data, emit ) != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't write output image\n" );
+      success = 0;
+      break;
+    }
+
+    // keep the rows looked ahead at for the next block
+    memmove( window.data, window.data + (size_t) consumed * window.width,
+             (size_t) ( have - consumed ) * window.width * sizeof( uint32_t ) );
+    have -= consumed;
+  }
+
+  if ( img_write_end( &writer ) != IMG_SUCCESS && success ) {
+    fprintf( stderr, "Error: couldn't write output image\n" );
+    success = 0;
+  }
+  img_read_end( &reader );
+  free( window.data );
+  free( out_window.data );
+
+  return success;
+}
+
 int main( int argc, char **argv ) {
+  // Options before the transformation name: "-p <profile>" selects the
+  // encode profile for the output image, "-j <threads>" the number of
+  // threads used to decode and encode images, "-r <rows>" the number
+  // of rows between restart points in the output image, and "-s" streams
+  // the transformation if it can be applied a block of rows at a time.
+  // Each option is removed from argv so that the transformation arguments
+  // are at the same positions either way.
+  int profile = IMG_PROFILE_BALANCED;
+  int stream = 0;
+  while ( argc > 2 && argv[1][0] == '-' ) {
+    int shift = 2;
+    if ( strcmp( argv[1], "-s" ) == 0 ) {
+      stream = 1;
+      shift = 1;
+    } else if ( strcmp( argv[1], "-p" ) == 0 ) {
+      profile = img_profile_from_name( argv[2] );
+      if ( profile < 0 ) {
+        fprintf( stderr, "Error: unknown profile '%s'\n", argv[2] );
+        return 1;
+      }
+    } else if ( strcmp( argv[1], "-j" ) == 0 ) {
+      int threads;
+      if ( sscanf( argv[2], "%d", &threads ) != 1 || threads < 0 )
+        usage( argv[0] );
+      img_set_threads( threads );
+    } else if ( strcmp( argv[1], "-r" ) == 0 ) {
+      int rows;
+      if ( sscanf( argv[2], "%d", &rows ) != 1 || rows < 0 )
+        usage( argv[0] );
+      img_set_restart_interval( rows );
+    } else {
+      usage( argv[0] );
+    }
+    argv[shift] = argv[0];
+    argv += shift;
+    argc -= shift;
+  }
+
   if ( argc < 4 )
     usage( argv[0] );
 
@@ -114,34 +332,72 @@ int main( int argc, char **argv ) {
     return 1;
   }
 
-  // Allocate and read the input image
-  struct Image *input_img = (struct Image *) malloc( sizeof( struct Image ) );
-  if ( input_img == NULL ) {
-    fprintf( stderr, "Error: couldn't allocate input image\n" );
+  // fail before decoding anything if the input image or the arguments
+  // are no good
+  struct Image input_dims;
+  if ( !probe_input( xform, input_filename, &input_dims, argc, argv ) )
     return 1;
-  }
-  if ( img_read( input_filename, input_img ) != IMG_SUCCESS ) {
-    fprintf( stderr, "Error: couldn't read input image\n" );
-    free( input_img );
-    return 1;
-  }
 
-  // Create output Image object
-  struct Image *output_img = create_output_img( input_img, argc, argv, xform );
-  if ( output_img == NULL ) {
-    fprintf( stderr, "Error: couldn't create output image object\n" );
-    cleanup_image( input_img );
-    return 1;
-  }
+  // transformations which need the whole input image are never streamed,
+  // and neither are those which read only the pixels they keep
+  if ( stream && xform->row_footprint != NULL )
+    return stream_transformation( xform, input_filename, output_filename, profile, argc, argv ) ? 0 : 1;
 
+  struct Image *input_img = NULL;
+  struct Image *output_img = NULL;
   int success;
 
-  // apply the transformation!
-  success = xform->apply( input_img, output_img, argc, argv ) != 0;
+  if ( xform->read_transformed != NULL ) {
+    // The transformation only selects pixels, so they are read straight
+    // into the output image
+    output_img = (struct Image *) malloc( sizeof( struct Image ) );
+    if ( output_img == NULL ) {
+      fprintf( stderr, "Error: couldn't allocate output image\n" );
+      return 1;
+    }
+    if ( !xform->read_transformed( input_filename, output_img, argc, argv ) ) {
+      fprintf( stderr, "Error: couldn't read input image\n" );
+      free( output_img );
+      return 1;
+    }
+    success = 1;
+  } else {
+    // Create output Image object, sized from the input image's header
+    output_img = create_output_img( &input_dims, argc, argv, xform );
+    if ( output_img == NULL ) {
+      fprintf( stderr, "Error: couldn't create output image object\n" );
+      return 1;
+    }
+
+    // Allocate and read the input image
+    input_img = (struct Image *) malloc( sizeof( struct Image ) );
+    if ( input_img == NULL ) {
+      fprintf( stderr, "Error: couldn't allocate input image\n" );
+      cleanup_image( output_img );
+      return 1;
+    }
+    if ( img_read( input_filename, input_img ) != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't read input image\n" );
+      free( input_img );
+      cleanup_image( output_img );
+      return 1;
+    }
+
+    // the file could have been replaced since it was probed
+    if ( input_img->width != input_dims.width || input_img->height != input_dims.height ) {
+      fprintf( stderr, "Error: couldn't read input image\n" );
+      cleanup_image( input_img );
+      cleanup_image( output_img );
+      return 1;
+    }
+
+    // apply the transformation!
+    success = xform->apply( input_img, output_img, argc, argv ) != 0;
+  }
 
   if ( success ) {
     // Write output image
-    if ( img_write( output_filename, output_img ) != IMG_SUCCESS ) {
+    if ( img_write_ex( output_filename, output_img, profile ) != IMG_SUCCESS ) {
       fprintf( stderr, "Error: couldn't write output image\n" );
       success = 0;
     }
@@ -169,6 +425,13 @@ int apply_squash( struct Image *input_img, struct Image *output_img, int argc, c
   return 1;
 }
 
+int read_squashed( const char *filename, struct Image *output_img, int argc, char **argv ) {
+  int32_t xfac, yfac;
+  if ( !squash_get_factors( argc, argv, &xfac, &yfac ) )
+    return 0;
+  return img_read_squashed( filename, output_img, xfac, yfac ) == IMG_SUCCESS;
+}
+
 int apply_rot( struct Image *input_img, struct Image *output_img, int argc, char **argv ) {
   (void) argc;
   (void) argv;
@@ -206,6 +469,8 @@ int out_dimensions_squash( struct Image *input_img, int argc, char **argv, int32
 int out_dimensions_expand( struct Image *input_img, int argc, char **argv, int32_t *out_w, int32_t *out_h ) {
   // In the expand transformation, the width and height
   // are both doubled.
+  if ( input_img->width > INT32_MAX / 2 || input_img->height > INT32_MAX / 2 )
+    return 0;
   *out_w = input_img->width * 2;
   *out_h = input_img->height * 2;
   return 1;
@@ -218,3 +483,36 @@ int out_dimensions_same( struct Image *input_img, int argc, char **argv, int32_t
   *out_h = input_img->height;
   return 1;
 }
+
+int out_dimensions_blur( struct Image *input_img, int argc, char **argv, int32_t *out_w, int32_t *out_h ) {
+  // The output image is the same size as the input image, but the
+  // blur distance argument is checked here so that a bad one is
+  // caught before the input image is decoded.
+  int blur_dist;
+  if ( argc != 5 || sscanf( argv[4], "%d", &blur_dist ) != 1 )
+    return 0;
+  return out_dimensions_same( input_img, argc, argv, out_w, out_h );
+}
+
+int row_footprint_expand( int argc, char **argv, int32_t *in_rows, int32_t *out_rows, int32_t *lookahead ) {
+  // Each input row becomes two output rows, the second of which
+  // averages it with the next input row
+  (void) argc;
+  (void) argv;
+  *in_rows = 1;
+  *out_rows = 2;
+  *lookahead = 1;
+  return 1;
+}
+
+int row_footprint_same( int argc, char **argv, int32_t *in_rows, int32_t *out_rows, int32_t *lookahead ) {
+  // This function is used for transformations which map each input
+  // row to the output row at the same position.
+  (void) argc;
+  (void) argv;
+  *in_rows = 1;
+  *out_rows = 1;
+  *lookahead = 0;
+  return 1;
+}
+
@@ -1,19 +1,73 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
 #include "pnglite.h"
+#include "qoi.h"
+#include "rawimg.h"
+#include "tileimg.h"
 #include "image.h"
 
-int png_init_called;
+// pnglite settings for each encode profile, indexed by IMG_PROFILE_* value
+struct EncodeProfile {
+  const char *name;
+  int level;         // zlib compression level
+  int strategy;      // PNG_STRATEGY_* value
+  int filter;        // PNG_FILTER_* value
+  unsigned idat_size;
+};
+
+static const struct EncodeProfile s_profiles[] = {
+  // stored deflate blocks, and no point in filtering
+  { "stored", 0, PNG_STRATEGY_DEFAULT, PNG_FILTER_NONE, 1024 * 1024 },
+  // run-length matches only, with the cheapest useful filter
+  { "fast", 1, PNG_STRATEGY_RLE, PNG_FILTER_SUB, 1024 * 1024 },
+  { "balanced", -1, PNG_STRATEGY_DEFAULT, PNG_FILTER_ADAPTIVE, 0 },
+  { "small", 9, PNG_STRATEGY_FILTERED, PNG_FILTER_ADAPTIVE, 0 },
+};
+
+#define NUM_PROFILES (int) (sizeof(s_profiles) / sizeof(s_profiles[0]))
+
+// number of threads used to compress and decompress image data,
+// 0 for one per processor
+static int s_threads;
+
+// rows between restart points in written images, 0 for none
+static int s_restart_interval;
 
 int is_little_endian(void) {
   int32_t x = 1;
   return *((char *) &x) == 1;
 }
 
-uint32_t byteswap(uint32_t val) {
-  const uint8_t *p = (const uint8_t *) &val;
-  uint32_t result = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
-  return result;
+// Returns true if pixels need to be byteswapped when converting between
+// the in-memory pixel layout and PNG's R,G,B,A byte order
+int need_byteswap(void) {
+#ifdef IMG_RGBA_BYTE_ORDER
+  // pixels are already stored in PNG byte order
+  return 0;
+#else
+  return is_little_endian();
+#endif
+}
+
+void img_set_threads(int threads) {
+  s_threads = threads > 0 ? threads : 0;
+}
+
+void img_set_restart_interval(int rows) {
+  s_restart_interval = rows > 0 ? rows : 0;
+}
+
+// Returns the number of threads to use to compress or decompress
+// image data
+static unsigned io_threads(void) {
+  if (s_threads > 0) {
+    return s_threads;
+  }
+  long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+  return nprocs > 0 ? (unsigned) nprocs : 1;
 }
 
 int img_init(struct Image *img, int32_t width, int32_t height) {
@@ -26,132 +80,1129 @@ int img_init(struct Image *img, int32_t width, int32_t height) {
 
   // initialize every pixel to opaque black
   for (int32_t i = 0; i < num_pixels; i++) {
-    pixel_data[i] = 0x000000FFU;
+    pixel_data[i] = 0xFFU << IMG_A_SHIFT;
   }
 
   // success
   img->width = width;
   img->height = height;
+  img->stride = width;
   img->data = pixel_data;
+  img->mapping = NULL;
+  img->mapping_size = 0;
+  img->is_view = 0;
   return IMG_SUCCESS;
 }
 
-int img_read(const char *filename, struct Image *img) {
-  if (!png_init_called) {
-    png_init(0, 0);
-    png_init_called = 1;
+int img_view(struct Image *img, struct Image *view,
+             int32_t x, int32_t y, int32_t width, int32_t height) {
+  if (x < 0 || y < 0 || width <= 0 || height <= 0 ||
+      (int64_t) x + width > img->width || (int64_t) y + height > img->height) {
+    return IMG_ERR_INVALID_ARGUMENT;
+  }
+
+  view->width = width;
+  view->height = height;
+  view->stride = img->stride;
+  view->data = img_row(img, y) + x;
+  view->is_view = 1;
+  view->mapping = NULL;
+  view->mapping_size = 0;
+  return IMG_SUCCESS;
+}
+
+// Returns true if the named file has the given extension (ignoring
+// case)
+static int has_extension(const char *filename, const char *ext) {
+  const char *dot = strrchr(filename, '.');
+  return dot != NULL && strcasecmp(dot, ext) == 0;
+}
+
+// Returns true if the named file is a QOI file, going by its
+// extension; every other file is taken to be a PNG file (or a raw
+// image file, see is_rawimg)
+static int is_qoi(const char *filename) {
+  return has_extension(filename, ".qoi");
+}
+
+// Returns true if the named file is a raw image file, going by its
+// extension
+static int is_rawimg(const char *filename) {
+  return has_extension(filename, ".rawimg");
+}
+
+// Returns true if the named file is a tiled image file, going by its
+// extension
+static int is_tileimg(const char *filename) {
+  return has_extension(filename, ".tiles");
+}
+
+// Returns the rawimg byte order of the in-memory pixel layout
+static unsigned rawimg_layout(void) {
+  return need_byteswap() ? RAWIMG_ABGR : RAWIMG_RGBA;
+}
+
+// Read the header of a QOI file, see img_probe
+static int probe_qoi(const char *filename, struct ImageInfo *info) {
+  qoi_t qoi;
+
+  if (qoi_open_file_read(&qoi, filename) != QOI_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  // QOI pixels are always 8-bit RGB or RGBA
+  info->width = qoi.width;
+  info->height = qoi.height;
+  info->color_type = qoi.channels == 4 ? PNG_TRUECOLOR_ALPHA : PNG_TRUECOLOR;
+  info->depth = 8;
+  info->truecolor = 1;
+
+  qoi_close_file(&qoi);
+  return IMG_SUCCESS;
+}
+
+// Read the header of a raw image file, see img_probe
+static int probe_rawimg(const char *filename, struct ImageInfo *info) {
+  rawimg_t raw;
+
+  if (rawimg_open_read(&raw, filename) != RAWIMG_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  // raw image pixels are always 8-bit RGBA
+  info->width = raw.width;
+  info->height = raw.height;
+  info->color_type = PNG_TRUECOLOR_ALPHA;
+  info->depth = 8;
+  info->truecolor = 1;
+
+  rawimg_close(&raw);
+  return IMG_SUCCESS;
+}
+
+// Read the header of a tiled image file, see img_probe
+static int probe_tileimg(const char *filename, struct ImageInfo *info) {
+  tileimg_t tile;
+
+  if (tileimg_open_read(&tile, filename, 1) != TILEIMG_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  // tiled image pixels are always 8-bit RGBA
+  info->width = tile.width;
+  info->height = tile.height;
+  info->color_type = PNG_TRUECOLOR_ALPHA;
+  info->depth = 8;
+  info->truecolor = 1;
+
+  tileimg_close(&tile);
+  return IMG_SUCCESS;
+}
+
+int img_probe(const char *filename, struct ImageInfo *info) {
+  if (is_qoi(filename)) {
+    return probe_qoi(filename, info);
+  }
+  if (is_rawimg(filename)) {
+    return probe_rawimg(filename, info);
+  }
+  if (is_tileimg(filename)) {
+    return probe_tileimg(filename, info);
   }
 
   png_t png;
 
-  if (png_open_file_read(&png, filename) != PNG_NO_ERROR) {
+  // opening the file reads the signature and IHDR chunk, and nothing
+  // more, so the file is read rather than mapped
+  int rc = png_open_file_read(&png, filename);
+
+  // an interlaced PNG (or one with a color type and bit depth PNG does
+  // not allow) has a header, but pixels pnglite cannot decode; the file
+  // has been closed again
+  if (rc != PNG_NO_ERROR && rc != PNG_NOT_SUPPORTED) {
     return IMG_ERR_COULD_NOT_OPEN;
   }
 
-  // only allow truecolor 8bpp images
-  if (!(png.color_type == PNG_TRUECOLOR && png.bpp == 3) &&
-      !(png.color_type == PNG_TRUECOLOR_ALPHA && png.bpp == 4)) {
+  info->width = png.width;
+  info->height = png.height;
+  info->color_type = png.color_type;
+  info->depth = png.depth;
+  info->truecolor = rc == PNG_NO_ERROR;
+
+  if (rc == PNG_NO_ERROR) {
     png_close_file(&png);
+  }
+  return IMG_SUCCESS;
+}
+
+// Open the named PNG file for reading. pnglite expands the pixels of
+// every color type and bit depth to RGBA, but not interlaced images.
+static int open_png(const char *filename, png_t *png) {
+  // the file is mapped, so pnglite inflates the image data straight from
+  // the page cache without copying it
+  int rc = png_open_file_map(png, filename);
+
+  if (rc == PNG_NOT_SUPPORTED) {
     return IMG_ERR_NOT_TRUECOLOR;
   }
-  
-  int num_pixels = png.width * png.height;
+  if (rc != PNG_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
 
-  // allocate buffer for pixel data in truecolor RGBA format
-  uint32_t *pixel_data = (uint32_t *) malloc(num_pixels * sizeof(uint32_t));
+  return IMG_SUCCESS;
+}
 
-  if (png.color_type == PNG_TRUECOLOR) {
-    // PNG pixel data is in RGB form, expand it to add the alpha channel
+int img_io_init(struct ImgIoContext *ctx) {
+  ctx->cache = png_cache_create(0, 0);
+  return ctx->cache != NULL ? IMG_SUCCESS : IMG_ERR_MALLOC_FAILED;
+}
 
-    unsigned char *pixel_data_raw = (unsigned char *) malloc(num_pixels * 3);
-    if (png_get_data(&png, pixel_data_raw) != PNG_NO_ERROR) {
-      png_close_file(&png);
-      free(pixel_data);
-      return IMG_ERR_MALLOC_FAILED;
-    }
+void img_io_cleanup(struct ImgIoContext *ctx) {
+  png_cache_destroy(ctx->cache);
+  ctx->cache = NULL;
+}
 
-    for (int i = 0; i < num_pixels; i++) {
-      unsigned char r = pixel_data_raw[i*3 + 0];
-      unsigned char g = pixel_data_raw[i*3 + 1];
-      unsigned char b = pixel_data_raw[i*3 + 2];
-      unsigned char a = 255;
+int img_read(const char *filename, struct Image *img) {
+  return img_read_ctx(NULL, filename, img);
+}
 
-      pixel_data[i] = (r << 24) | (g << 16) | (b << 8) | a;
-    }
+// Read a whole QOI file, see img_read
+static int read_qoi(const char *filename, struct Image *img) {
+  qoi_t qoi;
 
-    free(pixel_data_raw);
-  } else {
-    // PNG pixel data is already in the correct format,
-    // except that the RGBA data is in big-endian form, so we
-    // need to byteswap if on a little endian system
-    if (png_get_data(&png, (unsigned char *) pixel_data) != PNG_NO_ERROR) {
-      png_close_file(&png);
-      free(pixel_data);
+  if (qoi_open_file_read(&qoi, filename) != QOI_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  uint32_t *pixel_data = (uint32_t *) malloc((size_t) qoi.width * qoi.height * sizeof(uint32_t));
+  if (pixel_data == NULL) {
+    qoi_close_file(&qoi);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  // the decoder writes R,G,B,A bytes, byteswapped as needed, like pnglite
+  if (qoi_read_rows(&qoi, (unsigned char *) pixel_data, qoi.height, need_byteswap()) != (int) qoi.height) {
+    qoi_close_file(&qoi);
+    free(pixel_data);
+    return IMG_ERR_COULD_NOT_READ;
+  }
+
+  img->data = pixel_data;
+  img->width = qoi.width;
+  img->height = qoi.height;
+  img->stride = img->width;
+  img->mapping = NULL;
+  img->mapping_size = 0;
+  img->is_view = 0;
+
+  qoi_close_file(&qoi);
+  return IMG_SUCCESS;
+}
+
+// Read a whole raw image file, see img_read
+static int read_rawimg(const char *filename, struct Image *img) {
+  rawimg_t raw;
+
+  if (rawimg_open_read(&raw, filename) != RAWIMG_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  // rows which are already in the in-memory pixel layout are used
+  // where they are in the mapping, padding and all
+  if (raw.byte_order == rawimg_layout()) {
+    void *mapping;
+    size_t mapping_size;
+    if (rawimg_map(&raw, &mapping, &mapping_size) != RAWIMG_NO_ERROR) {
+      rawimg_close(&raw);
       return IMG_ERR_MALLOC_FAILED;
     }
 
-    if (is_little_endian()) {
-      for (int i = 0; i < num_pixels; i++) {
-        pixel_data[i] = byteswap(pixel_data[i]);
-      }
-    }
+    img->data = (uint32_t *) ((unsigned char *) mapping + raw.data_offset);
+    img->width = raw.width;
+    img->height = raw.height;
+    img->stride = raw.stride / 4;
+    img->mapping = mapping;
+    img->mapping_size = mapping_size;
+    img->is_view = 0;
+
+    rawimg_close(&raw);
+    return IMG_SUCCESS;
+  }
+
+  // otherwise they are read into a buffer, byteswapping if needed
+  uint32_t *pixel_data = (uint32_t *) malloc((size_t) raw.width * raw.height * sizeof(uint32_t));
+  if (pixel_data == NULL) {
+    rawimg_close(&raw);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  if (rawimg_read_rows(&raw, (unsigned char *) pixel_data, raw.height, rawimg_layout()) != (int) raw.height) {
+    rawimg_close(&raw);
+    free(pixel_data);
+    return IMG_ERR_COULD_NOT_READ;
+  }
+
+  img->data = pixel_data;
+  img->width = raw.width;
+  img->height = raw.height;
+  img->stride = img->width;
+  img->mapping = NULL;
+  img->mapping_size = 0;
+  img->is_view = 0;
+
+  rawimg_close(&raw);
+  return IMG_SUCCESS;
+}
+
+// Read a rectangle of a tiled image file, decoding only the tiles
+// which overlap it, see img_read_region. The whole image is a
+// rectangle too, for img_read.
+static int read_tileimg(const char *filename, struct Image *img,
+                        int32_t x, int32_t y, int32_t width, int32_t height) {
+  tileimg_t tile;
+
+  if (tileimg_open_read(&tile, filename, io_threads()) != TILEIMG_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  if (width < 0) {
+    width = tile.width;
+    height = tile.height;
+  } else if (x < 0 || y < 0 || width <= 0 || height <= 0 ||
+             (int64_t) x + width > tile.width || (int64_t) y + height > tile.height) {
+    tileimg_close(&tile);
+    return IMG_ERR_INVALID_ARGUMENT;
+  }
+
+  uint32_t *pixel_data = (uint32_t *) malloc((size_t) width * height * sizeof(uint32_t));
+  if (pixel_data == NULL) {
+    tileimg_close(&tile);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  // as with PNG, each pixel is byteswapped as it is stored if needed
+  if (tileimg_read_region(&tile, (unsigned char *) pixel_data, x, y, width, height, need_byteswap()) != TILEIMG_NO_ERROR) {
+    tileimg_close(&tile);
+    free(pixel_data);
+    return IMG_ERR_COULD_NOT_READ;
+  }
+
+  img->data = pixel_data;
+  img->width = width;
+  img->height = height;
+  img->stride = img->width;
+  img->mapping = NULL;
+  img->mapping_size = 0;
+  img->is_view = 0;
+
+  tileimg_close(&tile);
+  return IMG_SUCCESS;
+}
+
+int img_read_ctx(struct ImgIoContext *ctx, const char *filename, struct Image *img) {
+  // QOI, raw and tiled image files have no zlib streams or buffers
+  // worth keeping in the context
+  if (is_qoi(filename)) {
+    return read_qoi(filename, img);
+  }
+  if (is_rawimg(filename)) {
+    return read_rawimg(filename, img);
+  }
+  if (is_tileimg(filename)) {
+    return read_tileimg(filename, img, 0, 0, -1, -1);
+  }
+
+  png_t png;
+
+  int rc = open_png(filename, &png);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  if (ctx != NULL) {
+    png_set_cache(&png, ctx->cache);
+  }
+
+  int num_pixels = png.width * png.height;
+
+  // allocate buffer for pixel data in RGBA format
+  uint32_t *pixel_data = (uint32_t *) malloc(num_pixels * sizeof(uint32_t));
+  if (pixel_data == NULL) {
+    png_close_file(&png);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  png_set_threads(&png, io_threads());
+
+  // pnglite expands RGB pixels to RGBA as it unfilters each row, and
+  // byteswaps each pixel if the in-memory layout requires it
+  rc = png_get_data_rgba(&png, (unsigned char *) pixel_data, need_byteswap());
+  if (rc != PNG_NO_ERROR) {
+    png_close_file(&png);
+    free(pixel_data);
+    return rc == PNG_MEMORY_ERROR ? IMG_ERR_MALLOC_FAILED : IMG_ERR_COULD_NOT_READ;
   }
 
   // communicate pixel data and image dimensions to caller
   img->data = pixel_data;
   img->width = png.width;
   img->height = png.height;
+  img->stride = img->width;
+  img->mapping = NULL;
+  img->mapping_size = 0;
+  img->is_view = 0;
 
   png_close_file(&png);
 
   return IMG_SUCCESS;
 }
 
-int img_write(const char *filename, struct Image *img) {
-  if (!png_init_called) {
-    png_init(0, 0);
-    png_init_called = 1;
+// Read a QOI file squashed, see img_read_squashed. Every row has to be
+// decoded, but only one is in memory at a time.
+static int read_qoi_squashed(const char *filename, struct Image *img, int32_t xfac, int32_t yfac) {
+  qoi_t qoi;
+
+  if (qoi_open_file_read(&qoi, filename) != QOI_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
   }
 
-  png_t png;
+  int32_t width = qoi.width / xfac;
+  int32_t height = qoi.height / yfac;
+
+  uint32_t *pixel_data = (uint32_t *) malloc((size_t) width * height * sizeof(uint32_t));
+  uint32_t *row = (uint32_t *) malloc(qoi.width * sizeof(uint32_t));
+  if (pixel_data == NULL || row == NULL) {
+    qoi_close_file(&qoi);
+    free(pixel_data);
+    free(row);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  int rc = IMG_SUCCESS;
+  for (int32_t y = 0; y < (int32_t) qoi.height; y++) {
+    if (qoi_read_rows(&qoi, (unsigned char *) row, 1, need_byteswap()) != 1) {
+      rc = IMG_ERR_COULD_NOT_READ;
+      break;
+    }
+    if (y % yfac == 0 && y / yfac < height) {
+      uint32_t *out = pixel_data + (size_t) (y / yfac) * width;
+      for (int32_t x = 0; x < width; x++) {
+        out[x] = row[x * xfac];
+      }
+    }
+  }
 
-  if (png_open_file_write(&png, filename) != PNG_NO_ERROR) {
+  free(row);
+  qoi_close_file(&qoi);
+
+  if (rc != IMG_SUCCESS) {
+    free(pixel_data);
+    return rc;
+  }
+
+  img->data = pixel_data;
+  img->width = width;
+  img->height = height;
+  img->stride = img->width;
+  img->mapping = NULL;
+  img->mapping_size = 0;
+  img->is_view = 0;
+  return IMG_SUCCESS;
+}
+
+// Read a raw image file squashed, see img_read_squashed. The file is
+// mapped, so only the pages holding kept pixels are ever read.
+static int read_rawimg_squashed(const char *filename, struct Image *img, int32_t xfac, int32_t yfac) {
+  rawimg_t raw;
+
+  if (rawimg_open_read(&raw, filename) != RAWIMG_NO_ERROR) {
     return IMG_ERR_COULD_NOT_OPEN;
   }
 
-  // if this is a little endian system, we need to byteswap
-  // every uint32_t so that it can be written in big-endian order
-  // (which is what PNG requires)
+  void *mapping;
+  size_t mapping_size;
+  if (rawimg_map(&raw, &mapping, &mapping_size) != RAWIMG_NO_ERROR) {
+    rawimg_close(&raw);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  int32_t width = raw.width / xfac;
+  int32_t height = raw.height / yfac;
+  int swap = raw.byte_order != rawimg_layout();
+  const unsigned char *rows = (const unsigned char *) mapping + raw.data_offset;
+
+  uint32_t *pixel_data = (uint32_t *) malloc((size_t) width * height * sizeof(uint32_t));
+  if (pixel_data == NULL) {
+    rawimg_unmap(mapping, mapping_size);
+    rawimg_close(&raw);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  for (int32_t y = 0; y < height; y++) {
+    const uint32_t *row = (const uint32_t *) (rows + (size_t) y * yfac * raw.stride);
+    uint32_t *out = pixel_data + (size_t) y * width;
+    for (int32_t x = 0; x < width; x++) {
+      uint32_t pixel = row[x * xfac];
+      out[x] = swap ? __builtin_bswap32(pixel) : pixel;
+    }
+  }
+
+  rawimg_unmap(mapping, mapping_size);
+  rawimg_close(&raw);
+
+  img->data = pixel_data;
+  img->width = width;
+  img->height = height;
+  img->stride = img->width;
+  img->mapping = NULL;
+  img->mapping_size = 0;
+  img->is_view = 0;
+  return IMG_SUCCESS;
+}
 
-  uint32_t *data_to_write = img->data;
-  int need_byteswap = is_little_endian();
+// Read a tiled image file squashed, see img_read_squashed. Each row of
+// tiles is decoded (in parallel) into a buffer and sampled from there.
+static int read_tileimg_squashed(const char *filename, struct Image *img, int32_t xfac, int32_t yfac) {
+  tileimg_t tile;
 
-  if (need_byteswap) {
-    data_to_write = (uint32_t *) malloc(img->width * img->height * sizeof(uint32_t));
-    if (data_to_write == NULL) {
-      png_close_file(&png);
+  if (tileimg_open_read(&tile, filename, io_threads()) != TILEIMG_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  int32_t width = tile.width / xfac;
+  int32_t height = tile.height / yfac;
+
+  uint32_t *pixel_data = (uint32_t *) malloc((size_t) width * height * sizeof(uint32_t));
+  uint32_t *band = (uint32_t *) malloc((size_t) tile.width * tile.tile_size * sizeof(uint32_t));
+  if (pixel_data == NULL || band == NULL) {
+    tileimg_close(&tile);
+    free(pixel_data);
+    free(band);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  int rc = IMG_SUCCESS;
+  for (int32_t first = 0; first < height * yfac; first += tile.tile_size) {
+    int n = tileimg_read_rows(&tile, (unsigned char *) band, tile.tile_size, need_byteswap());
+    if (n <= 0) {
+      rc = IMG_ERR_COULD_NOT_READ;
+      break;
+    }
+    // the first kept row at or after the first row of the band
+    for (int32_t y = (first + yfac - 1) / yfac * yfac; y < first + n && y / yfac < height; y += yfac) {
+      const uint32_t *row = band + (size_t) (y - first) * tile.width;
+      uint32_t *out = pixel_data + (size_t) (y / yfac) * width;
+      for (int32_t x = 0; x < width; x++) {
+        out[x] = row[x * xfac];
+      }
+    }
+  }
+
+  free(band);
+  tileimg_close(&tile);
+
+  if (rc != IMG_SUCCESS) {
+    free(pixel_data);
+    return rc;
+  }
+
+  img->data = pixel_data;
+  img->width = width;
+  img->height = height;
+  img->stride = img->width;
+  img->mapping = NULL;
+  img->mapping_size = 0;
+  img->is_view = 0;
+  return IMG_SUCCESS;
+}
+
+int img_read_squashed(const char *filename, struct Image *img, int32_t xfac, int32_t yfac) {
+  if (xfac < 1 || yfac < 1) {
+    return IMG_ERR_INVALID_ARGUMENT;
+  }
+
+  if (is_qoi(filename)) {
+    return read_qoi_squashed(filename, img, xfac, yfac);
+  }
+  if (is_rawimg(filename)) {
+    return read_rawimg_squashed(filename, img, xfac, yfac);
+  }
+  if (is_tileimg(filename)) {
+    return read_tileimg_squashed(filename, img, xfac, yfac);
+  }
+
+  png_t png;
+
+  int rc = open_png(filename, &png);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  int32_t width = png.width / xfac;
+  int32_t height = png.height / yfac;
+
+  // only the squashed image is ever allocated
+  if ((uint64_t) width * height > SIZE_MAX / sizeof(uint32_t)) {
+    png_close_file(&png);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  uint32_t *pixel_data = (uint32_t *) malloc((size_t) width * height * sizeof(uint32_t));
+  if (pixel_data == NULL) {
+    png_close_file(&png);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  if (png_get_data_rgba_sampled(&png, (unsigned char *) pixel_data, xfac, yfac, need_byteswap()) != PNG_NO_ERROR) {
+    png_close_file(&png);
+    free(pixel_data);
+    return IMG_ERR_COULD_NOT_READ;
+  }
+
+  img->data = pixel_data;
+  img->width = width;
+  img->height = height;
+  img->stride = img->width;
+  img->mapping = NULL;
+  img->mapping_size = 0;
+  img->is_view = 0;
+
+  png_close_file(&png);
+
+  return IMG_SUCCESS;
+}
+
+int img_read_begin(const char *filename, struct ImageReader *reader) {
+  if (is_qoi(filename)) {
+    qoi_t *qoi = (qoi_t *) malloc(sizeof(qoi_t));
+    if (qoi == NULL) {
       return IMG_ERR_MALLOC_FAILED;
     }
+    if (qoi_open_file_read(qoi, filename) != QOI_NO_ERROR) {
+      free(qoi);
+      return IMG_ERR_COULD_NOT_OPEN;
+    }
+
+    reader->width = qoi->width;
+    reader->height = qoi->height;
+    reader->row = 0;
+    reader->png = NULL;
+    reader->qoi = qoi;
+    reader->raw = NULL;
+    reader->tiles = NULL;
+    return IMG_SUCCESS;
+  }
+
+  if (is_rawimg(filename)) {
+    rawimg_t *raw = (rawimg_t *) malloc(sizeof(rawimg_t));
+    if (raw == NULL) {
+      return IMG_ERR_MALLOC_FAILED;
+    }
+    if (rawimg_open_read(raw, filename) != RAWIMG_NO_ERROR) {
+      free(raw);
+      return IMG_ERR_COULD_NOT_OPEN;
+    }
+
+    reader->width = raw->width;
+    reader->height = raw->height;
+    reader->row = 0;
+    reader->png = NULL;
+    reader->qoi = NULL;
+    reader->raw = raw;
+    reader->tiles = NULL;
+    return IMG_SUCCESS;
+  }
+
+  if (is_tileimg(filename)) {
+    tileimg_t *tile = (tileimg_t *) malloc(sizeof(tileimg_t));
+    if (tile == NULL) {
+      return IMG_ERR_MALLOC_FAILED;
+    }
+    if (tileimg_open_read(tile, filename, io_threads()) != TILEIMG_NO_ERROR) {
+      free(tile);
+      return IMG_ERR_COULD_NOT_OPEN;
+    }
+
+    reader->width = tile->width;
+    reader->height = tile->height;
+    reader->row = 0;
+    reader->png = NULL;
+    reader->qoi = NULL;
+    reader->raw = NULL;
+    reader->tiles = tile;
+    return IMG_SUCCESS;
+  }
+
+  png_t *png = (png_t *) malloc(sizeof(png_t));
+  if (png == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  int rc = open_png(filename, png);
+  if (rc != IMG_SUCCESS) {
+    free(png);
+    return rc;
+  }
+
+  reader->width = png->width;
+  reader->height = png->height;
+  reader->row = 0;
+  reader->png = png;
+  reader->qoi = NULL;
+  reader->raw = NULL;
+  reader->tiles = NULL;
+  return IMG_SUCCESS;
+}
+
+int img_read_rows(struct ImageReader *reader, uint32_t *rows, int32_t max_rows) {
+  if (max_rows <= 0) {
+    return 0;
+  }
+
+  // as with img_read, pnglite expands and byteswaps each row as needed
+  int n;
+  if (reader->qoi != NULL) {
+    n = qoi_read_rows(reader->qoi, (unsigned char *) rows, max_rows, need_byteswap());
+  } else if (reader->raw != NULL) {
+    n = rawimg_read_rows(reader->raw, (unsigned char *) rows, max_rows, rawimg_layout());
+  } else if (reader->tiles != NULL) {
+    n = tileimg_read_rows(reader->tiles, (unsigned char *) rows, max_rows, need_byteswap());
+  } else {
+    n = png_read_rows_rgba(reader->png, (unsigned char *) rows, max_rows, need_byteswap());
+  }
+  if (n < 0) {
+    return IMG_ERR_COULD_NOT_READ;
+  }
+
+  reader->row += n;
+  return n;
+}
+
+void img_read_end(struct ImageReader *reader) {
+  if (reader->qoi != NULL) {
+    qoi_close_file(reader->qoi);
+    free(reader->qoi);
+    reader->qoi = NULL;
+    return;
+  }
+  if (reader->raw != NULL) {
+    rawimg_close(reader->raw);
+    free(reader->raw);
+    reader->raw = NULL;
+    return;
+  }
+  if (reader->tiles != NULL) {
+    tileimg_close(reader->tiles);
+    free(reader->tiles);
+    reader->tiles = NULL;
+    return;
+  }
+
+  png_t *png = reader->png;
+
+  png_read_rows_end(png);
+  png_close_file(png);
+  free(png);
+  reader->png = NULL;
+}
+
+// rows read at a time by img_read_region from files which can only be
+// decoded from the top
+#define REGION_BLOCK_ROWS 64
+
+int img_read_region(const char *filename, struct Image *img,
+                    int32_t x, int32_t y, int32_t width, int32_t height) {
+  if (x < 0 || y < 0 || width <= 0 || height <= 0) {
+    return IMG_ERR_INVALID_ARGUMENT;
+  }
+
+  if (is_tileimg(filename)) {
+    return read_tileimg(filename, img, x, y, width, height);
+  }
+
+  // other files are read down to the bottom of the region, a block of
+  // rows at a time, keeping just the region
+  struct ImageReader reader;
+
+  int rc = img_read_begin(filename, &reader);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  if ((int64_t) x + width > reader.width || (int64_t) y + height > reader.height) {
+    img_read_end(&reader);
+    return IMG_ERR_INVALID_ARGUMENT;
+  }
+
+  uint32_t *pixel_data = (uint32_t *) malloc((size_t) width * height * sizeof(uint32_t));
+  uint32_t *block = (uint32_t *) malloc((size_t) reader.width * REGION_BLOCK_ROWS * sizeof(uint32_t));
+  if (pixel_data == NULL || block == NULL) {
+    img_read_end(&reader);
+    free(pixel_data);
+    free(block);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  while (rc == IMG_SUCCESS && reader.row < y + height) {
+    int32_t first = reader.row;
+    int32_t max_rows = y + height - first < REGION_BLOCK_ROWS ? y + height - first : REGION_BLOCK_ROWS;
+    int n = img_read_rows(&reader, block, max_rows);
+    if (n <= 0) {
+      rc = IMG_ERR_COULD_NOT_READ;
+      break;
+    }
+    for (int32_t row = first > y ? first : y; row < first + n; row++) {
+      memcpy(pixel_data + (size_t) (row - y) * width, block + (size_t) (row - first) * reader.width + x,
+             width * sizeof(uint32_t));
+    }
+  }
+
+  free(block);
+  img_read_end(&reader);
+
+  if (rc != IMG_SUCCESS) {
+    free(pixel_data);
+    return rc;
+  }
 
-    int32_t num_pixels = img->width * img->height;
-    for (int32_t i = 0; i < num_pixels; i++) {
-      data_to_write[i] = byteswap(img->data[i]);
+  img->data = pixel_data;
+  img->width = width;
+  img->height = height;
+  img->stride = img->width;
+  img->mapping = NULL;
+  img->mapping_size = 0;
+  img->is_view = 0;
+  return IMG_SUCCESS;
+}
+
+int img_profile_from_name(const char *name) {
+  for (int i = 0; i < NUM_PROFILES; i++) {
+    if (strcmp(s_profiles[i].name, name) == 0) {
+      return i;
     }
   }
+  return -1;
+}
+
+int img_write(const char *filename, struct Image *img) {
+  return img_write_ex(filename, img, IMG_PROFILE_BALANCED);
+}
+
+// Open the named PNG file for writing, and apply the settings of the
+// given encode profile
+static int open_for_write(const char *filename, png_t *png, int profile) {
+  if (profile < 0 || profile >= NUM_PROFILES) {
+    return IMG_ERR_INVALID_ARGUMENT;
+  }
+
+  if (png_open_file_write(png, filename) != PNG_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  const struct EncodeProfile *p = &s_profiles[profile];
+  png_set_filter(png, p->filter);
+  png_set_compression(png, p->level, p->strategy, p->idat_size);
+  png_set_threads(png, io_threads());
+  png_set_restart_interval(png, s_restart_interval);
+  return IMG_SUCCESS;
+}
+
+int img_write_ex(const char *filename, struct Image *img, int profile) {
+  return img_write_ctx(NULL, filename, img, profile);
+}
+
+// Number of rows of an image that can be passed to an encoder at once:
+// all of them if they are contiguous, otherwise one
+static int32_t rows_per_write(const struct Image *img) {
+  return img->stride == img->width ? img->height : 1;
+}
 
-  int rc = png_set_data(&png, img->width, img->height, 8, PNG_TRUECOLOR_ALPHA, (unsigned char *) data_to_write);
+// Write a whole QOI file, see img_write
+static int write_qoi(const char *filename, struct Image *img) {
+  qoi_t qoi;
+
+  if (qoi_open_file_write(&qoi, filename, img->width, img->height, 4) != QOI_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  int32_t step = rows_per_write(img);
+  int success = 1;
+  for (int32_t row = 0; row < img->height && success; row += step) {
+    success = qoi_write_rows(&qoi, (unsigned char *) img_row(img, row), step, need_byteswap()) == QOI_NO_ERROR;
+  }
+  success = success && qoi_write_end(&qoi) == QOI_NO_ERROR;
+
+  if (qoi_close_file(&qoi) != QOI_NO_ERROR) {
+    success = 0;
+  }
+
+  return success ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+}
+
+// Write a whole raw image file, see img_write. The pixels are written
+// in the in-memory pixel layout, header and all in one system call
+// unless the rows are not contiguous.
+static int write_rawimg(const char *filename, struct Image *img) {
+  rawimg_t raw;
+
+  if (rawimg_open_write(&raw, filename, img->width, img->height, rawimg_layout()) != RAWIMG_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  int32_t step = rows_per_write(img);
+  int success = 1;
+  for (int32_t row = 0; row < img->height && success; row += step) {
+    success = rawimg_write_rows(&raw, (unsigned char *) img_row(img, row), step, rawimg_layout()) == RAWIMG_NO_ERROR;
+  }
+  success = success && rawimg_write_end(&raw) == RAWIMG_NO_ERROR;
+
+  if (rawimg_close(&raw) != RAWIMG_NO_ERROR) {
+    success = 0;
+  }
+
+  return success ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+}
+
+// Write a whole tiled image file, see img_write. The tiles are
+// compressed in parallel, at the profile's zlib compression level.
+static int write_tileimg(const char *filename, struct Image *img, int profile) {
+  tileimg_t tile;
+
+  if (profile < 0 || profile >= NUM_PROFILES) {
+    return IMG_ERR_INVALID_ARGUMENT;
+  }
+
+  if (tileimg_open_write(&tile, filename, img->width, img->height, s_profiles[profile].level, io_threads()) != TILEIMG_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  int32_t step = rows_per_write(img);
+  int success = 1;
+  for (int32_t row = 0; row < img->height && success; row += step) {
+    success = tileimg_write_rows(&tile, (unsigned char *) img_row(img, row), step, need_byteswap()) == TILEIMG_NO_ERROR;
+  }
+  success = success && tileimg_write_end(&tile) == TILEIMG_NO_ERROR;
+
+  if (tileimg_close(&tile) != TILEIMG_NO_ERROR) {
+    success = 0;
+  }
+
+  return success ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+}
+
+int img_write_ctx(struct ImgIoContext *ctx, const char *filename, struct Image *img, int profile) {
+  if (is_tileimg(filename)) {
+    return write_tileimg(filename, img, profile);
+  }
+
+  // QOI and raw image files have no settings, so the profile only
+  // needs to be valid
+  if (is_qoi(filename) || is_rawimg(filename)) {
+    if (profile < 0 || profile >= NUM_PROFILES) {
+      return IMG_ERR_INVALID_ARGUMENT;
+    }
+    return is_qoi(filename) ? write_qoi(filename, img) : write_rawimg(filename, img);
+  }
+
+  png_t png;
+
+  int rc = open_for_write(filename, &png, profile);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  if (ctx != NULL) {
+    png_set_cache(&png, ctx->cache);
+  }
+
+  // pnglite converts each row to PNG byte order (byteswapping if the
+  // in-memory pixel layout requires it), filters it, and compresses it,
+  // so no copy of the pixel data is made, even of a view
+  rc = png_set_data_rgba_stride(&png, img->width, img->height, (unsigned char *) img->data,
+                                (size_t) img->stride * sizeof(uint32_t), need_byteswap());
   int success = (rc == PNG_NO_ERROR);
 
   png_close_file(&png);
-  if (need_byteswap) {
-    free(data_to_write);
+
+  return success ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+}
+
+int img_write_begin(const char *filename, struct ImageWriter *writer,
+                    int32_t width, int32_t height, int profile) {
+  if (is_qoi(filename)) {
+    if (profile < 0 || profile >= NUM_PROFILES) {
+      return IMG_ERR_INVALID_ARGUMENT;
+    }
+
+    qoi_t *qoi = (qoi_t *) malloc(sizeof(qoi_t));
+    if (qoi == NULL) {
+      return IMG_ERR_MALLOC_FAILED;
+    }
+    if (qoi_open_file_write(qoi, filename, width, height, 4) != QOI_NO_ERROR) {
+      free(qoi);
+      return IMG_ERR_COULD_NOT_OPEN;
+    }
+
+    writer->width = width;
+    writer->height = height;
+    writer->row = 0;
+    writer->png = NULL;
+    writer->qoi = qoi;
+    writer->raw = NULL;
+    writer->tiles = NULL;
+    return IMG_SUCCESS;
+  }
+
+  if (is_rawimg(filename)) {
+    if (profile < 0 || profile >= NUM_PROFILES) {
+      return IMG_ERR_INVALID_ARGUMENT;
+    }
+
+    rawimg_t *raw = (rawimg_t *) malloc(sizeof(rawimg_t));
+    if (raw == NULL) {
+      return IMG_ERR_MALLOC_FAILED;
+    }
+    if (rawimg_open_write(raw, filename, width, height, rawimg_layout()) != RAWIMG_NO_ERROR) {
+      free(raw);
+      return IMG_ERR_COULD_NOT_OPEN;
+    }
+
+    writer->width = width;
+    writer->height = height;
+    writer->row = 0;
+    writer->png = NULL;
+    writer->qoi = NULL;
+    writer->raw = raw;
+    writer->tiles = NULL;
+    return IMG_SUCCESS;
+  }
+
+  if (is_tileimg(filename)) {
+    if (profile < 0 || profile >= NUM_PROFILES) {
+      return IMG_ERR_INVALID_ARGUMENT;
+    }
+
+    tileimg_t *tile = (tileimg_t *) malloc(sizeof(tileimg_t));
+    if (tile == NULL) {
+      return IMG_ERR_MALLOC_FAILED;
+    }
+    if (tileimg_open_write(tile, filename, width, height, s_profiles[profile].level, io_threads()) != TILEIMG_NO_ERROR) {
+      free(tile);
+      return IMG_ERR_COULD_NOT_OPEN;
+    }
+
+    writer->width = width;
+    writer->height = height;
+    writer->row = 0;
+    writer->png = NULL;
+    writer->qoi = NULL;
+    writer->raw = NULL;
+    writer->tiles = tile;
+    return IMG_SUCCESS;
+  }
+
+  png_t *png = (png_t *) malloc(sizeof(png_t));
+  if (png == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  int rc = open_for_write(filename, png, profile);
+  if (rc != IMG_SUCCESS) {
+    free(png);
+    return rc;
+  }
+
+  if (png_write_begin(png, width, height, 8, PNG_TRUECOLOR_ALPHA) != PNG_NO_ERROR) {
+    png_close_file(png);
+    free(png);
+    return IMG_ERR_COULD_NOT_WRITE;
   }
 
+  writer->width = width;
+  writer->height = height;
+  writer->row = 0;
+  writer->png = png;
+  writer->qoi = NULL;
+  writer->raw = NULL;
+  writer->tiles = NULL;
+  return IMG_SUCCESS;
+}
+
+int img_write_rows(struct ImageWriter *writer, uint32_t *rows, int32_t num_rows) {
+  if (num_rows < 0) {
+    return IMG_ERR_COULD_NOT_WRITE;
+  }
+
+  // once this fails, pnglite has freed its encoding state, so later
+  // calls (and img_write_end) fail too
+  if (writer->qoi != NULL) {
+    if (qoi_write_rows(writer->qoi, (unsigned char *) rows, num_rows, need_byteswap()) != QOI_NO_ERROR) {
+      return IMG_ERR_COULD_NOT_WRITE;
+    }
+  } else if (writer->raw != NULL) {
+    if (rawimg_write_rows(writer->raw, (unsigned char *) rows, num_rows, rawimg_layout()) != RAWIMG_NO_ERROR) {
+      return IMG_ERR_COULD_NOT_WRITE;
+    }
+  } else if (writer->tiles != NULL) {
+    if (tileimg_write_rows(writer->tiles, (unsigned char *) rows, num_rows, need_byteswap()) != TILEIMG_NO_ERROR) {
+      return IMG_ERR_COULD_NOT_WRITE;
+    }
+  } else if (png_write_rows_rgba(writer->png, (unsigned char *) rows, num_rows, need_byteswap()) != PNG_NO_ERROR) {
+    return IMG_ERR_COULD_NOT_WRITE;
+  }
+
+  writer->row += num_rows;
+  return IMG_SUCCESS;
+}
+
+int img_write_end(struct ImageWriter *writer) {
+  if (writer->qoi != NULL) {
+    int success = (qoi_write_end(writer->qoi) == QOI_NO_ERROR);
+    if (qoi_close_file(writer->qoi) != QOI_NO_ERROR) {
+      success = 0;
+    }
+    free(writer->qoi);
+    writer->qoi = NULL;
+    return success ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+  }
+  if (writer->raw != NULL) {
+    int success = (rawimg_write_end(writer->raw) == RAWIMG_NO_ERROR);
+    if (rawimg_close(writer->raw) != RAWIMG_NO_ERROR) {
+      success = 0;
+    }
+    free(writer->raw);
+    writer->raw = NULL;
+    return success ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+  }
+  if (writer->tiles != NULL) {
+    int success = (tileimg_write_end(writer->tiles) == TILEIMG_NO_ERROR);
+    if (tileimg_close(writer->tiles) != TILEIMG_NO_ERROR) {
+      success = 0;
+    }
+    free(writer->tiles);
+    writer->tiles = NULL;
+    return success ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+  }
+
+  png_t *png = writer->png;
+
+  int success = (png_write_end(png) == PNG_NO_ERROR);
+
+  png_close_file(png);
+  free(png);
+  writer->png = NULL;
+
   return success ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
 }
 
 void img_cleanup( struct Image *img ) {
-  // The data array is the only dynamically-allocated
+  // The data array is the only dynamically-allocated (or mapped)
   // part of the representation of a struct Image
-  free( img->data );
+  if ( img->is_view ) {
+    return;
+  }
+  if ( img->mapping != NULL ) {
+    rawimg_unmap( img->mapping, img->mapping_size );
+  } else {
+    free( img->data );
+  }
 }
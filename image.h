@@ -7,14 +7,101 @@
 #define IMG_ERR_NOT_TRUECOLOR    -2
 #define IMG_ERR_MALLOC_FAILED    -3
 #define IMG_ERR_COULD_NOT_WRITE  -4
+#define IMG_ERR_INVALID_ARGUMENT -5
+#define IMG_ERR_COULD_NOT_READ   -6 // corrupt or truncated image data
+
+// encode profiles for img_write_ex, trading encoding speed for
+// output file size
+#define IMG_PROFILE_STORED       0 // no compression, for scratch files
+#define IMG_PROFILE_FAST         1
+#define IMG_PROFILE_BALANCED     2 // used by img_write
+#define IMG_PROFILE_SMALL        3
+
+// Pixel layout. By default each pixel is a uint32_t whose value is
+// 0xRRGGBBAA, i.e., red is the most significant byte. Building with
+// -DIMG_RGBA_BYTE_ORDER instead keeps each pixel's bytes in PNG order
+// (R, G, B, A at increasing addresses), so that img_read and img_write
+// can hand the pixel buffer to pnglite without byteswapping it.
+// The IMG_*_SHIFT values are the bit positions of each component
+// within a pixel's uint32_t value for the selected layout.
+#if defined(IMG_RGBA_BYTE_ORDER) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define IMG_R_SHIFT              0
+#define IMG_G_SHIFT              8
+#define IMG_B_SHIFT              16
+#define IMG_A_SHIFT              24
+#else
+#define IMG_R_SHIFT              24
+#define IMG_G_SHIFT              16
+#define IMG_B_SHIFT              8
+#define IMG_A_SHIFT              0
+#endif
 
 #ifndef ASM_SOURCE
+#include <stddef.h>
 #include <stdint.h>
 
 struct Image {
   int32_t width;
   int32_t height;
   uint32_t *data;
+  // number of pixels from the start of one row of data to the start
+  // of the next: the width, except for a view (see img_view) or a
+  // mapped raw image file with padded rows
+  int32_t stride;
+  // nonzero if data belongs to another Image, see img_view
+  int32_t is_view;
+  // when data points into a mapped raw image file rather than a
+  // malloc'ed buffer, the mapping (which img_cleanup releases);
+  // otherwise NULL
+  void *mapping;
+  size_t mapping_size;
+};
+
+// Get a pointer to the first pixel of the given row of an image. The
+// pixel at (row, col) is img_row(img, row)[col].
+static inline uint32_t *img_row(const struct Image *img, int32_t row) {
+  return img->data + (size_t) row * img->stride;
+}
+
+// What the header of a PNG file says about its pixels, see img_probe.
+struct ImageInfo {
+  int32_t width;
+  int32_t height;
+  int color_type;   // PNG color type: 0 gray, 2 RGB, 3 palette,
+                    // 4 gray and alpha, 6 RGBA
+  int depth;        // bits per sample (or per palette index)
+  int truecolor;    // nonzero if img_read can decode the pixels,
+                    // which it can for every color type and bit
+                    // depth, but not for an interlaced PNG
+};
+
+// A PNG file being read a block of rows at a time, see img_read_begin.
+struct ImageReader {
+  int32_t width;
+  int32_t height;
+  int32_t row;   // number of rows read so far
+  void *png;     // pnglite state, private to image.c
+  void *qoi;     // QOI decoder state instead, for a QOI file
+  void *raw;     // or raw image state, for a raw image file
+  void *tiles;   // or tiled image state, for a tiled image file
+};
+
+// A PNG file being written a block of rows at a time, see
+// img_write_begin.
+struct ImageWriter {
+  int32_t width;
+  int32_t height;
+  int32_t row;   // number of rows written so far
+  void *png;     // pnglite state, private to image.c
+  void *qoi;     // QOI encoder state instead, for a QOI file
+  void *raw;     // or raw image state, for a raw image file
+  void *tiles;   // or tiled image state, for a tiled image file
+};
+
+// Buffers and zlib streams which are kept between the images read and
+// written with img_read_ctx and img_write_ctx, see img_io_init.
+struct ImgIoContext {
+  void *cache;   // pnglite cache, private to image.c
 };
 
 // Initialize an Image struct instance by creating a pixel
@@ -34,8 +121,66 @@ struct Image {
 //   IMG_ERR_* values
 int img_init(struct Image *img, int32_t width, int32_t height);
 
+// Initialize the specified Image struct instance as a view of a
+// rectangle of another image: the view's pixels are the image's
+// pixels, not a copy, so a transformation can read from a view, or
+// write its output into one, in place. The view is valid for as long
+// as the image is, and img_cleanup does nothing to it.
+//
+// Parameters:
+//   img - pointer to Image (or view) to make a view of
+//   view - pointer to Image instance to initialize
+//   x - left edge of the rectangle
+//   y - top edge of the rectangle
+//   width - width of the rectangle
+//   height - height of the rectangle, which must lie within img
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise IMG_ERR_INVALID_ARGUMENT
+int img_view(struct Image *img, struct Image *view,
+             int32_t x, int32_t y, int32_t width, int32_t height);
+
+// Read just the signature and header of a PNG (or QOI) file, which
+// is enough to check it and to size buffers for it without decoding
+// any pixel data.
+//
+// Parameters:
+//   filename - name of PNG file to probe
+//   info - pointer to ImageInfo struct to fill in
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise IMG_ERR_COULD_NOT_OPEN
+int img_probe(const char *filename, struct ImageInfo *info);
+
 // Read PNG image data from a file and initialize the specified
-// Image struct instance.
+// Image struct instance. PNG files of every color type and bit depth
+// are read: gray, gray and alpha, and palette pixels (with the alpha
+// of a tRNS chunk) are expanded to RGBA, and 16-bit samples keep their
+// most significant 8 bits. Interlaced PNG files are not supported, and
+// give IMG_ERR_NOT_TRUECOLOR.
+//
+// Files whose names end in ".qoi" are read as QOI ("Quite OK Image")
+// files instead, here and in the other img_read and img_write
+// functions. QOI is lossless and much faster to decode and encode
+// than PNG, though the files are bigger, so it suits intermediate
+// files. Encode profiles have no effect on QOI files.
+//
+// Files whose names end in ".rawimg" are uncompressed raw images (see
+// rawimg.h), whose rows are stored as they are laid out in memory.
+// img_read maps such a file rather than reading it, so img->data
+// points into the mapping (which is private: changing the pixels
+// doesn't change the file) and no pixel is touched until it is used,
+// unless the file was written with the other pixel layout. Padded rows
+// stay padded, with img->stride set to match. img_write
+// writes one with a single system call (or one per row, if the rows of
+// the image are not contiguous). Encode profiles have no effect
+// on raw image files either.
+//
+// Files whose names end in ".tiles" are tiled images (see tileimg.h),
+// whose 256x256 tiles are compressed independently. Their tiles are
+// compressed and decompressed on all of the threads set with
+// img_set_threads, and img_read_region decodes only the tiles it
+// needs. The encode profile sets the zlib compression level.
 //
 // Parameters:
 //   filename - name of PNG file to read
@@ -47,8 +192,120 @@ int img_init(struct Image *img, int32_t width, int32_t height);
 //   IMG_ERR_* values
 int img_read(const char *filename, struct Image *img);
 
+// Initialize an ImgIoContext struct instance. Reading or writing many
+// images with one context reuses the buffers and zlib streams of
+// earlier ones instead of allocating and setting up new ones, which
+// is a large part of the cost of reading or writing small images.
+// A context can be used by several threads at once.
+//
+// Parameters:
+//   ctx - pointer to ImgIoContext struct to initialize
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise IMG_ERR_MALLOC_FAILED
+int img_io_init(struct ImgIoContext *ctx);
+
+// Free everything kept by an ImgIoContext. No image may be being read
+// or written with it.
+//
+// Parameters:
+//   ctx - pointer to ImgIoContext struct to clean up
+void img_io_cleanup(struct ImgIoContext *ctx);
+
+// Read PNG image data from a file as img_read does, reusing the
+// buffers and zlib streams kept by a context. The pixel data is
+// allocated (or mapped) as with img_read, and belongs to the caller.
+//
+// Parameters:
+//   ctx - pointer to ImgIoContext struct, or NULL for none
+//   filename - name of PNG file to read
+//   img - pointer to Image struct to initialize with the loaded
+//         image data
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_read_ctx(struct ImgIoContext *ctx, const char *filename, struct Image *img);
+
+// Read PNG image data from a file, squashed by the given factors
+// as imgproc_squash would, and initialize the specified Image struct
+// instance with the squashed image. Only the pixels kept by the
+// squash are converted and stored.
+//
+// Parameters:
+//   filename - name of PNG file to read
+//   img - pointer to Image struct to initialize with the squashed
+//         image data
+//   xfac - factor to divide the width by, at least 1
+//   yfac - factor to divide the height by, at least 1
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_read_squashed(const char *filename, struct Image *img, int32_t xfac, int32_t yfac);
+
+// Read a rectangle of the pixels of an image file, and initialize the
+// specified Image struct instance with just that rectangle. For a
+// tiled image file, only the tiles overlapping the rectangle are
+// decoded; other files are decoded down to its bottom edge, but no
+// more than a block of rows outside the rectangle is kept in memory.
+//
+// Parameters:
+//   filename - name of image file to read
+//   img - pointer to Image struct to initialize with the rectangle
+//   x - left edge of the rectangle
+//   y - top edge of the rectangle
+//   width - width of the rectangle, which must lie within the image
+//   height - height of the rectangle
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_read_region(const char *filename, struct Image *img,
+                    int32_t x, int32_t y, int32_t width, int32_t height);
+
+// Open a PNG file for reading a block of rows at a time with
+// img_read_rows, and initialize the specified ImageReader struct
+// instance with its dimensions. Rows are decoded as they are read,
+// so only the rows passed to img_read_rows need to be in memory.
+//
+// Parameters:
+//   filename - name of PNG file to read
+//   reader - pointer to ImageReader struct to initialize
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_read_begin(const char *filename, struct ImageReader *reader);
+
+// Read the next rows of pixel data from a PNG file opened with
+// img_read_begin, in the same pixel format as img_read.
+//
+// Parameters:
+//   reader - pointer to ImageReader struct
+//   rows - buffer with room for max_rows rows of reader->width pixels
+//   max_rows - maximum number of rows to read
+//
+// Returns:
+//   the number of rows read, which is less than max_rows only at
+//   the end of the image, 0 once all of the rows have been read,
+//   or IMG_ERR_COULD_NOT_READ
+int img_read_rows(struct ImageReader *reader, uint32_t *rows, int32_t max_rows);
+
+// Close a PNG file opened with img_read_begin, whether or not all of
+// its rows have been read.
+//
+// Parameters:
+//   reader - pointer to ImageReader struct to clean up
+void img_read_end(struct ImageReader *reader);
+
 // Write pixel data from specified Image struct instance to the
-// named PNG output file.
+// named PNG output file. The file is written without alpha if every
+// pixel is opaque, and in gray if every pixel is gray, which makes it
+// smaller and quicker to write; img_read reads it back the same.
+// (Files written a block of rows at a time are always RGBA.) Images
+// whose rows are not contiguous, such as views, are written the same
+// way, straight from their rows.
 //
 // Parameters:
 //   filename - name of PNG file to write
@@ -60,10 +317,118 @@ int img_read(const char *filename, struct Image *img);
 //   IMG_ERR_* values
 int img_write(const char *filename, struct Image *img);
 
+// Write pixel data from specified Image struct instance to the
+// named PNG output file, using the specified encode profile.
+//
+// Parameters:
+//   filename - name of PNG file to write
+//   img - pointer to Image struct with the pixel data to write
+//         to a PNG file
+//   profile - one of the IMG_PROFILE_* values
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_write_ex(const char *filename, struct Image *img, int profile);
+
+// Write pixel data to a PNG file as img_write_ex does, reusing the
+// buffers and zlib streams kept by a context.
+//
+// Parameters:
+//   ctx - pointer to ImgIoContext struct, or NULL for none
+//   filename - name of PNG file to write
+//   img - pointer to Image struct with the pixel data to write
+//         to a PNG file
+//   profile - one of the IMG_PROFILE_* values
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_write_ctx(struct ImgIoContext *ctx, const char *filename, struct Image *img, int profile);
+
+// Create a PNG file to be written a block of rows at a time with
+// img_write_rows, and initialize the specified ImageWriter struct
+// instance. Rows are filtered and compressed as they are written,
+// so a program can write rows as it produces them without holding
+// the whole image in memory.
+//
+// Parameters:
+//   filename - name of PNG file to write
+//   writer - pointer to ImageWriter struct to initialize
+//   width - image width (number of pixel columns)
+//   height - image height (number of pixel rows)
+//   profile - one of the IMG_PROFILE_* values
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int img_write_begin(const char *filename, struct ImageWriter *writer,
+                    int32_t width, int32_t height, int profile);
+
+// Write the next rows of pixel data to a PNG file created with
+// img_write_begin.
+//
+// Parameters:
+//   writer - pointer to ImageWriter struct
+//   rows - num_rows rows of writer->width pixels each
+//   num_rows - number of rows to write, at most the number of
+//              rows not yet written
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise IMG_ERR_COULD_NOT_WRITE
+int img_write_rows(struct ImageWriter *writer, uint32_t *rows, int32_t num_rows);
+
+// Finish and close a PNG file created with img_write_begin. This
+// must be called even if writing failed.
+//
+// Parameters:
+//   writer - pointer to ImageWriter struct to clean up
+//
+// Returns:
+//   IMG_SUCCESS if all of the rows were written successfully,
+//   otherwise IMG_ERR_COULD_NOT_WRITE
+int img_write_end(struct ImageWriter *writer);
+
+// Set the number of threads used by img_write and img_write_ex to
+// filter and compress the image data, and by img_read to decompress,
+// unfilter and convert it (in parallel segments for PNG files which
+// have restart points, otherwise as a pipeline).
+//
+// This and img_set_restart_interval are process-wide settings, so set
+// them before doing I/O on several threads. Apart from these, the image
+// I/O functions share no state, and can read and write different images
+// on different threads at the same time.
+//
+// Parameters:
+//   threads - number of threads; 0 (the default) uses one thread
+//             per online processor
+void img_set_threads(int threads);
+
+// Set how often img_write and img_write_ex insert restart points,
+// which allow the image to be decoded in parallel (see
+// png_set_restart_interval). They are listed in a private chunk
+// which other decoders ignore.
+//
+// Parameters:
+//   rows - number of rows between restart points, or 0 (the
+//          default) for none
+void img_set_restart_interval(int rows);
+
+// Look up an encode profile by name ("stored", "fast", "balanced",
+// or "small").
+//
+// Parameters:
+//   name - the name of the profile
+//
+// Returns:
+//   the IMG_PROFILE_* value, or -1 if the name is not recognized
+int img_profile_from_name(const char *name);
+
 // De-allocate the dynamically-allocated memory used in the internal
 // representation of the given Image struct. Note that this function
 // does NOT de-allocate the struct Image instance itself (since allocating
 // Image objects is the responsibility of the program, not this library.)
+// A view has nothing to clean up, since its pixels belong to its image.
 //
 // Parameters:
 //   img - pointer to Image object to clean up
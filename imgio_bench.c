@@ -0,0 +1,172 @@
+/*
+ * Benchmark driver for PNG image encoding: reports the encoded size
+ * and encoding speed for each row filter setting and each encode profile
+ * CSF Assignment 2
+ * Partner 1: Flora Huang (fhuang27@jh.edu)
+ * Partner 2: Jonathan Xue (jxue18@jh.edu)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "pnglite.h"
+#include "image.h"
+
+struct FilterSetting {
+  const char *name;
+  int filter;
+};
+
+static const struct FilterSetting s_filters[] = {
+  { "none", PNG_FILTER_NONE },
+  { "sub", PNG_FILTER_SUB },
+  { "up", PNG_FILTER_UP },
+  { "average", PNG_FILTER_AVERAGE },
+  { "paeth", PNG_FILTER_PAETH },
+  { "adaptive", PNG_FILTER_ADAPTIVE },
+  { NULL, 0 },
+};
+
+static const char *s_profiles[] = { "stored", "fast", "balanced", "small", NULL };
+
+void usage( const char *progname ) {
+  fprintf( stderr, "Usage: %s [-r <reps>] <input img> [<input img>...]\n", progname );
+  exit( 1 );
+}
+
+// Return the current time in seconds from a monotonic clock
+double now_sec( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// pnglite write callback which discards the data, but counts the bytes
+unsigned count_bytes( void *input, size_t size, size_t numel, void *user_pointer ) {
+  (void) input;
+  *(size_t *) user_pointer += size * numel;
+  return numel;
+}
+
+// Returns true if the bytes of each in-memory pixel are in the reverse
+// of PNG byte order (i.e., red is not the first byte)
+int pixels_reversed( void ) {
+  uint32_t pixel = 0xFFU << IMG_R_SHIFT;
+  return *(const uint8_t *) &pixel != 0xFFU;
+}
+
+// Encode img with the given filter setting, storing the encoded size
+// in *out_bytes. Returns the elapsed time in seconds, or a negative
+// value if encoding failed.
+double encode( struct Image *img, int filter, size_t *out_bytes ) {
+  png_t png;
+  *out_bytes = 0;
+
+  double start = now_sec();
+  png_open_write( &png, count_bytes, out_bytes );
+  png_set_filter( &png, filter );
+  int rc = png_set_data_rgba( &png, img->width, img->height, (unsigned char *) img->data,
+                              pixels_reversed() );
+  double elapsed = now_sec() - start;
+
+  return rc == PNG_NO_ERROR ? elapsed : -1.0;
+}
+
+// Write img to the named file with img_write_ex using the given encode
+// profile, storing the size of the file in *out_bytes. Returns the elapsed
+// time in seconds, or a negative value if writing failed.
+double write_profile( struct Image *img, int profile, const char *filename, size_t *out_bytes ) {
+  double start = now_sec();
+  int rc = img_write_ex( filename, img, profile );
+  double elapsed = now_sec() - start;
+
+  struct stat st;
+  if ( rc != IMG_SUCCESS || stat( filename, &st ) != 0 )
+    return -1.0;
+  *out_bytes = st.st_size;
+  return elapsed;
+}
+
+// Report the size and best-of-reps encoding speed for one setting
+void report( const char *filename, const char *kind, const char *name,
+             size_t bytes, double best, double raw_mb ) {
+  char setting[32];
+  snprintf( setting, sizeof( setting ), "%s %s", kind, name );
+  printf( "%-32s %-16s %12zu %10.2f %9.1f\n", filename, setting, bytes, best * 1e3, raw_mb / best );
+}
+
+int main( int argc, char **argv ) {
+  int reps = 3;
+  int first_file = 1;
+
+  if ( argc > 2 && strcmp( argv[1], "-r" ) == 0 ) {
+    reps = atoi( argv[2] );
+    first_file = 3;
+  }
+  if ( reps < 1 || first_file >= argc )
+    usage( argv[0] );
+
+  png_init( 0, 0 );
+
+  // profiles are timed through img_write_ex, so they need a real file
+  char tmp_filename[] = "/tmp/imgio_bench_XXXXXX";
+  int tmp_fd = mkstemp( tmp_filename );
+  if ( tmp_fd < 0 ) {
+    fprintf( stderr, "Error: couldn't create temporary file\n" );
+    return 1;
+  }
+  close( tmp_fd );
+
+  printf( "%-32s %-16s %12s %10s %9s\n", "image", "setting", "bytes", "ms", "MB/s" );
+
+  for ( int f = first_file; f < argc; f++ ) {
+    struct Image img;
+    if ( img_read( argv[f], &img ) != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't read %s\n", argv[f] );
+      unlink( tmp_filename );
+      return 1;
+    }
+    double raw_mb = (double) img.width * img.height * 4 / 1e6;
+
+    for ( int i = 0; s_filters[i].name != NULL; i++ ) {
+      size_t bytes = 0;
+      double best = 1e30;
+      for ( int r = 0; r < reps; r++ ) {
+        double elapsed = encode( &img, s_filters[i].filter, &bytes );
+        if ( elapsed < 0 ) {
+          fprintf( stderr, "Error: couldn't encode %s\n", argv[f] );
+          unlink( tmp_filename );
+          return 1;
+        }
+        if ( elapsed < best )
+          best = elapsed;
+      }
+      report( argv[f], "filter", s_filters[i].name, bytes, best, raw_mb );
+    }
+
+    for ( int i = 0; s_profiles[i] != NULL; i++ ) {
+      size_t bytes = 0;
+      double best = 1e30;
+      for ( int r = 0; r < reps; r++ ) {
+        double elapsed = write_profile( &img, img_profile_from_name( s_profiles[i] ), tmp_filename, &bytes );
+        if ( elapsed < 0 ) {
+          fprintf( stderr, "Error: couldn't write %s\n", argv[f] );
+          unlink( tmp_filename );
+          return 1;
+        }
+        if ( elapsed < best )
+          best = elapsed;
+      }
+      report( argv[f], "profile", s_profiles[i], bytes, best, raw_mb );
+    }
+
+    img_cleanup( &img );
+  }
+
+  unlink( tmp_filename );
+
+  return 0;
+}
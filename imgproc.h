@@ -18,6 +18,11 @@ struct PixelAverager {
     uint32_t r, g, b, a, count;
 };
 
+// The input and output Images of the transformations below may be
+// views (see img_view) of larger images: each is addressed through its
+// own stride, so a tile or band of an image can be transformed without
+// being copied out of it first.
+
 //! Transform the entire image by shrinking it down both 
 //! horizontally and vertically (by potentially different
 //! factors). This is equivalent to sampling the orignal image
@@ -176,16 +181,17 @@ uint32_t make_pixel(uint32_t r, uint32_t g, uint32_t b, uint32_t a);
 // Rotates the color of the pixel at the given index
 //
 // @param img pointer to Image whose pixel we want to color rotate
-// @param index row-major linear index of the pixel to be rotated
+// @param index index in img's data of the pixel to be rotated (see compute_index)
 // @return color in RGBA format after rotation
 uint32_t rot_colors(struct Image *img, int32_t index);
 
-// Gets the row-major linear index for a pixel at position (row, col)
+// Gets the index in the Image's data of the pixel at position (row, col),
+// whose rows are the Image's stride apart
 //
 // @param img pointer to Image
 // @param row row of target pixel (starting with row 0 as top row)
 // @param col column of target pixel (starting with column 0 as leftmost column)
-// @return linear index of target pixel
+// @return index of target pixel
 int32_t compute_index(struct Image *img, int32_t row, int32_t col);
 
 // Determines if the position (row, col) is valid for the given Image
@@ -234,17 +240,56 @@ uint32_t blur_pixel(struct Image *img, int32_t row, int32_t col, int32_t blur_di
 // Compute expanded pixel at output position (i, j)
 //
 // @param img pointer to input Image
-// @param i linear index in output Image
+// @param i row-major linear index in output Image (i * output width + j)
 // @return expanded pixel value
 uint32_t expand_pixel(struct Image *img, int32_t index);
 
 // Compute squashed pixel at output position (i, j)
 //
 // @param img pointer to input Image
-// @param i linear index of pixel
+// @param i row-major linear index in output Image (row * output width + col)
 // @param xfac xfactor of squash
 // @param yfac yfactor of squash
 // @return squashed pixel value
 uint32_t squash_pixel(struct Image *img, int32_t i, int32_t xfac, int32_t yfac);
 
+// Inline versions of the pixel helper functions above, for use by the
+// C kernels so that per-channel accesses don't cost a function call.
+// The out-of-line get_r, make_pixel, etc. remain the linkable symbols
+// used by the unit tests and the assembly implementation. Building with
+// -DIMGPROC_NO_INLINE keeps these out of line (useful for benchmarking).
+#ifdef IMGPROC_NO_INLINE
+#define IMGPROC_HELPER static __attribute__((noinline, unused))
+#else
+#define IMGPROC_HELPER static inline
+#endif
+
+IMGPROC_HELPER uint32_t get_r_inline(uint32_t pixel) {
+  return (pixel >> IMG_R_SHIFT) & 0xFFU;
+}
+
+IMGPROC_HELPER uint32_t get_g_inline(uint32_t pixel) {
+  return (pixel >> IMG_G_SHIFT) & 0xFFU;
+}
+
+IMGPROC_HELPER uint32_t get_b_inline(uint32_t pixel) {
+  return (pixel >> IMG_B_SHIFT) & 0xFFU;
+}
+
+IMGPROC_HELPER uint32_t get_a_inline(uint32_t pixel) {
+  return (pixel >> IMG_A_SHIFT) & 0xFFU;
+}
+
+IMGPROC_HELPER uint32_t make_pixel_inline(uint32_t r, uint32_t g, uint32_t b, uint32_t a) {
+  return (r << IMG_R_SHIFT) | (g << IMG_G_SHIFT) | (b << IMG_B_SHIFT) | (a << IMG_A_SHIFT);
+}
+
+IMGPROC_HELPER int32_t compute_index_inline(struct Image *img, int32_t row, int32_t col) {
+  return row * img->stride + col;
+}
+
+IMGPROC_HELPER bool valid_position_inline(struct Image *img, int32_t row, int32_t col) {
+  return (row >= 0) && (row < img->height) && (col < img->width) && (col >= 0);
+}
+
 #endif // IMGPROC_H
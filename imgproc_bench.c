@@ -0,0 +1,118 @@
+/*
+ * Benchmark driver for the image processing functions
+ * CSF Assignment 2
+ * Partner 1: Flora Huang (fhuang27@jh.edu)
+ * Partner 2: Jonathan Xue (jxue18@jh.edu)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "imgproc.h"
+
+// Default dimensions of the synthetic image used when no input
+// PNG file is specified
+#define SYNTH_WIDTH  1024
+#define SYNTH_HEIGHT 768
+
+void usage( const char *progname ) {
+  fprintf( stderr, "Usage: %s [-r <reps>] [-b <blur dist>] [<input img>]\n", progname );
+  exit( 1 );
+}
+
+// Return the current time in seconds from a monotonic clock
+double now_sec( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fill an Image with deterministic pseudo-random opaque pixels
+int init_synthetic_img( struct Image *img, int32_t width, int32_t height ) {
+  if ( img_init( img, width, height ) != IMG_SUCCESS )
+    return 0;
+
+  uint32_t state = 0x12345678U;
+  for ( int32_t i = 0; i < width * height; i++ ) {
+    // xorshift32
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    img->data[i] = make_pixel( state >> 24, (state >> 16) & 0xFFU, (state >> 8) & 0xFFU, 0xFFU );
+  }
+  return 1;
+}
+
+// Report the best-of-reps time for one transformation
+void report( const char *name, struct Image *input_img, double best ) {
+  double mpix = (double) input_img->width * input_img->height / 1e6;
+  printf( "%-12s %10.3f ms %10.2f Mpix/s\n", name, best * 1e3, mpix / best );
+}
+
+int main( int argc, char **argv ) {
+  int reps = 5;
+  int32_t blur_dist = 5;
+  const char *input_filename = NULL;
+
+  for ( int i = 1; i < argc; i++ ) {
+    if ( strcmp( argv[i], "-r" ) == 0 && i + 1 < argc )
+      reps = atoi( argv[++i] );
+    else if ( strcmp( argv[i], "-b" ) == 0 && i + 1 < argc )
+      blur_dist = atoi( argv[++i] );
+    else if ( argv[i][0] != '-' && input_filename == NULL )
+      input_filename = argv[i];
+    else
+      usage( argv[0] );
+  }
+  if ( reps < 1 || blur_dist < 0 )
+    usage( argv[0] );
+
+  struct Image input_img;
+  if ( input_filename != NULL ) {
+    if ( img_read( input_filename, &input_img ) != IMG_SUCCESS ) {
+      fprintf( stderr, "Error: couldn't read input image\n" );
+      return 1;
+    }
+  } else if ( !init_synthetic_img( &input_img, SYNTH_WIDTH, SYNTH_HEIGHT ) ) {
+    fprintf( stderr, "Error: couldn't create input image\n" );
+    return 1;
+  }
+
+  struct Image same_img, expand_img;
+  if ( img_init( &same_img, input_img.width, input_img.height ) != IMG_SUCCESS
+       || img_init( &expand_img, input_img.width * 2, input_img.height * 2 ) != IMG_SUCCESS ) {
+    fprintf( stderr, "Error: couldn't create output images\n" );
+    return 1;
+  }
+
+  printf( "%dx%d, best of %d\n", input_img.width, input_img.height, reps );
+
+  double best = 1e30;
+  for ( int r = 0; r < reps; r++ ) {
+    double start = now_sec();
+    imgproc_blur( &input_img, &same_img, blur_dist );
+    double elapsed = now_sec() - start;
+    if ( elapsed < best )
+      best = elapsed;
+  }
+  char name[32];
+  snprintf( name, sizeof( name ), "blur %d", blur_dist );
+  report( name, &input_img, best );
+
+  best = 1e30;
+  for ( int r = 0; r < reps; r++ ) {
+    double start = now_sec();
+    imgproc_expand( &input_img, &expand_img );
+    double elapsed = now_sec() - start;
+    if ( elapsed < best )
+      best = elapsed;
+  }
+  report( "expand", &input_img, best );
+
+  img_cleanup( &input_img );
+  img_cleanup( &same_img );
+  img_cleanup( &expand_img );
+
+  return 0;
+}
@@ -25,6 +25,12 @@ struct TestImageData {
 // Include test image data
 #include "test_image_data.h"
 
+// Test pixel values are written as 0xRRGGBBAA; this converts one
+// to the in-memory pixel layout selected in image.h
+#define TEST_PIXEL( v ) \
+  ( ((((v) >> 24) & 0xFFU) << IMG_R_SHIFT) | ((((v) >> 16) & 0xFFU) << IMG_G_SHIFT) | \
+    ((((v) >> 8) & 0xFFU) << IMG_B_SHIFT) | (((v) & 0xFFU) << IMG_A_SHIFT) )
+
 // Data type for the test fixture object.
 // This contains data (including Image objects) that
 // can be accessed by test functions. This is useful
@@ -46,8 +52,12 @@ void cleanup( TestObjs *objs );
 
 // Helper functions used by the test code
 void init_image_from_testdata(struct Image *img, struct TestImageData *test_data);
+void convert_testdata(struct TestImageData *test_data);
 struct Image *create_output_image( const struct Image *src_img );
 bool images_equal( struct Image *a, struct Image *b );
+struct Image *create_padded_image( int32_t width, int32_t height, struct Image *view );
+void copy_pixels( struct Image *dst, const struct Image *src );
+bool margin_untouched( struct Image *img );
 void destroy_img( struct Image *img );
 
 // Test functions
@@ -70,6 +80,8 @@ void test_pa_avg_pixel(TestObjs *objs);
 void test_blur_pixel(TestObjs *objs);
 void test_squash_pixel(TestObjs *objs);
 void test_expand_pixel(TestObjs *objs);
+void test_views(TestObjs *objs);
+void test_write_views(TestObjs *objs);
 
 int main( int argc, char **argv ) {
   // allow the specific test to execute to be specified as the
@@ -77,6 +89,17 @@ int main( int argc, char **argv ) {
   if ( argc > 1 )
     tctest_testname_to_execute = argv[1];
 
+  // Convert test image data to the in-memory pixel layout
+  // (this has no effect with the default layout)
+  convert_testdata( &smol );
+  convert_testdata( &smol_squash_1_1 );
+  convert_testdata( &smol_squash_3_1 );
+  convert_testdata( &smol_squash_1_3 );
+  convert_testdata( &smol_color_rot );
+  convert_testdata( &smol_blur_0 );
+  convert_testdata( &smol_blur_3 );
+  convert_testdata( &smol_expand );
+
   TEST_INIT();
 
   // Run tests.
@@ -101,6 +124,8 @@ int main( int argc, char **argv ) {
   TEST(test_blur_pixel);
   TEST(test_squash_pixel);
   TEST(test_expand_pixel);
+  TEST(test_views);
+  TEST(test_write_views);
 
   TEST_FINI();
 }
@@ -123,7 +148,7 @@ TestObjs *setup( void ) {
   init_image_from_testdata( &objs->smol_expand, &smol_expand );
 
   // Initialize other test data
-  objs->test_pixel = 0x8de0baffU;
+  objs->test_pixel = TEST_PIXEL(0x8de0baffU);
   pa_init(&objs->pa);
 
   return objs;
@@ -147,6 +172,16 @@ void init_image_from_testdata(struct Image *img, struct TestImageData *test_data
   img->width = test_data->width;
   img->height = test_data->height;
   img->data = test_data->pixels;
+  img->stride = test_data->width;
+  img->is_view = 0;
+}
+
+// Helper function to convert the 0xRRGGBBAA pixel values in
+// a TestImageData instance to the in-memory pixel layout.
+// Should only be called once per TestImageData instance.
+void convert_testdata(struct TestImageData *test_data) {
+  for (int32_t i = 0; i < test_data->width * test_data->height; i++)
+    test_data->pixels[i] = TEST_PIXEL(test_data->pixels[i]);
 }
 
 // Helper function to create a temporary output Image
@@ -165,8 +200,55 @@ bool images_equal( struct Image *a, struct Image *b ) {
 
   for ( int i = 0; i < a->height; ++i )
     for ( int j = 0; j < a->width; ++j ) {
-      int index = i*a->width + j;
-      if ( a->data[index] != b->data[index] )
+      if ( img_row( a, i )[j] != img_row( b, i )[j] )
+        return false;
+    }
+
+  return true;
+}
+
+// Pixels of margin around the views used by test_views
+#define VIEW_MARGIN 3
+
+// Value of the pixels of a view made by create_padded_image; no test
+// image has a pixel with this (translucent) value
+#define VIEW_SENTINEL TEST_PIXEL(0x12345678U)
+
+// Helper function to create an Image with a margin of opaque black
+// pixels around a view of the given size, whose pixels are all
+// VIEW_SENTINEL. Returns NULL if the Image can't be created.
+struct Image *create_padded_image( int32_t width, int32_t height, struct Image *view ) {
+  struct Image *img;
+  img = malloc( sizeof( struct Image ) );
+  if ( img == NULL )
+    return NULL;
+  if ( img_init( img, width + 2*VIEW_MARGIN, height + 2*VIEW_MARGIN ) != IMG_SUCCESS ) {
+    free( img );
+    return NULL;
+  }
+  img_view( img, view, VIEW_MARGIN, VIEW_MARGIN, width, height );
+  for ( int i = 0; i < height; ++i )
+    for ( int j = 0; j < width; ++j )
+      img_row( view, i )[j] = VIEW_SENTINEL;
+  return img;
+}
+
+// Helper function to copy the pixels of one Image into another of the
+// same size
+void copy_pixels( struct Image *dst, const struct Image *src ) {
+  for ( int i = 0; i < src->height; ++i )
+    for ( int j = 0; j < src->width; ++j )
+      img_row( dst, i )[j] = img_row( src, i )[j];
+}
+
+// Returns true IFF every pixel of the margin around a view made by
+// create_padded_image is still opaque black
+bool margin_untouched( struct Image *img ) {
+  for ( int i = 0; i < img->height; ++i )
+    for ( int j = 0; j < img->width; ++j ) {
+      bool in_view = i >= VIEW_MARGIN && i < img->height - VIEW_MARGIN &&
+                     j >= VIEW_MARGIN && j < img->width - VIEW_MARGIN;
+      if ( !in_view && img_row( img, i )[j] != TEST_PIXEL(0x000000ffU) )
         return false;
     }
 
@@ -248,18 +330,18 @@ void test_get_a(TestObjs *objs) {
 
 void test_make_pixel() {
   uint32_t pixel_1 = make_pixel(0xFFU, 0xCCU, 0xAAU, 0xFFU);
-  ASSERT(pixel_1 == 0xFFCCAAFFU);
+  ASSERT(pixel_1 == TEST_PIXEL(0xFFCCAAFFU));
 
   uint32_t pixel_2 = make_pixel(0xFFU, 0x66U, 0x99U, 0x80U);
-  ASSERT(pixel_2 == 0xFF669980U);
+  ASSERT(pixel_2 == TEST_PIXEL(0xFF669980U));
 }
 
 void test_rot_colors(TestObjs *objs) {
   uint32_t rot_color_1 = rot_colors(&objs->smol, 0);
-  ASSERT(rot_color_1 == 0x90ac9dffU);
+  ASSERT(rot_color_1 == TEST_PIXEL(0x90ac9dffU));
 
   uint32_t rot_color_2 = rot_colors(&objs->smol, 314);
-  ASSERT(rot_color_2 == 0x253f31ffU);
+  ASSERT(rot_color_2 == TEST_PIXEL(0x253f31ffU));
 }
 
 void test_compute_index(TestObjs *objs) {
@@ -332,12 +414,12 @@ void test_pa_update_from_img(TestObjs *objs) {
 }
 
 void test_pa_avg_pixel(TestObjs *objs) {
-  pa_update(&objs->pa, 0x690E6CFFU);
-  pa_update(&objs->pa, 0x87E61DBFU);
-  pa_update(&objs->pa, 0x24516099U);
+  pa_update(&objs->pa, TEST_PIXEL(0x690E6CFFU));
+  pa_update(&objs->pa, TEST_PIXEL(0x87E61DBFU));
+  pa_update(&objs->pa, TEST_PIXEL(0x24516099U));
 
   uint32_t avg_pixel = pa_avg_pixel(&objs->pa);
-  ASSERT(avg_pixel == 0x5C6C4DC7U);
+  ASSERT(avg_pixel == TEST_PIXEL(0x5C6C4DC7U));
 }
 
 void test_blur_pixel(TestObjs *objs) {
@@ -412,3 +494,88 @@ void test_expand_pixel(TestObjs *objs) {
     ASSERT(expanded == objs->smol_expand.data[out_index]);
   }
 }
+
+// Transform the view of smol in a padded image into the view of a
+// padded output image. The output view starts out as VIEW_SENTINEL
+// pixels, so it only matches the expected image if every one of its
+// pixels is written, and the margin around it must not be written.
+#define VIEW_TEST( expected, call ) \
+do { \
+  struct Image in_view, out_view, *in_img, *out_img; \
+  in_img = create_padded_image( objs->smol.width, objs->smol.height, &in_view ); \
+  out_img = create_padded_image( objs->expected.width, objs->expected.height, &out_view ); \
+  ASSERT( in_img != NULL && out_img != NULL ); \
+  copy_pixels( &in_view, &objs->smol ); \
+  call; \
+  ASSERT( images_equal( &out_view, &objs->expected ) ); \
+  ASSERT( margin_untouched( out_img ) ); \
+  img_cleanup( &in_view ); \
+  img_cleanup( &out_view ); \
+  destroy_img( in_img ); \
+  destroy_img( out_img ); \
+} while (0)
+
+void test_views(TestObjs *objs) {
+  VIEW_TEST( smol_squash_3_1, imgproc_squash( &in_view, &out_view, 3, 1 ) );
+  VIEW_TEST( smol_squash_1_3, imgproc_squash( &in_view, &out_view, 1, 3 ) );
+  VIEW_TEST( smol_color_rot, imgproc_color_rot( &in_view, &out_view ) );
+  VIEW_TEST( smol_blur_3, imgproc_blur( &in_view, &out_view, 3 ) );
+  VIEW_TEST( smol_expand, imgproc_expand( &in_view, &out_view ) );
+
+  // A view's pixels are its image's pixels
+  struct Image view;
+  ASSERT( img_view( &objs->smol, &view, 4, 2, 10, 5 ) == IMG_SUCCESS );
+  ASSERT( view.width == 10 && view.height == 5 && view.stride == objs->smol.width );
+  ASSERT( compute_index( &view, 1, 3 ) == objs->smol.width + 3 );
+  ASSERT( view.data[compute_index( &view, 1, 3 )] == objs->smol.data[compute_index( &objs->smol, 3, 7 )] );
+
+  // ...and so is a view of a view
+  struct Image inner;
+  ASSERT( img_view( &view, &inner, 1, 1, 9, 4 ) == IMG_SUCCESS );
+  ASSERT( inner.data[0] == objs->smol.data[compute_index( &objs->smol, 3, 5 )] );
+
+  // Rectangles which don't lie within the image are rejected
+  ASSERT( img_view( &objs->smol, &view, -1, 0, 4, 4 ) == IMG_ERR_INVALID_ARGUMENT );
+  ASSERT( img_view( &objs->smol, &view, 0, 0, objs->smol.width + 1, 1 ) == IMG_ERR_INVALID_ARGUMENT );
+  ASSERT( img_view( &objs->smol, &view, 0, objs->smol.height, 1, 1 ) == IMG_ERR_INVALID_ARGUMENT );
+  ASSERT( img_view( &objs->smol, &view, 0, 0, 0, 1 ) == IMG_ERR_INVALID_ARGUMENT );
+}
+
+void test_write_views(TestObjs *objs) {
+  static const char *filenames[] = {
+    "test_view.png", "test_view.qoi", "test_view.rawimg", "test_view.tiles",
+  };
+  struct Image view, read_back, *img;
+  struct ImageInfo view_info, packed_info;
+
+  // A view of smol, in an image whose other pixels are translucent,
+  // so that they would change the color type of the PNG file if they
+  // were scanned or written
+  img = create_padded_image( objs->smol.width, objs->smol.height, &view );
+  ASSERT( img != NULL );
+  for ( int i = 0; i < img->height; ++i )
+    for ( int j = 0; j < img->width; ++j )
+      img_row( img, i )[j] = VIEW_SENTINEL;
+  copy_pixels( &view, &objs->smol );
+
+  // A view is written with the same color type as the contiguous image
+  ASSERT( img_write( "test_packed.png", &objs->smol ) == IMG_SUCCESS );
+  ASSERT( img_write( filenames[0], &view ) == IMG_SUCCESS );
+  ASSERT( img_probe( "test_packed.png", &packed_info ) == IMG_SUCCESS );
+  ASSERT( img_probe( filenames[0], &view_info ) == IMG_SUCCESS );
+  ASSERT( view_info.color_type == packed_info.color_type );
+  remove( "test_packed.png" );
+
+  // ...and reads back as the view's pixels, in every file format
+  for ( size_t k = 0; k < sizeof( filenames ) / sizeof( filenames[0] ); ++k ) {
+    if ( k > 0 )
+      ASSERT( img_write( filenames[k], &view ) == IMG_SUCCESS );
+    ASSERT( img_read( filenames[k], &read_back ) == IMG_SUCCESS );
+    ASSERT( images_equal( &read_back, &objs->smol ) );
+    img_cleanup( &read_back );
+    remove( filenames[k] );
+  }
+
+  img_cleanup( &view );
+  destroy_img( img );
+}
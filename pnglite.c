@@ -3,6 +3,21 @@
 */
 #define DO_CRC_CHECKS 1
 #define USE_ZLIB 1
+#define USE_THREADS 1
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_SSSE3 1
+#define USE_AVX2 1
+#else
+#define USE_SSSE3 0
+#define USE_AVX2 0
+#endif
+
+#if defined(__SSE2__)
+#define USE_SSE2 1
+#else
+#define USE_SSE2 0
+#endif
 
 #if USE_ZLIB
 #include <zlib.h>
@@ -10,13 +25,28 @@
 #include "zlite.h"
 #endif
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if USE_THREADS
+#include <pthread.h>
+#endif
+#if USE_SSE2 || USE_SSSE3 || USE_AVX2
+#include <immintrin.h>
+#endif
 #include "pnglite.h"
 
-static png_alloc_t png_alloc;
-static png_free_t png_free;
+/* default size of the compressed data in each IDAT chunk when writing */
+#define PNG_IDAT_CHUNK_SIZE	(64*1024)
+
+/* the allocator each png_t starts out with, which only png_init changes */
+static png_alloc_t png_default_alloc = malloc;
+static png_free_t png_default_free = free;
 
 static size_t file_read(png_t* png, void* out, size_t size, size_t numel)
 {
@@ -40,6 +70,49 @@ static size_t file_read(png_t* png, void* out, size_t size, size_t numel)
 	return result;
 }
 
+/* a file mapped into memory by png_open_file_map, read through png_map_read */
+typedef struct
+{
+	unsigned char*	data;
+	size_t		size;
+	size_t		pos;
+} png_map_t;
+
+static unsigned png_map_read(void* output, size_t size, size_t numel, void* user_pointer)
+{
+	png_map_t* map = user_pointer;
+	size_t avail = (map->size - map->pos) / size;
+
+	if(numel > avail)
+		numel = avail;
+
+	if(output)
+		memcpy(output, map->data + map->pos, size * numel);
+
+	map->pos += size * numel;
+
+	return (unsigned)numel;
+}
+
+/*
+	Return a pointer to the next length bytes of a mapped file, and skip over them, so that they
+	can be used in place rather than copied. Returns 0 if png was not opened with a mapped file, or
+	if the file is too short.
+*/
+static unsigned char* file_map(png_t* png, unsigned length)
+{
+	png_map_t* map = png->user_pointer;
+	unsigned char* p;
+
+	if(png->read_fun != png_map_read || map->size - map->pos < length)
+		return 0;
+
+	p = map->data + map->pos;
+	map->pos += length;
+
+	return p;
+}
+
 static size_t file_write(png_t* png, void* p, size_t size, size_t numel)
 {
 	size_t result;
@@ -107,17 +180,283 @@ static unsigned set_ul(unsigned char* buf, unsigned in)
 
 int png_init(png_alloc_t pngalloc, png_free_t pngfree)
 {
-	if(pngalloc)
-		png_alloc = pngalloc;
-	else
-		png_alloc = &malloc;
+	png_default_alloc = pngalloc ? pngalloc : &malloc;
+	png_default_free = pngfree ? pngfree : &free;
+
+	return PNG_NO_ERROR;
+}
+
+void png_set_allocator(png_t* png, png_alloc_t pngalloc, png_free_t pngfree)
+{
+	png->alloc_fun = pngalloc ? pngalloc : &malloc;
+	png->free_fun = pngfree ? pngfree : &free;
+}
+
+/*
+	Caches of buffers and zlib streams (see png_set_cache). A free buffer is kept if there is room, or if it
+	is bigger than the smallest one kept, so the cached buffers only grow. Each buffer is preceded by a
+	header holding its size. The lock is held only while the lists are changed.
+*/
+#define PNG_CACHE_BUFFERS	16
+#define PNG_CACHE_STREAMS	8
+#define PNG_CACHE_HEADER	16
+
+struct png_cache
+{
+	png_alloc_t		alloc_fun;
+	png_free_t		free_fun;
+	unsigned char*		buffers[PNG_CACHE_BUFFERS];
+	unsigned		num_buffers;
+#if USE_ZLIB
+	z_stream*		inflate_zs[PNG_CACHE_STREAMS];	/* streams to inflateReset and reuse */
+	unsigned		num_inflate_zs;
+	z_stream*		deflate_zs[PNG_CACHE_STREAMS];	/* streams to deflateReset and reuse */
+	int			deflate_params[PNG_CACHE_STREAMS];	/* level and strategy of each */
+	unsigned		num_deflate_zs;
+#endif
+#if USE_THREADS
+	pthread_mutex_t		lock;
+#endif
+};
+
+static void png_cache_lock(png_cache_t* cache)
+{
+#if USE_THREADS
+	pthread_mutex_lock(&cache->lock);
+#else
+	(void)cache;
+#endif
+}
+
+static void png_cache_unlock(png_cache_t* cache)
+{
+#if USE_THREADS
+	pthread_mutex_unlock(&cache->lock);
+#else
+	(void)cache;
+#endif
+}
+
+static size_t png_cache_size(unsigned char* buf)
+{
+	return *(size_t*)(buf - PNG_CACHE_HEADER);
+}
+
+png_cache_t* png_cache_create(png_alloc_t pngalloc, png_free_t pngfree)
+{
+	png_cache_t* cache;
+
+	if(!pngalloc)
+		pngalloc = &malloc;
+	if(!pngfree)
+		pngfree = &free;
+
+	cache = pngalloc(sizeof(png_cache_t));
+	if(!cache)
+		return 0;
+
+	memset(cache, 0, sizeof(png_cache_t));
+	cache->alloc_fun = pngalloc;
+	cache->free_fun = pngfree;
+#if USE_THREADS
+	pthread_mutex_init(&cache->lock, 0);
+#endif
+
+	return cache;
+}
+
+void png_cache_destroy(png_cache_t* cache)
+{
+	unsigned i;
+
+	if(!cache)
+		return;
+
+#if USE_ZLIB
+	for(i = 0; i < cache->num_inflate_zs; i++)
+	{
+		inflateEnd(cache->inflate_zs[i]);
+		cache->free_fun((unsigned char*)cache->inflate_zs[i] - PNG_CACHE_HEADER);
+	}
+	for(i = 0; i < cache->num_deflate_zs; i++)
+	{
+		deflateEnd(cache->deflate_zs[i]);
+		cache->free_fun((unsigned char*)cache->deflate_zs[i] - PNG_CACHE_HEADER);
+	}
+#endif
+	for(i = 0; i < cache->num_buffers; i++)
+		cache->free_fun(cache->buffers[i] - PNG_CACHE_HEADER);
+
+#if USE_THREADS
+	pthread_mutex_destroy(&cache->lock);
+#endif
+	cache->free_fun(cache);
+}
+
+void png_set_cache(png_t* png, png_cache_t* cache)
+{
+	png->cache = cache;
+}
+
+/* take the smallest cached buffer of at least size bytes, or allocate one */
+static void* png_cache_alloc(png_cache_t* cache, size_t size)
+{
+	unsigned char* buf = 0;
+	unsigned best = 0;
+	unsigned i;
+
+	png_cache_lock(cache);
+	for(i = 0; i < cache->num_buffers; i++)
+	{
+		if(png_cache_size(cache->buffers[i]) >= size &&
+			(!buf || png_cache_size(cache->buffers[i]) < png_cache_size(buf)))
+		{
+			buf = cache->buffers[i];
+			best = i;
+		}
+	}
+	if(buf)
+		cache->buffers[best] = cache->buffers[--cache->num_buffers];
+	png_cache_unlock(cache);
+
+	if(buf)
+		return buf;
+
+	buf = cache->alloc_fun(size + PNG_CACHE_HEADER);
+	if(!buf)
+		return 0;
+
+	*(size_t*)buf = size;
+
+	return buf + PNG_CACHE_HEADER;
+}
+
+/* keep buf in the cache, in place of the smallest cached buffer if it is full */
+static void png_cache_free(png_cache_t* cache, unsigned char* buf)
+{
+	unsigned smallest = 0;
+	unsigned i;
 
-	if(pngfree)
-		png_free = pngfree;
+	if(!buf)
+		return;
+
+	png_cache_lock(cache);
+	if(cache->num_buffers < PNG_CACHE_BUFFERS)
+	{
+		cache->buffers[cache->num_buffers++] = buf;
+		buf = 0;
+	}
 	else
-		png_free = &free;
+	{
+		for(i = 1; i < cache->num_buffers; i++)
+		{
+			if(png_cache_size(cache->buffers[i]) < png_cache_size(cache->buffers[smallest]))
+				smallest = i;
+		}
+		if(png_cache_size(cache->buffers[smallest]) < png_cache_size(buf))
+		{
+			unsigned char* evicted = cache->buffers[smallest];
+			cache->buffers[smallest] = buf;
+			buf = evicted;
+		}
+	}
+	png_cache_unlock(cache);
 
-	return PNG_NO_ERROR;
+	if(buf)
+		cache->free_fun(buf - PNG_CACHE_HEADER);
+}
+
+#if USE_ZLIB
+/* take a cached inflate stream, or return 0 */
+static z_stream* png_cache_get_inflate(png_cache_t* cache)
+{
+	z_stream* stream = 0;
+
+	png_cache_lock(cache);
+	if(cache->num_inflate_zs)
+		stream = cache->inflate_zs[--cache->num_inflate_zs];
+	png_cache_unlock(cache);
+
+	return stream;
+}
+
+/* keep stream in the cache if there is room; returns 0 if there is not */
+static int png_cache_put_inflate(png_cache_t* cache, z_stream* stream)
+{
+	int kept = 0;
+
+	png_cache_lock(cache);
+	if(cache->num_inflate_zs < PNG_CACHE_STREAMS)
+	{
+		cache->inflate_zs[cache->num_inflate_zs++] = stream;
+		kept = 1;
+	}
+	png_cache_unlock(cache);
+
+	return kept;
+}
+
+/*
+	Deflate streams are only reused with the compression level and strategy they were set up with,
+	since changing them on a used stream may need it to flush its output.
+*/
+#define PNG_DEFLATE_PARAMS(png)	((png)->deflate_level * 16 + (png)->deflate_strategy)
+
+static z_stream* png_cache_get_deflate(png_cache_t* cache, int params)
+{
+	z_stream* stream = 0;
+	unsigned i;
+
+	png_cache_lock(cache);
+	for(i = 0; i < cache->num_deflate_zs; i++)
+	{
+		if(cache->deflate_params[i] == params)
+		{
+			stream = cache->deflate_zs[i];
+			cache->num_deflate_zs--;
+			cache->deflate_zs[i] = cache->deflate_zs[cache->num_deflate_zs];
+			cache->deflate_params[i] = cache->deflate_params[cache->num_deflate_zs];
+			break;
+		}
+	}
+	png_cache_unlock(cache);
+
+	return stream;
+}
+
+static int png_cache_put_deflate(png_cache_t* cache, z_stream* stream, int params)
+{
+	int kept = 0;
+
+	png_cache_lock(cache);
+	if(cache->num_deflate_zs < PNG_CACHE_STREAMS)
+	{
+		cache->deflate_zs[cache->num_deflate_zs] = stream;
+		cache->deflate_params[cache->num_deflate_zs] = params;
+		cache->num_deflate_zs++;
+		kept = 1;
+	}
+	png_cache_unlock(cache);
+
+	return kept;
+}
+#endif
+
+/* all allocation goes through the png_t, so that there is no shared state between images */
+static void* png_alloc(png_t* png, size_t size)
+{
+	if(png->cache)
+		return png_cache_alloc(png->cache, size);
+
+	return png->alloc_fun(size);
+}
+
+static void png_free(png_t* png, void* p)
+{
+	if(png->cache)
+		png_cache_free(png->cache, p);
+	else
+		png->free_fun(p);
 }
 
 static int png_get_bpp(png_t* png)
@@ -140,11 +479,25 @@ static int png_get_bpp(png_t* png)
 		return PNG_FILE_ERROR;
 	}
 
+	/* samples of less than 8 bits (greyscale or palette indices) are packed into
+	   bytes, which the filters treat as 1-byte pixels */
+	if(png->depth < 8)
+		return 1;
+
 	bpp *= png->depth/8;
 
 	return bpp;
 }
 
+/* bytes in an unfiltered row of the image, without its filter type byte */
+static unsigned png_row_bytes(png_t* png)
+{
+	if(png->depth < 8)
+		return (unsigned)(((unsigned long long)png->width * png->depth + 7) / 8);
+
+	return png->width * png->bpp;
+}
+
 static int png_read_ihdr(png_t* png)
 {
 	unsigned length;
@@ -184,11 +537,26 @@ static int png_read_ihdr(png_t* png)
 	png->filter_method = ihdr[15];
 	png->interlace_method = ihdr[16];
 
-	if(png->color_type == PNG_INDEXED)
-		return PNG_NOT_SUPPORTED;
-
-	if(png->depth != 8 && png->depth != 16)
+	/* the bit depths allowed with each color type */
+	switch(png->color_type)
+	{
+	case PNG_GREYSCALE:
+		if(png->depth != 1 && png->depth != 2 && png->depth != 4 && png->depth != 8 && png->depth != 16)
+			return PNG_NOT_SUPPORTED;
+		break;
+	case PNG_INDEXED:
+		if(png->depth != 1 && png->depth != 2 && png->depth != 4 && png->depth != 8)
+			return PNG_NOT_SUPPORTED;
+		break;
+	case PNG_TRUECOLOR:
+	case PNG_GREYSCALE_ALPHA:
+	case PNG_TRUECOLOR_ALPHA:
+		if(png->depth != 8 && png->depth != 16)
+			return PNG_NOT_SUPPORTED;
+		break;
+	default:
 		return PNG_NOT_SUPPORTED;
+	}
 
 	if(png->interlace_method)
 		return PNG_NOT_SUPPORTED;
@@ -254,11 +622,34 @@ void png_print_info(png_t* png)
 int png_open_read(png_t* png, png_read_callback_t read_fun, void* user_pointer)
 {
 	char header[8];
+	unsigned i;
 	int result;
 
 	png->read_fun = read_fun;
 	png->write_fun = 0;
 	png->user_pointer = user_pointer;
+	png->alloc_fun = png_default_alloc;
+	png->free_fun = png_default_free;
+	png->cache = 0;
+	png->threads = 1;
+	png->zs = 0;
+	png->png_data = 0;
+	png->png_datalen = 0;
+	png->readbuf = 0;
+	png->readbuflen = 0;
+	png->rowbuf = 0;
+	png->filterbuf = 0;
+	png->writebuf = 0;
+	png->restarts = 0;
+	png->num_restarts = 0;
+	png->next_row = 0;
+	png->palette_size = 0;
+	png->has_trns_key = 0;
+
+	/* until a PLTE chunk says otherwise, every palette entry is opaque black */
+	memset(png->palette, 0, sizeof(png->palette));
+	for(i = 0; i < 256; i++)
+		png->palette[i][3] = 255;
 
 	if(!read_fun && !user_pointer)
 		return PNG_WRONG_ARGUMENTS;
@@ -281,6 +672,24 @@ int png_open_write(png_t* png, png_write_callback_t write_fun, void* user_pointe
 	png->write_fun = write_fun;
 	png->read_fun = 0;
 	png->user_pointer = user_pointer;
+	png->alloc_fun = png_default_alloc;
+	png->free_fun = png_default_free;
+	png->cache = 0;
+	png->filter_heuristic = PNG_FILTER_NONE;
+	png->deflate_level = Z_DEFAULT_COMPRESSION;
+	png->deflate_strategy = Z_DEFAULT_STRATEGY;
+	png->idat_size = PNG_IDAT_CHUNK_SIZE;
+	png->threads = 1;
+	png->restart_interval = 0;
+	png->zs = 0;
+	png->writebuf = 0;
+	png->rowbuf = 0;
+	png->candbuf = 0;
+	png->filterbuf = 0;
+	png->restarts = 0;
+	png->next_row = 0;
+	png->palette_size = 0;
+	png->has_trns_key = 0;
 
 	if(!write_fun && !user_pointer)
 		return PNG_WRONG_ARGUMENTS;
@@ -293,6 +702,20 @@ int png_open(png_t* png, png_read_callback_t read_fun, void* user_pointer)
 	return png_open_read(png, read_fun, user_pointer);
 }
 
+/* open png for reading from fp, closing it on failure */
+static int png_open_stdio_read(png_t* png, FILE* fp)
+{
+	int result = png_open_read(png, 0, fp);
+
+	if(result != PNG_NO_ERROR)
+	{
+		fclose(fp);
+		png->user_pointer = 0;
+	}
+
+	return result;
+}
+
 int png_open_file_read(png_t *png, const char* filename)
 {
 	FILE* fp = fopen(filename, "rb");
@@ -300,7 +723,61 @@ int png_open_file_read(png_t *png, const char* filename)
 	if(!fp)
 		return PNG_FILE_ERROR;
 
-	return png_open_read(png, 0, fp);
+	return png_open_stdio_read(png, fp);
+}
+
+int png_open_file_map(png_t *png, const char* filename)
+{
+	png_map_t* map;
+	struct stat st;
+	void* data;
+	int result;
+	int fd = open(filename, O_RDONLY);
+
+	if(fd < 0)
+		return PNG_FILE_ERROR;
+
+	/* anything that cannot be mapped, such as a pipe, is read with stdio instead */
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+		(data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+	{
+		FILE* fp = fdopen(fd, "rb");
+
+		if(!fp)
+		{
+			close(fd);
+			return PNG_FILE_ERROR;
+		}
+
+		return png_open_stdio_read(png, fp);
+	}
+
+	/* the mapping keeps the file open */
+	close(fd);
+
+	/* like the FILE that stdio allocates, this is not allocated with the png's allocator */
+	map = malloc(sizeof(png_map_t));
+	if(!map)
+	{
+		munmap(data, st.st_size);
+		return PNG_MEMORY_ERROR;
+	}
+
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	map->data = data;
+	map->size = st.st_size;
+	map->pos = 0;
+
+	result = png_open_read(png, png_map_read, map);
+	if(result != PNG_NO_ERROR)
+	{
+		munmap(map->data, map->size);
+		free(map);
+		png->user_pointer = 0;
+	}
+
+	return result;
 }
 
 int png_open_file_write(png_t *png, const char* filename)
@@ -320,6 +797,17 @@ int png_open_file(png_t *png, const char* filename)
 
 int png_close_file(png_t* png)
 {
+	if(png->read_fun == png_map_read)
+	{
+		png_map_t* map = png->user_pointer;
+
+		munmap(map->data, map->size);
+		free(map);
+		png->user_pointer = 0;
+
+		return PNG_NO_ERROR;
+	}
+
 	fclose(png->user_pointer);
 
 	return PNG_NO_ERROR;
@@ -328,17 +816,29 @@ int png_close_file(png_t* png)
 static int png_init_deflate(png_t* png, unsigned char* data, int datalen)
 {
 	z_stream *stream;
-	png->zs = png_alloc(sizeof(z_stream));
 
-	stream = png->zs;
+	/* a cached stream only needs resetting */
+	if(png->cache && (stream = png_cache_get_deflate(png->cache, PNG_DEFLATE_PARAMS(png))))
+	{
+		png->zs = stream;
 
-	if(!stream)
-		return PNG_MEMORY_ERROR;
+		if(deflateReset(stream) != Z_OK)
+			return PNG_ZLIB_ERROR;
+	}
+	else
+	{
+		png->zs = png_alloc(png, sizeof(z_stream));
 
-	memset(stream, 0, sizeof(z_stream));
+		stream = png->zs;
 
-	if(deflateInit(stream, Z_DEFAULT_COMPRESSION) != Z_OK)
-		return PNG_ZLIB_ERROR;
+		if(!stream)
+			return PNG_MEMORY_ERROR;
+
+		memset(stream, 0, sizeof(z_stream));
+
+		if(deflateInit2(stream, png->deflate_level, Z_DEFLATED, 15, 8, png->deflate_strategy) != Z_OK)
+			return PNG_ZLIB_ERROR;
+	}
 
 	stream->next_in = data;
 	stream->avail_in = datalen;
@@ -350,10 +850,24 @@ static int png_init_inflate(png_t* png)
 {
 #if USE_ZLIB
 	z_stream *stream;
-	png->zs = png_alloc(sizeof(z_stream));
+
+	if(png->cache && (stream = png_cache_get_inflate(png->cache)))
+	{
+		png->zs = stream;
+
+		if(inflateReset(stream) != Z_OK)
+			return PNG_ZLIB_ERROR;
+
+		stream->next_out = png->png_data;
+		stream->avail_out = png->png_datalen;
+
+		return PNG_NO_ERROR;
+	}
+
+	png->zs = png_alloc(png, sizeof(z_stream));
 #else
 	zl_stream *stream;
-	png->zs = png_alloc(sizeof(zl_stream));
+	png->zs = png_alloc(png, sizeof(zl_stream));
 #endif
 
 	stream = png->zs;
@@ -384,9 +898,12 @@ static int png_end_deflate(png_t* png)
 	if(!stream)
 		return PNG_MEMORY_ERROR;
 
+	if(png->cache && png_cache_put_deflate(png->cache, stream, PNG_DEFLATE_PARAMS(png)))
+		return PNG_NO_ERROR;
+
 	deflateEnd(stream);
 
-	png_free(png->zs);
+	png_free(png, png->zs);
 
 	return PNG_NO_ERROR;
 }
@@ -403,6 +920,9 @@ static int png_end_inflate(png_t* png)
 		return PNG_MEMORY_ERROR;
 
 #if USE_ZLIB
+	if(png->cache && png_cache_put_inflate(png->cache, stream))
+		return PNG_NO_ERROR;
+
 	if(inflateEnd(stream) != Z_OK)
 #else
 	if(z_inflateEnd(stream) != Z_OK)
@@ -412,7 +932,7 @@ static int png_end_inflate(png_t* png)
 		return PNG_ZLIB_ERROR;
 	}
 
-	png_free(png->zs);
+	png_free(png, png->zs);
 
 	return PNG_NO_ERROR;
 }
@@ -450,7 +970,7 @@ static int png_inflate(png_t* png, unsigned char* data, int len)
 	return PNG_NO_ERROR;
 }
 
-static int png_deflate(png_t* png, char* outdata, int outlen, int *outwritten)
+static int png_deflate(png_t* png, char* outdata, int outlen, int *outwritten, int flush)
 {
 	int result;
 
@@ -462,10 +982,13 @@ static int png_deflate(png_t* png, char* outdata, int outlen, int *outwritten)
 	stream->next_out = (unsigned char*)outdata;
 	stream->avail_out = outlen;
 
-	result = deflate(stream, Z_SYNC_FLUSH);
+	result = deflate(stream, flush);
 
 	*outwritten = outlen - stream->avail_out;
 
+	if(result == Z_BUF_ERROR)	/* no progress possible, not fatal */
+		result = Z_OK;
+
 	if(result != Z_STREAM_END && result != Z_OK)
 	{
 		printf("%s\n", stream->msg);
@@ -475,176 +998,350 @@ static int png_deflate(png_t* png, char* outdata, int outlen, int *outwritten)
 	return result;
 }
 
-static int png_write_idats(png_t* png, unsigned char* data)
+/* double the size of png->writebuf, keeping its contents */
+static int png_grow_writebuf(png_t* png)
 {
-	unsigned char *chunk;
-	unsigned long written;
-	unsigned long crc;
-	unsigned size = png->width * png->height * png->bpp + png->height;
-	unsigned chunk_size = compressBound(size);
+	unsigned char* buf = png_alloc(png, png->writebufsize * 2);
 
-	(void)png_init_deflate;
-	(void)png_end_deflate;
-	(void)png_deflate;
-
-	chunk = png_alloc(chunk_size + 4);
-	memcpy(chunk, "IDAT", 4);
-
-	written = chunk_size;
-	compress(chunk+4, &written, data, size);
+	if(!buf)
+		return PNG_MEMORY_ERROR;
 
-	crc = crc32(0L, Z_NULL, 0);
-	crc = crc32(crc, chunk, written+4);
-	set_ul(chunk+written+4, crc);
-	file_write_ul(png, written);
-	file_write(png, chunk, 1, written+8);
-	png_free(chunk);
-
-	file_write_ul(png, 0);
-	file_write(png, "IEND", 1, 4);
-	crc = crc32(0L, (const unsigned char *)"IEND", 4);
-	file_write_ul(png, crc);
+	memcpy(buf, png->writebuf, png->writebuflen);
+	png_free(png, png->writebuf);
+	png->writebuf = buf;
+	png->writebufsize *= 2;
 
 	return PNG_NO_ERROR;
 }
 
-static int png_read_idat(png_t* png, unsigned length)
-{
-#if DO_CRC_CHECKS
-	unsigned orig_crc;
-	unsigned calc_crc;
-#endif
+#if USE_THREADS
+/*
+	Reading restart points (see png_set_restart_interval). When the rsTR chunk is found
+	before the IDAT chunks and more than one thread may be used, the compressed data is
+	collected in png->writebuf instead of being inflated as it is read, and the segments
+	between the restart points are then inflated and unfiltered in parallel. An rsTR
+	chunk which does not make sense for the image is ignored.
+*/
 
-	if(!png->readbuf || png->readbuflen < length)
-	{
-		if (png->readbuf)
-		{
-			png_free(png->readbuf);
-		}
-		png->readbuf = png_alloc(length);
-		png->readbuflen = length;
-	}
+static int png_read_restarts(png_t* png, unsigned length)
+{
+	unsigned char* chunk;
+	unsigned i;
+	int result = PNG_NO_ERROR;
 
-	if(!png->readbuf)
-	{
+	chunk = png_alloc(png, length + 4);
+	if(!chunk)
 		return PNG_MEMORY_ERROR;
-	}
 
-	if(file_read(png, png->readbuf, 1, length) != length)
-	{
-		return PNG_FILE_ERROR;
-	}
+	memcpy(chunk, "rsTR", 4);
+
+	if(file_read(png, chunk + 4, 1, length) != length)
+		result = PNG_FILE_ERROR;
 
 #if DO_CRC_CHECKS
-	calc_crc = crc32(0L, Z_NULL, 0);
-	calc_crc = crc32(calc_crc, (unsigned char*)"IDAT", 4);
-	calc_crc = crc32(calc_crc, (unsigned char*)png->readbuf, length);
+	if(result == PNG_NO_ERROR)
+	{
+		unsigned orig_crc;
 
-	file_read_ul(png, &orig_crc);
+		file_read_ul(png, &orig_crc);
 
-	if(orig_crc != calc_crc)
-	{
-		return PNG_CRC_ERROR;
+		if(orig_crc != crc32(crc32(0L, Z_NULL, 0), chunk, length + 4))
+			result = PNG_CRC_ERROR;
 	}
 #else
-	file_read_ul(png);
+	if(result == PNG_NO_ERROR)
+		file_read(png, 0, 1, 4);
 #endif
 
-	return png_inflate(png, png->readbuf, length);
+	png_free(png, png->restarts);
+	png->restarts = 0;
+	png->num_restarts = 0;
+
+	if(result == PNG_NO_ERROR && length > 0 && length % 8 == 0)
+	{
+		png->num_restarts = length / 8;
+		png->restarts = png_alloc(png, length);
+		if(!png->restarts)
+			result = PNG_MEMORY_ERROR;
+
+		for(i = 0; i < png->num_restarts * 2 && result == PNG_NO_ERROR; i++)
+			png->restarts[i] = get_ul(chunk + 4 + i * 4);
+
+		/* rows and offsets must increase, and the rows be within the image */
+		for(i = 0; i < png->num_restarts && png->restarts; i++)
+		{
+			unsigned prev_row = i ? png->restarts[2 * i - 2] : 0;
+			unsigned prev_offset = i ? png->restarts[2 * i - 1] : 1;
+
+			if(png->restarts[2 * i] <= prev_row || png->restarts[2 * i] >= png->height ||
+				png->restarts[2 * i + 1] <= prev_offset)
+			{
+				png_free(png, png->restarts);
+				png->restarts = 0;
+				png->num_restarts = 0;
+			}
+		}
+	}
+
+	png_free(png, chunk);
+
+	return result;
 }
 
-static int png_process_chunk(png_t* png)
+/* add IDAT data to the compressed data collected in png->writebuf */
+static int png_append_idat(png_t* png, unsigned char* data, unsigned length)
 {
-	int result = PNG_NO_ERROR;
-	unsigned type;
-	unsigned length;
+	if(!png->writebuf)
+	{
+		png->writebufsize = length > PNG_IDAT_CHUNK_SIZE ? length : PNG_IDAT_CHUNK_SIZE;
+		png->writebuflen = 0;
+		png->writebuf = png_alloc(png, png->writebufsize);
+		if(!png->writebuf)
+			return PNG_MEMORY_ERROR;
+	}
 
-	file_read_ul(png, &length);
+	while(png->writebufsize - png->writebuflen < length)
+	{
+		if(png_grow_writebuf(png) != PNG_NO_ERROR)
+			return PNG_MEMORY_ERROR;
+	}
 
-	if(file_read(png, &type, 1, 4) != 4)
-		return PNG_FILE_ERROR;
+	memcpy(png->writebuf + png->writebuflen, data, length);
+	png->writebuflen += length;
+
+	return PNG_NO_ERROR;
+}
+#endif
+
+/*
+	Read the data of an IDAT chunk, and check its CRC, storing a pointer to it in *data. It is
+	used in place if the file is mapped, and read into png->readbuf otherwise.
+*/
+static int png_read_idat(png_t* png, unsigned char** data, unsigned length)
+{
+#if DO_CRC_CHECKS
+	unsigned orig_crc;
+	unsigned calc_crc;
+#endif
 
-	if(type == *(unsigned int*)"IDAT")	/* if we found an idat, all other idats should be followed with no other chunks in between */
+	if(png->read_fun == png_map_read)
+	{
+		*data = file_map(png, length);
+		if(!*data)
+			return PNG_FILE_ERROR;
+	}
+	else
 	{
-		if(!png->png_data) /* first IDAT */
+		if(!png->readbuf || png->readbuflen < length)
 		{
-			png->png_datalen = png->width * png->height * png->bpp + png->height;
-			png->png_data = png_alloc(png->png_datalen);
+			if (png->readbuf)
+			{
+				png_free(png, png->readbuf);
+			}
+			png->readbuf = png_alloc(png, length);
+			png->readbuflen = length;
 		}
 
-		if(!png->png_data)
+		if(!png->readbuf)
+		{
 			return PNG_MEMORY_ERROR;
+		}
 
-		if(!png->zs)
+		if(file_read(png, png->readbuf, 1, length) != length)
 		{
-			result = png_init_inflate(png);
-			if(result != PNG_NO_ERROR)
-				return result;
+			return PNG_FILE_ERROR;
 		}
 
-		return png_read_idat(png, length);
+		*data = png->readbuf;
 	}
-	else if(type == *(unsigned int*)"IEND")
+
+#if DO_CRC_CHECKS
+	calc_crc = crc32(0L, Z_NULL, 0);
+	calc_crc = crc32(calc_crc, (unsigned char*)"IDAT", 4);
+	calc_crc = crc32(calc_crc, *data, length);
+
+	file_read_ul(png, &orig_crc);
+
+	if(orig_crc != calc_crc)
 	{
-		return PNG_DONE;
+		return PNG_CRC_ERROR;
 	}
-	else
+#else
+	file_read_ul(png);
+#endif
+
+	return PNG_NO_ERROR;
+}
+
+/*
+	Read a PLTE or tRNS chunk (type is its name) of length bytes into png->palette, or a tRNS
+	chunk into png->trns_key for greyscale or truecolor. The suggested palette of a truecolor
+	image, and a tRNS chunk too short for its color type, are ignored. Palette entries which
+	are not given stay opaque black.
+*/
+static int png_read_palette(png_t* png, const char* type, unsigned length)
+{
+	unsigned char chunk[4 + 256 * 3];
+	unsigned i;
+
+	/* too long for either chunk, so no use */
+	if(length > sizeof(chunk) - 4)
 	{
-		file_read(png, 0, 1, length + 4); /* unknown chunk */
+		file_read(png, 0, 1, length + 4);
+		return PNG_NO_ERROR;
 	}
 
-	return result;
+	memcpy(chunk, type, 4);
+
+	if(file_read(png, chunk + 4, 1, length) != length)
+		return PNG_FILE_ERROR;
+
+#if DO_CRC_CHECKS
+	{
+		unsigned orig_crc;
+
+		file_read_ul(png, &orig_crc);
+
+		if(orig_crc != crc32(crc32(0L, Z_NULL, 0), chunk, length + 4))
+			return PNG_CRC_ERROR;
+	}
+#else
+	file_read(png, 0, 1, 4);
+#endif
+
+	if(memcmp(type, "PLTE", 4) == 0)
+	{
+		if(png->color_type != PNG_INDEXED)
+			return PNG_NO_ERROR;
+
+		png->palette_size = length / 3;
+		for(i = 0; i < png->palette_size; i++)
+		{
+			png->palette[i][0] = chunk[4 + i * 3];
+			png->palette[i][1] = chunk[5 + i * 3];
+			png->palette[i][2] = chunk[6 + i * 3];
+		}
+	}
+	else if(png->color_type == PNG_INDEXED)
+	{
+		for(i = 0; i < length && i < 256; i++)
+			png->palette[i][3] = chunk[4 + i];
+	}
+	else if(png->color_type == PNG_GREYSCALE && length >= 2)
+	{
+		png->trns_key[0] = (unsigned short)((chunk[4] << 8) | chunk[5]);
+		png->has_trns_key = 1;
+	}
+	else if(png->color_type == PNG_TRUECOLOR && length >= 6)
+	{
+		for(i = 0; i < 3; i++)
+			png->trns_key[i] = (unsigned short)((chunk[4 + i * 2] << 8) | chunk[5 + i * 2]);
+		png->has_trns_key = 1;
+	}
+
+	return PNG_NO_ERROR;
 }
 
-static void png_filter_sub(int stride, unsigned char* in, unsigned char* out, int len)
+/*
+	Skip chunks up to the next IDAT chunk, and read its data with png_read_idat, storing its
+	length in *length. Returns PNG_DONE if the IEND chunk is found first. PLTE and tRNS chunks
+	are read with png_read_palette, and an rsTR chunk is read (rather than skipped) if restarts
+	is nonzero.
+*/
+static int png_next_idat(png_t* png, unsigned char** data, unsigned* length, int restarts)
 {
-	int i;
-	unsigned char a = 0;
+	unsigned type;
 
-	for(i = 0; i < len; i++)
+	for(;;)
 	{
-		if(i >= stride)
-			a = out[i - stride];
+		if(file_read_ul(png, length) != PNG_NO_ERROR)
+			return PNG_EOF_ERROR;
 
-		out[i] = in[i] + a;
+		if(file_read(png, &type, 1, 4) != 4)
+			return PNG_FILE_ERROR;
+
+		if(type == *(unsigned int*)"IDAT")
+		{
+			return png_read_idat(png, data, *length);
+		}
+		else if(type == *(unsigned int*)"IEND")
+		{
+			return PNG_DONE;
+		}
+		else if(type == *(unsigned int*)"PLTE" || type == *(unsigned int*)"tRNS")
+		{
+			int result = png_read_palette(png, (const char*)&type, *length);
+			if(result != PNG_NO_ERROR)
+				return result;
+		}
+#if USE_THREADS
+		else if(type == *(unsigned int*)"rsTR" && restarts)
+		{
+			int result = png_read_restarts(png, *length);
+			if(result != PNG_NO_ERROR)
+				return result;
+		}
+#endif
+		else
+		{
+			file_read(png, 0, 1, *length + 4); /* unknown chunk */
+		}
 	}
 }
 
-static void png_filter_up(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+/*
+	Decoder-side unfiltering. prev_line is 0 for the first row (or the first row of a
+	segment), whose row above is taken to be all zeros, so up is a copy, and paeth is the
+	same as sub; that case is handled separately rather than tested for in the loops.
+*/
+
+static void png_filter_sub(int stride, unsigned char* in, unsigned char* out, int len)
 {
-	(void) stride;
+	int i;
+
+	for(i = 0; i < stride && i < len; i++)
+		out[i] = in[i];
 
+	for(; i < len; i++)
+		out[i] = in[i] + out[i - stride];
+}
+
+static void png_filter_up(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+{
 	int i;
 
-	if(prev_line)
+	(void) stride;
+
+	if(!prev_line)
 	{
-        for(i = 0; i < len; i++)
-		out[i] = in[i] + prev_line[i];
-	}
-	else
 		memcpy(out, in, len);
+		return;
+	}
+
+	for(i = 0; i < len; i++)
+		out[i] = in[i] + prev_line[i];
 }
 
 static void png_filter_average(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
 {
 	int i;
-	unsigned char a = 0;
-	unsigned char b = 0;
-	unsigned int sum = 0;
 
-	for(i = 0; i < len; i++)
+	if(!prev_line)
 	{
-		if(prev_line)
-			b = prev_line[i];
-
-		if(i >= stride)
-			a = out[i - stride];
+		for(i = 0; i < stride && i < len; i++)
+			out[i] = in[i];
 
-		sum = a;
-		sum += b;
+		for(; i < len; i++)
+			out[i] = in[i] + (out[i - stride] >> 1);
 
-		out[i] = (char)(in[i] + sum/2);
+		return;
 	}
+
+	for(i = 0; i < stride && i < len; i++)
+		out[i] = in[i] + (prev_line[i] >> 1);
+
+	for(; i < len; i++)
+		out[i] = in[i] + ((out[i - stride] + prev_line[i]) >> 1);
 }
 
 static unsigned char png_paeth(unsigned char a, unsigned char b, unsigned char c)
@@ -669,170 +1366,3107 @@ static unsigned char png_paeth(unsigned char a, unsigned char b, unsigned char c
 static void png_filter_paeth(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
 {
 	int i;
-	unsigned char a;
-	unsigned char b;
-	unsigned char c;
 
-	for(i = 0; i < len; i++)
+	if(!prev_line)
 	{
-		if(prev_line && i >= stride)
-		{
-			a = out[i - stride];
-			b = prev_line[i];
-			c = prev_line[i - stride];
-		}
-		else
-		{
-			if(prev_line)
-				b = prev_line[i];
-			else
-				b = 0;
-
-			if(i >= stride)
-				a = out[i - stride];
-			else
-				a = 0;
+		png_filter_sub(stride, in, out, len);
+		return;
+	}
 
-			c = 0;
-		}
+	/* with a and c both 0, the predictor is b */
+	for(i = 0; i < stride && i < len; i++)
+		out[i] = in[i] + prev_line[i];
 
-		out[i] = in[i] + png_paeth(a, b, c);
-	}
+	for(; i < len; i++)
+		out[i] = in[i] + png_paeth(out[i - stride], prev_line[i], prev_line[i - stride]);
 }
 
-static int png_filter(png_t* png, unsigned char* data)
+#if USE_SSE2
+/*
+	SSE2 unfiltering for 3- and 4-byte pixels. Up is done 16 bytes at a time. Sub computes
+	the prefix sums of 4 pixels at a time with two shifted adds, after adding the pixel to the
+	left to the first one. Average and paeth depend on the pixel to the left, so they work
+	one pixel at a time, on all of its bytes at once.
+*/
+
+/* paeth predictor for bytes widened to 16-bit lanes (also used by the encoder) */
+static __m128i png_paeth_epi16_sse2(__m128i a, __m128i b, __m128i c)
 {
-	(void) png;
-	(void) data;
-	return PNG_NO_ERROR;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i pa = _mm_sub_epi16(b, c);	/* p - a */
+	__m128i pb = _mm_sub_epi16(a, c);	/* p - b */
+	__m128i pc = _mm_add_epi16(pa, pb);	/* p - c */
+	__m128i not_a;
+	__m128i take_c;
+	__m128i bc;
+
+	pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+	pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+	pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+
+	not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+	take_c = _mm_cmpgt_epi16(pb, pc);
+	bc = _mm_or_si128(_mm_and_si128(take_c, c), _mm_andnot_si128(take_c, b));
+
+	return _mm_or_si128(_mm_and_si128(not_a, bc), _mm_andnot_si128(not_a, a));
 }
 
-static int png_unfilter(png_t* png, unsigned char* data)
+/*
+	Load or store one pixel of n bytes in the low bytes of a vector. For 3-byte pixels,
+	all but the last pixel in a row are loaded and stored with n = 4; the extra byte only
+	affects its own lane, and is overwritten by the next pixel.
+*/
+static inline __m128i png_load_pixel(const unsigned char* p, int n)
 {
-	unsigned i;
-	unsigned pos = 0;
-	unsigned outpos = 0;
-	unsigned char *filtered = png->png_data;
+	unsigned v;
 
-	int stride = png->bpp;
+	if(n == 4)
+		memcpy(&v, p, 4);
+	else
+		v = p[0] | (p[1] << 8) | ((unsigned)p[2] << 16);
 
-	while(pos < png->png_datalen)
-	{
-		unsigned char filter = filtered[pos];
+	return _mm_cvtsi32_si128((int)v);
+}
 
-		pos++;
+static inline void png_store_pixel(unsigned char* p, __m128i x, int n)
+{
+	unsigned v = (unsigned)_mm_cvtsi128_si32(x);
 
-		if(png->depth == 16)
-		{
-			for(i = 0; i < png->width * stride; i+=2)
-			{
-				*(short*)(filtered+pos+i) = (filtered[pos+i] << 8) | filtered[pos+i+1];
-			}
-		}
+	if(n == 4)
+		memcpy(p, &v, 4);
+	else
+	{
+		p[0] = (unsigned char)v;
+		p[1] = (unsigned char)(v >> 8);
+		p[2] = (unsigned char)(v >> 16);
+	}
+}
 
-		switch(filter)
-		{
-		case 0: /* none */
-			memcpy(data+outpos, filtered+pos, png->width * stride);
-			break;
-		case 1: /* sub */
-			png_filter_sub(stride, filtered+pos, data+outpos, png->width * stride);
-			break;
-		case 2: /* up */
-			if(outpos)
-				png_filter_up(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_up(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		case 3: /* average */
-			if(outpos)
-				png_filter_average(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_average(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		case 4: /* paeth */
-			if(outpos)
-				png_filter_paeth(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_paeth(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		default:
-			return PNG_UNKNOWN_FILTER;
-		}
+static void png_unfilter_up_sse2(const unsigned char* in, unsigned char* out, const unsigned char* prev_line, int len)
+{
+	int i = 0;
 
-		outpos += png->width * stride;
-		pos += png->width * stride;
+	for(; i + 16 <= len; i += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i*)(in + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(prev_line + i));
+		_mm_storeu_si128((__m128i*)(out + i), _mm_add_epi8(x, b));
 	}
 
-	return PNG_NO_ERROR;
+	for(; i < len; i++)
+		out[i] = in[i] + prev_line[i];
 }
 
-int png_get_data(png_t* png, unsigned char* data)
+static void png_unfilter_sub3_sse2(const unsigned char* in, unsigned char* out, int len)
 {
-	int result = PNG_NO_ERROR;
+	const __m128i mask = _mm_setr_epi32(0xffffff, 0, 0, 0);
+	__m128i a = _mm_setzero_si128();
+	int i = 0;
 
-	png->zs = NULL;
-	png->png_datalen = 0;
-	png->png_data = NULL;
-	png->readbuf = NULL;
-	png->readbuflen = 0;
-
-	while(result == PNG_NO_ERROR)
+	/* 4 pixels (12 bytes) per step; the 4 bytes after them are stored too, then overwritten */
+	for(; i + 16 <= len; i += 12)
 	{
-		result = png_process_chunk(png);
+		__m128i x = _mm_add_epi8(_mm_loadu_si128((const __m128i*)(in + i)), a);
+		x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+		x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+		_mm_storeu_si128((__m128i*)(out + i), x);
+		a = _mm_and_si128(_mm_srli_si128(x, 9), mask);
 	}
 
-	if (png->readbuf)
+	for(; i < len; i += 3)
 	{
-		png_free(png->readbuf);
-		png->readbuflen = 0;
+		a = _mm_add_epi8(png_load_pixel(in + i, 3), a);
+		png_store_pixel(out + i, a, 3);
 	}
-	if (png->zs)
+}
+
+static void png_unfilter_sub4_sse2(const unsigned char* in, unsigned char* out, int len)
+{
+	__m128i a = _mm_setzero_si128();
+	int i = 0;
+
+	for(; i + 16 <= len; i += 16)
 	{
-		png_end_inflate(png);
+		__m128i x = _mm_add_epi8(_mm_loadu_si128((const __m128i*)(in + i)), a);
+		x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+		x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+		_mm_storeu_si128((__m128i*)(out + i), x);
+		a = _mm_srli_si128(x, 12);
 	}
 
-	if(result != PNG_DONE)
+	for(; i < len; i += 4)
 	{
-		png_free(png->png_data);
-		return result;
+		a = _mm_add_epi8(png_load_pixel(in + i, 4), a);
+		png_store_pixel(out + i, a, 4);
 	}
+}
 
-	result = png_unfilter(png, data);
+/* unfilter one average-filtered pixel of n bytes, given the pixel to its left */
+static inline __m128i png_average_pixel_sse2(__m128i a, const unsigned char* in, unsigned char* out, const unsigned char* prev, int n)
+{
+	const __m128i ones = _mm_set1_epi8(1);
+	__m128i b = png_load_pixel(prev, n);
+	/* _mm_avg_epu8 rounds up, so subtract 1 where a + b is odd */
+	__m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), ones));
 
-	png_free(png->png_data);
+	a = _mm_add_epi8(png_load_pixel(in, n), avg);
+	png_store_pixel(out, a, n);
 
-	return result;
+	return a;
 }
 
-int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data)
+static inline void png_unfilter_average_sse2(int bpp, const unsigned char* in, unsigned char* out, const unsigned char* prev_line, int len)
 {
-	//int i;
-	unsigned i;
-	unsigned char *filtered;
-	png->width = width;
-	png->height = height;
-	png->depth = depth;
-	png->color_type = color;
-	png->bpp = png_get_bpp(png);
+	__m128i a = _mm_setzero_si128();
+	int i;
+
+	for(i = 0; i + 4 <= len; i += bpp)
+		a = png_average_pixel_sse2(a, in + i, out + i, prev_line + i, 4);
+
+	for(; i < len; i += bpp)
+		a = png_average_pixel_sse2(a, in + i, out + i, prev_line + i, bpp);
+}
+
+/* unfilter one paeth-filtered pixel of n bytes; a and c (the pixels to the left and above left, as 16-bit lanes) are updated for the next pixel */
+static inline void png_paeth_pixel_sse2(__m128i* a, __m128i* c, const unsigned char* in, unsigned char* out, const unsigned char* prev, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i b = _mm_unpacklo_epi8(png_load_pixel(prev, n), zero);
+	__m128i x = png_paeth_epi16_sse2(*a, b, *c);
+
+	x = _mm_add_epi8(png_load_pixel(in, n), _mm_packus_epi16(x, x));
+	png_store_pixel(out, x, n);
+
+	*a = _mm_unpacklo_epi8(x, zero);
+	*c = b;
+}
+
+static inline void png_unfilter_paeth_sse2(int bpp, const unsigned char* in, unsigned char* out, const unsigned char* prev_line, int len)
+{
+	__m128i a = _mm_setzero_si128();
+	__m128i c = _mm_setzero_si128();
+	int i;
+
+	for(i = 0; i + 4 <= len; i += bpp)
+		png_paeth_pixel_sse2(&a, &c, in + i, out + i, prev_line + i, 4);
 
-	filtered = png_alloc(width * height * png->bpp + height);
+	for(; i < len; i += bpp)
+		png_paeth_pixel_sse2(&a, &c, in + i, out + i, prev_line + i, bpp);
+}
 
-	for(i = 0; i < png->height; i++)
+/* unfilter a row of 3- or 4-byte pixels */
+static int png_unfilter_row_sse2(int stride, unsigned char filter, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+{
+	switch(filter)
 	{
-		filtered[i*png->width*png->bpp+i] = 0;
-		memcpy(&filtered[i*png->width*png->bpp+i+1], data + i * png->width*png->bpp, png->width*png->bpp);
+	case 0: /* none */
+		memcpy(out, in, len);
+		break;
+	case 1: /* sub */
+		if(stride == 3)
+			png_unfilter_sub3_sse2(in, out, len);
+		else
+			png_unfilter_sub4_sse2(in, out, len);
+		break;
+	case 2: /* up */
+		if(prev_line)
+			png_unfilter_up_sse2(in, out, prev_line, len);
+		else
+			memcpy(out, in, len);
+		break;
+	case 3: /* average */
+		if(!prev_line)
+			png_filter_average(stride, in, out, prev_line, len);
+		else if(stride == 3)
+			png_unfilter_average_sse2(3, in, out, prev_line, len);
+		else
+			png_unfilter_average_sse2(4, in, out, prev_line, len);
+		break;
+	case 4: /* paeth */
+		if(!prev_line)
+			return png_unfilter_row_sse2(stride, 1, in, out, prev_line, len);
+		else if(stride == 3)
+			png_unfilter_paeth_sse2(3, in, out, prev_line, len);
+		else
+			png_unfilter_paeth_sse2(4, in, out, prev_line, len);
+		break;
+	default:
+		return PNG_UNKNOWN_FILTER;
 	}
 
-	png_filter(png, filtered);
-	png_write_ihdr(png);
-	png_write_idats(png, filtered);
+	return PNG_NO_ERROR;
+}
+#endif
+
+static int png_unfilter_row(int stride, unsigned char filter, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+{
+#if USE_SSE2
+	if(stride == 3 || stride == 4)
+		return png_unfilter_row_sse2(stride, filter, in, out, prev_line, len);
+#endif
 
-	png_free(filtered);
+	switch(filter)
+	{
+	case 0: /* none */
+		memcpy(out, in, len);
+		break;
+	case 1: /* sub */
+		png_filter_sub(stride, in, out, len);
+		break;
+	case 2: /* up */
+		png_filter_up(stride, in, out, prev_line, len);
+		break;
+	case 3: /* average */
+		png_filter_average(stride, in, out, prev_line, len);
+		break;
+	case 4: /* paeth */
+		png_filter_paeth(stride, in, out, prev_line, len);
+		break;
+	default:
+		return PNG_UNKNOWN_FILTER;
+	}
 
 	return PNG_NO_ERROR;
 }
 
+/* unfilter rows first to last - 1 into data; the row before first is taken to be all zeros */
+static int png_unfilter_rows(png_t* png, unsigned char* data, unsigned first, unsigned last)
+{
+	unsigned i;
+	unsigned rowlen = png_row_bytes(png);
+	unsigned pos = first * (rowlen + 1);
+	unsigned outpos = first * rowlen;
+	unsigned endpos = last * (rowlen + 1);
+	unsigned char *filtered = png->png_data;
+	int result;
+
+	int stride = png->bpp;
+
+	while(pos < endpos)
+	{
+		unsigned char filter = filtered[pos];
+
+		pos++;
+
+		if(png->depth == 16)
+		{
+			for(i = 0; i < rowlen; i+=2)
+			{
+				*(short*)(filtered+pos+i) = (filtered[pos+i] << 8) | filtered[pos+i+1];
+			}
+		}
+
+		result = png_unfilter_row(stride, filter, filtered+pos, data+outpos,
+			outpos > first * rowlen ? data + outpos - rowlen : 0, rowlen);
+		if(result != PNG_NO_ERROR)
+			return result;
+
+		outpos += rowlen;
+		pos += rowlen;
+	}
+
+	return PNG_NO_ERROR;
+}
+
+static int png_unfilter(png_t* png, unsigned char* data)
+{
+	return png_unfilter_rows(png, data, 0, png->height);
+}
+
+/*
+	Row conversion from unfiltered data (with 16-bit samples in PNG byte order) to 4-byte
+	RGBA pixels. If swap is set, the bytes of each output pixel are reversed (A,B,G,R),
+	which is the layout of 0xRRGGBBAA uint32_t values on a little-endian host.
+*/
+
+typedef void (*png_convert_row_t)(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap);
+
+static void png_convert_rgb(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned i;
+
+	if(swap)
+	{
+		for(i = 0; i < width; i++, in += 3, out += 4)
+		{
+			out[0] = 255;
+			out[1] = in[2];
+			out[2] = in[1];
+			out[3] = in[0];
+		}
+	}
+	else
+	{
+		for(i = 0; i < width; i++, in += 3, out += 4)
+		{
+			out[0] = in[0];
+			out[1] = in[1];
+			out[2] = in[2];
+			out[3] = 255;
+		}
+	}
+}
+
+static void png_convert_rgba(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned i;
+
+	if(!swap)
+	{
+		memcpy(out, in, width * 4);
+		return;
+	}
+
+	for(i = 0; i < width; i++, in += 4, out += 4)
+	{
+		out[0] = in[3];
+		out[1] = in[2];
+		out[2] = in[1];
+		out[3] = in[0];
+	}
+}
+
+static void png_convert_grey(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned i;
+
+	for(i = 0; i < width; i++, in++, out += 4)
+	{
+		out[swap ? 1 : 0] = in[0];
+		out[swap ? 2 : 1] = in[0];
+		out[swap ? 3 : 2] = in[0];
+		out[swap ? 0 : 3] = 255;
+	}
+}
+
+static void png_convert_grey_alpha(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned i;
+
+	for(i = 0; i < width; i++, in += 2, out += 4)
+	{
+		out[swap ? 1 : 0] = in[0];
+		out[swap ? 2 : 1] = in[0];
+		out[swap ? 3 : 2] = in[0];
+		out[swap ? 0 : 3] = in[1];
+	}
+}
+
+static void png_convert_palette(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned i;
+	unsigned v;
+
+	for(i = 0; i < width; i++, out += 4)
+	{
+		memcpy(&v, png->palette[in[i]], 4);
+		if(swap)
+			v = __builtin_bswap32(v);
+		memcpy(out, &v, 4);
+	}
+}
+
+/* sample index of an unfiltered row of samples of depth bits */
+static unsigned png_get_sample(const unsigned char* row, unsigned index, unsigned depth)
+{
+	unsigned bit;
+
+	if(depth == 8)
+		return row[index];
+	if(depth == 16)
+		return (row[index * 2] << 8) | row[index * 2 + 1];
+
+	/* packed, most significant bits first */
+	bit = index * depth;
+	return (row[bit >> 3] >> (8 - depth - (bit & 7))) & ((1 << depth) - 1);
+}
+
+/*
+	Conversion of anything a pixel at a time: greyscale of 1, 2 or 4 bits (scaled to 8), palette
+	indices of any depth, 16-bit samples (whose most significant byte is kept), and greyscale or
+	truecolor with a tRNS color key, matching pixels of which are made transparent.
+*/
+static void png_convert_any(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned depth = png->depth;
+	unsigned channels = png->color_type == PNG_TRUECOLOR_ALPHA ? 4 : png->color_type == PNG_TRUECOLOR ? 3 :
+		png->color_type == PNG_GREYSCALE_ALPHA ? 2 : 1;
+	unsigned scale = depth < 8 ? 255 / ((1 << depth) - 1) : 1;
+	unsigned s[4];
+	unsigned char p[4];
+	unsigned i, c;
+
+	for(i = 0; i < width; i++, out += 4)
+	{
+		for(c = 0; c < channels; c++)
+			s[c] = png_get_sample(in, i * channels + c, depth);
+
+		if(png->color_type == PNG_INDEXED)
+		{
+			memcpy(p, png->palette[s[0]], 4);
+		}
+		else
+		{
+			int key = png->has_trns_key && (channels == 1 ? s[0] == png->trns_key[0] :
+				s[0] == png->trns_key[0] && s[1] == png->trns_key[1] && s[2] == png->trns_key[2]);
+
+			for(c = 0; c < channels; c++)
+				s[c] = depth == 16 ? s[c] >> 8 : s[c] * scale;
+
+			p[0] = (unsigned char)s[0];
+			p[1] = (unsigned char)s[channels >= 3 ? 1 : 0];
+			p[2] = (unsigned char)s[channels >= 3 ? 2 : 0];
+			p[3] = key ? 0 : (channels == 2 || channels == 4) ? (unsigned char)s[channels - 1] : 255;
+		}
+
+		out[swap ? 3 : 0] = p[0];
+		out[swap ? 2 : 1] = p[1];
+		out[swap ? 1 : 2] = p[2];
+		out[swap ? 0 : 3] = p[3];
+	}
+}
+
+#if USE_SSSE3
+__attribute__((target("ssse3")))
+static void png_convert_rgb_ssse3(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned i = 0;
+	const __m128i shuf = swap ?
+		_mm_setr_epi8(-1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9) :
+		_mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m128i alpha = _mm_set1_epi32(swap ? 0x000000ff : (int)0xff000000);
+
+	/* each step expands 4 pixels, but loads 16 bytes, so stop while 6 pixels remain */
+	for(; i + 6 <= width; i += 4)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(in + i*3));
+		v = _mm_or_si128(_mm_shuffle_epi8(v, shuf), alpha);
+		_mm_storeu_si128((__m128i*)(out + i*4), v);
+	}
+
+	png_convert_rgb(png, in + i*3, out + i*4, width - i, swap);
+}
+
+__attribute__((target("ssse3")))
+static void png_convert_rgba_ssse3(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned i = 0;
+	const __m128i shuf = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+
+	if(swap)
+	{
+		for(; i + 4 <= width; i += 4)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)(in + i*4));
+			_mm_storeu_si128((__m128i*)(out + i*4), _mm_shuffle_epi8(v, shuf));
+		}
+	}
+
+	png_convert_rgba(png, in + i*4, out + i*4, width - i, swap);
+}
+
+/* the shuffles below zero bytes with -128 rather than -1, so that adding a
+   pixel offset to the whole mask leaves them zeroing */
+
+__attribute__((target("ssse3")))
+static void png_convert_grey_ssse3(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned i = 0;
+	unsigned j;
+	const __m128i shuf = swap ?
+		_mm_setr_epi8(-128, 0, 0, 0, -128, 1, 1, 1, -128, 2, 2, 2, -128, 3, 3, 3) :
+		_mm_setr_epi8(0, 0, 0, -128, 1, 1, 1, -128, 2, 2, 2, -128, 3, 3, 3, -128);
+	const __m128i four = _mm_set1_epi8(4);
+	const __m128i alpha = _mm_set1_epi32(swap ? 0x000000ff : (int)0xff000000);
+
+	/* 16 pixels from each load, 4 from each shuffle */
+	for(; i + 16 <= width; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+		__m128i s = shuf;
+
+		for(j = 0; j < 4; j++, s = _mm_add_epi8(s, four))
+			_mm_storeu_si128((__m128i*)(out + (i + j*4)*4), _mm_or_si128(_mm_shuffle_epi8(v, s), alpha));
+	}
+
+	png_convert_grey(png, in + i, out + i*4, width - i, swap);
+}
+
+__attribute__((target("ssse3")))
+static void png_convert_grey_alpha_ssse3(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned i = 0;
+	const __m128i shuf = swap ?
+		_mm_setr_epi8(1, 0, 0, 0, 3, 2, 2, 2, 5, 4, 4, 4, 7, 6, 6, 6) :
+		_mm_setr_epi8(0, 0, 0, 1, 2, 2, 2, 3, 4, 4, 4, 5, 6, 6, 6, 7);
+	const __m128i eight = _mm_set1_epi8(8);
+
+	/* 8 pixels from each load, 4 from each shuffle */
+	for(; i + 8 <= width; i += 8)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(in + i*2));
+		_mm_storeu_si128((__m128i*)(out + i*4), _mm_shuffle_epi8(v, shuf));
+		_mm_storeu_si128((__m128i*)(out + i*4 + 16), _mm_shuffle_epi8(v, _mm_add_epi8(shuf, eight)));
+	}
+
+	png_convert_grey_alpha(png, in + i*2, out + i*4, width - i, swap);
+}
+
+/* 16-bit samples keep their first (most significant) byte */
+
+__attribute__((target("ssse3")))
+static void png_convert_grey16_ssse3(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned i = 0;
+	const __m128i shuf = swap ?
+		_mm_setr_epi8(-128, 0, 0, 0, -128, 2, 2, 2, -128, 4, 4, 4, -128, 6, 6, 6) :
+		_mm_setr_epi8(0, 0, 0, -128, 2, 2, 2, -128, 4, 4, 4, -128, 6, 6, 6, -128);
+	const __m128i eight = _mm_set1_epi8(8);
+	const __m128i alpha = _mm_set1_epi32(swap ? 0x000000ff : (int)0xff000000);
+
+	for(; i + 8 <= width; i += 8)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(in + i*2));
+		_mm_storeu_si128((__m128i*)(out + i*4), _mm_or_si128(_mm_shuffle_epi8(v, shuf), alpha));
+		_mm_storeu_si128((__m128i*)(out + i*4 + 16),
+			_mm_or_si128(_mm_shuffle_epi8(v, _mm_add_epi8(shuf, eight)), alpha));
+	}
+
+	png_convert_any(png, in + i*2, out + i*4, width - i, swap);
+}
+
+__attribute__((target("ssse3")))
+static void png_convert_grey_alpha16_ssse3(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned i = 0;
+	const __m128i shuf = swap ?
+		_mm_setr_epi8(2, 0, 0, 0, 6, 4, 4, 4, 10, 8, 8, 8, 14, 12, 12, 12) :
+		_mm_setr_epi8(0, 0, 0, 2, 4, 4, 4, 6, 8, 8, 8, 10, 12, 12, 12, 14);
+
+	for(; i + 4 <= width; i += 4)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(in + i*4));
+		_mm_storeu_si128((__m128i*)(out + i*4), _mm_shuffle_epi8(v, shuf));
+	}
+
+	png_convert_any(png, in + i*4, out + i*4, width - i, swap);
+}
+
+__attribute__((target("ssse3")))
+static void png_convert_rgb16_ssse3(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned i = 0;
+	const __m128i shuf = swap ?
+		_mm_setr_epi8(-128, 4, 2, 0, -128, 10, 8, 6, -128, -128, -128, -128, -128, -128, -128, -128) :
+		_mm_setr_epi8(0, 2, 4, -128, 6, 8, 10, -128, -128, -128, -128, -128, -128, -128, -128, -128);
+	const __m128i alpha = _mm_set1_epi32(swap ? 0x000000ff : (int)0xff000000);
+
+	/* 2 pixels from each load of 16 bytes, of which the second ends 4 bytes
+	   past the 4 pixels, so stop while 5 pixels remain */
+	for(; i + 5 <= width; i += 4)
+	{
+		__m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i*6)), shuf);
+		__m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i*6 + 12)), shuf);
+		_mm_storeu_si128((__m128i*)(out + i*4), _mm_or_si128(_mm_unpacklo_epi64(a, b), alpha));
+	}
+
+	png_convert_any(png, in + i*6, out + i*4, width - i, swap);
+}
+
+__attribute__((target("ssse3")))
+static void png_convert_rgba16_ssse3(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned i = 0;
+	const __m128i shuf = swap ?
+		_mm_setr_epi8(6, 4, 2, 0, 14, 12, 10, 8, -128, -128, -128, -128, -128, -128, -128, -128) :
+		_mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, -128, -128, -128, -128, -128, -128, -128, -128);
+
+	for(; i + 4 <= width; i += 4)
+	{
+		__m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i*8)), shuf);
+		__m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i*8 + 16)), shuf);
+		_mm_storeu_si128((__m128i*)(out + i*4), _mm_unpacklo_epi64(a, b));
+	}
+
+	png_convert_any(png, in + i*8, out + i*4, width - i, swap);
+}
+#endif
+
+/* the converter to RGBA for png, which must have read the chunks before its image data */
+static png_convert_row_t png_get_rgba_converter(png_t* png)
+{
+	if(png->color_type == PNG_INDEXED)
+		return png->depth == 8 ? png_convert_palette : png_convert_any;
+	if(png->depth < 8 || png->has_trns_key)
+		return png_convert_any;
+
+#if USE_SSSE3
+	if(__builtin_cpu_supports("ssse3"))
+	{
+		if(png->color_type == PNG_TRUECOLOR)
+			return png->depth == 16 ? png_convert_rgb16_ssse3 : png_convert_rgb_ssse3;
+		if(png->color_type == PNG_TRUECOLOR_ALPHA)
+			return png->depth == 16 ? png_convert_rgba16_ssse3 : png_convert_rgba_ssse3;
+		if(png->color_type == PNG_GREYSCALE)
+			return png->depth == 16 ? png_convert_grey16_ssse3 : png_convert_grey_ssse3;
+		if(png->color_type == PNG_GREYSCALE_ALPHA)
+			return png->depth == 16 ? png_convert_grey_alpha16_ssse3 : png_convert_grey_alpha_ssse3;
+	}
+#endif
+
+	if(png->depth == 16)
+		return png_convert_any;
+	if(png->color_type == PNG_TRUECOLOR)
+		return png_convert_rgb;
+	if(png->color_type == PNG_TRUECOLOR_ALPHA)
+		return png_convert_rgba;
+	if(png->color_type == PNG_GREYSCALE)
+		return png_convert_grey;
+	if(png->color_type == PNG_GREYSCALE_ALPHA)
+		return png_convert_grey_alpha;
+
+	return 0;
+}
+
+/* true if png's unfiltered rows are already RGBA, as png_get_data_rgba returns them without swap */
+static int png_is_rgba(png_t* png)
+{
+	return png->color_type == PNG_TRUECOLOR_ALPHA && png->depth == 8;
+}
+
+/* unfilter rows first to last - 1 into data as RGBA; the row before first is taken to be all zeros */
+static int png_unfilter_rgba_rows(png_t* png, unsigned char* data, int swap, unsigned first, unsigned last)
+{
+	unsigned y;
+	unsigned rowlen = png_row_bytes(png);
+	unsigned pos = first * (rowlen + 1);
+	unsigned char *filtered = png->png_data;
+	unsigned char *rows;
+	unsigned char *cur;
+	unsigned char *prev = 0;
+	int result = PNG_NO_ERROR;
+	png_convert_row_t convert = png_get_rgba_converter(png);
+
+	if(!convert)
+		return PNG_NOT_SUPPORTED;
+
+	/* already in the requested format, so unfilter straight into data */
+	if(png_is_rgba(png) && !swap)
+		return png_unfilter_rows(png, data, first, last);
+
+	/* unfilter into a two-row window (the up, average and paeth filters need
+	   the previous row in PNG format) and convert each row into data */
+	rows = png_alloc(png, rowlen * 2);
+	if(!rows)
+		return PNG_MEMORY_ERROR;
+
+	cur = rows;
+	for(y = first; y < last; y++)
+	{
+		result = png_unfilter_row(png->bpp, filtered[pos], filtered+pos+1, cur, prev, rowlen);
+		if(result != PNG_NO_ERROR)
+			break;
+
+		convert(png, cur, data + (size_t)y * png->width * 4, png->width, swap);
+
+		pos += rowlen + 1;
+		prev = cur;
+		cur = (cur == rows) ? rows + rowlen : rows;
+	}
+
+	png_free(png, rows);
+
+	return result;
+}
+
+static int png_unfilter_rgba(png_t* png, unsigned char* data, int swap)
+{
+	return png_unfilter_rgba_rows(png, data, swap, 0, png->height);
+}
+
+#if USE_THREADS
+typedef struct
+{
+	png_t*			png;
+	unsigned char*		data;
+	int			rgba;	/* unfilter with png_unfilter_rgba_rows, else png_unfilter_rows */
+	int			swap;
+	unsigned		num_segs;
+	unsigned long*		adlers;	/* adler32 of each segment's filtered data */
+	unsigned		next_seg;
+	int			result;
+	int			unfilter_serially;	/* set if a segment does not start with a restart row */
+	pthread_mutex_t		lock;
+} png_decoder_t;
+
+/* get the first row and compressed data offset of segment index, which ends where segment index + 1 starts */
+static void png_segment_start(png_t* png, unsigned index, unsigned* row, unsigned* offset)
+{
+	if(index == 0)
+	{
+		*row = 0;
+		*offset = 0;
+	}
+	else if(index > png->num_restarts)
+	{
+		*row = png->height;
+		*offset = png->writebuflen - 4;	/* the adler32 follows the last segment */
+	}
+	else
+	{
+		*row = png->restarts[2 * index - 2];
+		*offset = png->restarts[2 * index - 1];
+	}
+}
+
+static int png_decode_segment(png_decoder_t* dec, unsigned index)
+{
+	png_t* png = dec->png;
+	unsigned rowlen = png_row_bytes(png);
+	unsigned first, last, start, end;
+	unsigned char* filtered;
+	z_stream stream;
+	int result;
+
+	png_segment_start(png, index, &first, &start);
+	png_segment_start(png, index + 1, &last, &end);
+	filtered = png->png_data + first * (rowlen + 1);
+
+	/* the first segment starts with the zlib header, the others are raw deflate data */
+	memset(&stream, 0, sizeof(stream));
+	if(inflateInit2(&stream, index ? -15 : 15) != Z_OK)
+		return PNG_ZLIB_ERROR;
+
+	stream.next_in = png->writebuf + start;
+	stream.avail_in = end - start;
+	stream.next_out = filtered;
+	stream.avail_out = (last - first) * (rowlen + 1);
+
+	result = inflate(&stream, Z_SYNC_FLUSH);
+	inflateEnd(&stream);
+
+	if((result != Z_OK && result != Z_STREAM_END) || stream.avail_out != 0)
+		return PNG_ZLIB_ERROR;
+
+	dec->adlers[index] = adler32(adler32(0L, Z_NULL, 0), filtered, (last - first) * (rowlen + 1));
+
+	if(filtered[0] > 1)
+	{
+		pthread_mutex_lock(&dec->lock);
+		dec->unfilter_serially = 1;
+		pthread_mutex_unlock(&dec->lock);
+		return PNG_NO_ERROR;
+	}
+
+	if(dec->rgba)
+		return png_unfilter_rgba_rows(png, dec->data, dec->swap, first, last);
+
+	return png_unfilter_rows(png, dec->data, first, last);
+}
+
+static void* png_decode_worker(void* arg)
+{
+	png_decoder_t* dec = arg;
+	unsigned index;
+	int result;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&dec->lock);
+		index = dec->next_seg++;
+		if(dec->result != PNG_NO_ERROR)
+			index = dec->num_segs;
+		pthread_mutex_unlock(&dec->lock);
+
+		if(index >= dec->num_segs)
+			break;
+
+		result = png_decode_segment(dec, index);
+
+		if(result != PNG_NO_ERROR)
+		{
+			pthread_mutex_lock(&dec->lock);
+			dec->result = result;
+			pthread_mutex_unlock(&dec->lock);
+		}
+	}
+
+	return 0;
+}
+
+/*
+	Decode the compressed data collected in png->writebuf into data, inflating and unfiltering
+	the segments between restart points on up to png->threads threads (one of which is the
+	calling thread). Frees png->writebuf and png->restarts.
+*/
+static int png_decode_segments(png_t* png, unsigned char* data, int rgba, int swap)
+{
+	png_decoder_t dec;
+	pthread_t* threads;
+	unsigned num_threads = png->threads;
+	unsigned started = 0;
+	unsigned long adler;
+	unsigned i;
+	int result;
+
+	memset(&dec, 0, sizeof(dec));
+	dec.png = png;
+	dec.data = data;
+	dec.rgba = rgba;
+	dec.swap = swap;
+	dec.num_segs = png->num_restarts + 1;
+	dec.result = PNG_NO_ERROR;
+
+	/* the last restart point must leave room for the last segment and the adler32 */
+	if(png->writebuflen < 4 || png->restarts[2 * png->num_restarts - 1] >= png->writebuflen - 4)
+		result = PNG_ZLIB_ERROR;
+	else
+		result = PNG_NO_ERROR;
+
+	if(num_threads > dec.num_segs)
+		num_threads = dec.num_segs;
+
+	dec.adlers = png_alloc(png, dec.num_segs * sizeof(unsigned long));
+	threads = png_alloc(png, num_threads * sizeof(pthread_t));
+	if(!dec.adlers || !threads)
+		result = PNG_MEMORY_ERROR;
+
+	if(result == PNG_NO_ERROR)
+	{
+		pthread_mutex_init(&dec.lock, 0);
+
+		while(started + 1 < num_threads && pthread_create(&threads[started], 0, png_decode_worker, &dec) == 0)
+			started++;
+
+		png_decode_worker(&dec);
+
+		for(i = 0; i < started; i++)
+			pthread_join(threads[i], 0);
+
+		pthread_mutex_destroy(&dec.lock);
+
+		result = dec.result;
+	}
+
+	if(result == PNG_NO_ERROR)
+	{
+		unsigned rowlen = png_row_bytes(png);
+		unsigned first, last, offset;
+
+		/* check the adler32 of all of the data, combined from the segments' */
+		adler = adler32(0L, Z_NULL, 0);
+		for(i = 0; i < dec.num_segs; i++)
+		{
+			png_segment_start(png, i, &first, &offset);
+			png_segment_start(png, i + 1, &last, &offset);
+			adler = adler32_combine(adler, dec.adlers[i], (z_off_t)(last - first) * (rowlen + 1));
+		}
+
+		if(adler != get_ul(png->writebuf + png->writebuflen - 4))
+			result = PNG_ZLIB_ERROR;
+	}
+
+	/* if the restart points turned out to be unusable, inflate all of the data serially */
+	if(result != PNG_NO_ERROR && result != PNG_MEMORY_ERROR)
+	{
+		result = png_init_inflate(png);
+		if(result == PNG_NO_ERROR)
+			result = png_inflate(png, png->writebuf, png->writebuflen);
+		if(png->zs)
+		{
+			png_end_inflate(png);
+			png->zs = 0;
+		}
+		dec.unfilter_serially = 1;
+	}
+
+	if(result == PNG_NO_ERROR && dec.unfilter_serially)
+		result = rgba ? png_unfilter_rgba(png, data, swap) : png_unfilter(png, data);
+
+	png_free(png, dec.adlers);
+	png_free(png, threads);
+	png_free(png, png->writebuf);
+	png_free(png, png->restarts);
+	png->writebuf = 0;
+	png->restarts = 0;
+
+	return result;
+}
+#endif
+
+/*
+	Row-at-a-time decoding. The compressed data is inflated one row at a time into
+	png->rowbuf as the IDAT chunks are read, and each row is unfiltered against the
+	previous one, which is kept in png->prevrow (or in the caller's buffer), so the
+	memory used beyond the caller's buffer is one IDAT chunk and a few rows, however
+	large the image is.
+*/
+
+/*
+	Read up to the first IDAT chunk and set up inflating it. If restarts is nonzero and
+	usable restart points were found, the IDAT data is collected in png->writebuf instead.
+*/
+static int png_begin_rows(png_t* png, int restarts)
+{
+	unsigned rowlen = png_row_bytes(png);
+	unsigned char* idat;
+	unsigned length;
+	int result;
+#if USE_ZLIB
+	z_stream *stream;
+#else
+	zl_stream *stream;
+#endif
+
+	result = png_next_idat(png, &idat, &length, restarts);
+	if(result == PNG_DONE)
+		return PNG_EOF_ERROR;
+	if(result != PNG_NO_ERROR)
+		return result;
+
+#if USE_THREADS
+	if(png->restarts)
+		return png_append_idat(png, idat, length);
+#endif
+
+	png->rowbuf = png_alloc(png, rowlen + 1);
+	png->filterbuf = png_alloc(png, rowlen * 2);
+	if(!png->rowbuf || !png->filterbuf)
+		return PNG_MEMORY_ERROR;
+
+	png->prevrow = png->filterbuf;
+	png->currow = png->filterbuf + rowlen;
+
+	result = png_init_inflate(png);
+	if(result != PNG_NO_ERROR)
+		return result;
+
+	stream = png->zs;
+	stream->next_in = idat;
+	stream->avail_in = length;
+
+	return PNG_NO_ERROR;
+}
+
+/* a source of compressed data for png_inflate_rows, which points png->zs at the next piece of it */
+typedef int (*png_input_t)(png_t* png, void* arg);
+
+/* png_input_t which reads the next IDAT chunk */
+static int png_read_input(png_t* png, void* arg)
+{
+	unsigned char* idat;
+	unsigned length;
+	int result;
+#if USE_ZLIB
+	z_stream *stream = png->zs;
+#else
+	zl_stream *stream = png->zs;
+#endif
+
+	(void)arg;
+
+	result = png_next_idat(png, &idat, &length, 0);
+	if(result == PNG_DONE)
+		return PNG_EOF_ERROR;
+	if(result != PNG_NO_ERROR)
+		return result;
+
+	stream->next_in = idat;
+	stream->avail_in = length;
+
+	return PNG_NO_ERROR;
+}
+
+/*
+	Inflate len bytes into out, getting more compressed data from input as needed. If len
+	is 0, inflate the rest of the data instead, which checks the adler32 at its end, and
+	fail if there is more image data than expected.
+*/
+static int png_inflate_rows(png_t* png, unsigned char* out, unsigned len, png_input_t input, void* arg)
+{
+	unsigned char extra;
+	int result;
+#if USE_ZLIB
+	z_stream *stream = png->zs;
+#else
+	zl_stream *stream = png->zs;
+#endif
+
+	stream->next_out = len ? out : &extra;
+	stream->avail_out = len ? len : 1;
+
+	for(;;)
+	{
+#if USE_ZLIB
+		result = inflate(stream, Z_SYNC_FLUSH);
+#else
+		result = z_inflate(stream);
+#endif
+
+		if(result == Z_BUF_ERROR && stream->avail_in == 0)	/* needs the next IDAT chunk */
+			result = Z_OK;
+
+		if(result != Z_STREAM_END && result != Z_OK)
+			return PNG_ZLIB_ERROR;
+
+		if(len == 0)
+		{
+			if(stream->avail_out == 0)
+				return PNG_ZLIB_ERROR;
+			if(result == Z_STREAM_END)
+				return PNG_NO_ERROR;
+		}
+		else if(stream->avail_out == 0)
+		{
+			return PNG_NO_ERROR;
+		}
+		else if(result == Z_STREAM_END)
+		{
+			return PNG_ZLIB_ERROR;
+		}
+
+		if(stream->avail_in == 0)
+		{
+			result = input(png, arg);
+			if(result != PNG_NO_ERROR)
+				return result;
+		}
+	}
+}
+
+/* unfilter one row of inflated data (filter type byte first) into out, like png_unfilter_rows if
+   host_order is set, else leaving 16-bit samples in PNG byte order for a converter */
+static int png_unfilter_filtered_row(png_t* png, unsigned char* filtered, unsigned char* out, unsigned char* prev,
+	int host_order)
+{
+	unsigned rowlen = png_row_bytes(png);
+	unsigned i;
+
+	if(png->depth == 16 && host_order)
+	{
+		for(i = 0; i < rowlen; i+=2)
+		{
+			*(short*)(filtered+1+i) = (filtered[1+i] << 8) | filtered[2+i];
+		}
+	}
+
+	return png_unfilter_row(png->bpp, filtered[0], filtered + 1, out, prev, rowlen);
+}
+
+/* decode up to rows rows into data, converting each with convert if it is not 0 */
+static int png_read_rows_convert(png_t* png, unsigned char* data, unsigned rows, png_convert_row_t convert, int swap)
+{
+	unsigned rowlen = png_row_bytes(png);
+	/* size_t, so that offsets into an image of more than 4 GiB do not wrap */
+	size_t outlen = convert ? (size_t)png->width * 4 : rowlen;
+	unsigned char* out;
+	unsigned char* prev;
+	unsigned n;
+	int result = PNG_NO_ERROR;
+
+	if(png->next_row >= png->height)
+		return 0;
+
+	if(!png->rowbuf)
+		result = png_begin_rows(png, 0);
+
+	for(n = 0; n < rows && png->next_row < png->height && result == PNG_NO_ERROR; n++)
+	{
+		/* rows which are not converted are unfiltered straight into data, and
+		   the previous row is taken from there if this call decoded it */
+		out = convert ? png->currow : data + n * outlen;
+		if(png->next_row == 0)
+			prev = 0;
+		else if(convert || n == 0)
+			prev = png->prevrow;
+		else
+			prev = out - outlen;
+
+		result = png_inflate_rows(png, png->rowbuf, rowlen + 1, png_read_input, 0);
+		if(result != PNG_NO_ERROR)
+			break;
+
+		result = png_unfilter_filtered_row(png, png->rowbuf, out, prev, !convert);
+		if(result != PNG_NO_ERROR)
+			break;
+
+		if(convert)
+		{
+			convert(png, out, data + n * outlen, png->width, swap);
+			png->currow = png->prevrow;
+			png->prevrow = out;
+		}
+
+		png->next_row++;
+	}
+
+	if(result == PNG_NO_ERROR && png->next_row == png->height)
+		result = png_inflate_rows(png, 0, 0, png_read_input, 0);
+
+	if(result != PNG_NO_ERROR || png->next_row == png->height)
+	{
+		png_read_rows_end(png);
+		return result != PNG_NO_ERROR ? result : (int)n;
+	}
+
+	/* keep the last row for unfiltering the first row of the next call */
+	if(!convert && n > 0)
+		memcpy(png->prevrow, data + (n - 1) * outlen, rowlen);
+
+	return n;
+}
+
+int png_read_rows(png_t* png, unsigned char* data, unsigned rows)
+{
+	return png_read_rows_convert(png, data, rows, 0, 0);
+}
+
+int png_read_rows_rgba(png_t* png, unsigned char* data, unsigned rows, int swap)
+{
+	png_convert_row_t convert;
+	int result;
+
+	/* the converter depends on the PLTE and tRNS chunks, which come before the image data */
+	if(!png->rowbuf && png->next_row < png->height)
+	{
+		result = png_begin_rows(png, 0);
+		if(result != PNG_NO_ERROR)
+		{
+			png_read_rows_end(png);
+			return result;
+		}
+	}
+
+	convert = png_get_rgba_converter(png);
+	if(!convert)
+		return PNG_NOT_SUPPORTED;
+
+	/* already in the requested format */
+	if(png_is_rgba(png) && !swap)
+		convert = 0;
+
+	return png_read_rows_convert(png, data, rows, convert, swap);
+}
+
+/* convert every xstep-th pixel of an unfiltered 8-bit greyscale or truecolor row to RGBA, like png_convert_rgba
+   and the others */
+static void png_sample_rgba(const unsigned char* in, unsigned char* out, unsigned width, unsigned bpp, unsigned xstep, int swap)
+{
+	unsigned i;
+	unsigned g = bpp >= 3 ? 1 : 0;	/* offsets of green and blue, which are grey's for greyscale */
+	unsigned b = bpp >= 3 ? 2 : 0;
+	unsigned char a;
+
+	for(i = 0; i < width; i++, in += bpp * xstep, out += 4)
+	{
+		a = (bpp == 2 || bpp == 4) ? in[bpp - 1] : 255;
+
+		if(swap)
+		{
+			out[0] = a;
+			out[1] = in[b];
+			out[2] = in[g];
+			out[3] = in[0];
+		}
+		else
+		{
+			out[0] = in[0];
+			out[1] = in[g];
+			out[2] = in[b];
+			out[3] = a;
+		}
+	}
+}
+
+int png_get_data_rgba_sampled(png_t* png, unsigned char* data, unsigned xstep, unsigned ystep, int swap)
+{
+	unsigned rowlen = png_row_bytes(png);
+	unsigned out_width, out_height, rows, y, x;
+	png_convert_row_t convert;
+	unsigned char* out;
+	unsigned char* tmp;
+	unsigned char* full = 0;
+	int result;
+
+	if(!xstep || !ystep)
+		return PNG_WRONG_ARGUMENTS;
+
+	out_width = png->width / xstep;
+	out_height = png->height / ystep;
+
+	/* every row up to the last one sampled must be unfiltered, since
+	   each row may be filtered against the one above */
+	rows = out_height ? (out_height - 1) * ystep + 1 : 0;
+
+	result = png_begin_rows(png, 0);
+
+	/* chosen once the PLTE and tRNS chunks have been read; the 8-bit formats png_sample_rgba
+	   handles are sampled directly, and anything else is converted a whole row at a time */
+	convert = png_get_rgba_converter(png);
+	if(result == PNG_NO_ERROR && !convert)
+		result = PNG_NOT_SUPPORTED;
+	if(result == PNG_NO_ERROR && xstep > 1 && (png->depth != 8 || png->color_type == PNG_INDEXED || png->has_trns_key))
+	{
+		full = png_alloc(png, png->width * 4);
+		if(!full)
+			result = PNG_MEMORY_ERROR;
+	}
+
+	for(y = 0; y < rows && result == PNG_NO_ERROR; y++)
+	{
+		result = png_inflate_rows(png, png->rowbuf, rowlen + 1, png_read_input, 0);
+		if(result != PNG_NO_ERROR)
+			break;
+
+		result = png_unfilter_row(png->bpp, png->rowbuf[0], png->rowbuf + 1, png->currow, y ? png->prevrow : 0, rowlen);
+		if(result != PNG_NO_ERROR)
+			break;
+
+		/* only the sampled pixels are converted */
+		if(y % ystep == 0)
+		{
+			out = data + (y / ystep) * out_width * 4;
+			if(xstep == 1)
+			{
+				convert(png, png->currow, out, out_width, swap);
+			}
+			else if(full)
+			{
+				convert(png, png->currow, full, png->width, swap);
+				for(x = 0; x < out_width; x++)
+					memcpy(out + x * 4, full + x * xstep * 4, 4);
+			}
+			else
+			{
+				png_sample_rgba(png->currow, out, out_width, png->bpp, xstep, swap);
+			}
+		}
+
+		tmp = png->prevrow;
+		png->prevrow = png->currow;
+		png->currow = tmp;
+	}
+
+	png_free(png, full);
+	png_read_rows_end(png);
+
+	return result;
+}
+
+int png_read_rows_end(png_t* png)
+{
+	if(png->zs)
+	{
+		png_end_inflate(png);
+		png->zs = 0;
+	}
+
+	png_free(png, png->readbuf);
+	png_free(png, png->rowbuf);
+	png_free(png, png->filterbuf);
+	png_free(png, png->writebuf);
+	png_free(png, png->restarts);
+	png->readbuf = 0;
+	png->readbuflen = 0;
+	png->rowbuf = 0;
+	png->filterbuf = 0;
+	png->writebuf = 0;
+	png->restarts = 0;
+	png->num_restarts = 0;
+
+	/* later calls to png_read_rows return 0 */
+	png->next_row = png->height;
+
+	return PNG_NO_ERROR;
+}
+
+#if USE_THREADS
+/* read the rest of the compressed data into png->writebuf, and decode it with png_decode_segments */
+static int png_read_segments(png_t* png, unsigned char* data, int rgba, int swap)
+{
+	unsigned char* idat;
+	unsigned length;
+	int result;
+
+	while((result = png_next_idat(png, &idat, &length, 0)) == PNG_NO_ERROR)
+	{
+		result = png_append_idat(png, idat, length);
+		if(result != PNG_NO_ERROR)
+			return result;
+	}
+
+	if(result != PNG_DONE)
+		return result;
+
+	png->png_datalen = png_row_bytes(png) * png->height + png->height;
+	png->png_data = png_alloc(png, png->png_datalen);
+	if(!png->png_data)
+		return PNG_MEMORY_ERROR;
+
+	result = png_decode_segments(png, data, rgba, swap);
+
+	png_free(png, png->png_data);
+	png->png_data = 0;
+
+	return result;
+}
+#endif
+
+#if USE_THREADS
+/*
+	Pipelined decoding, for files without restart points when more than one thread may be
+	used. Reading the IDAT chunks (and checking their CRCs), inflating, unfiltering and
+	converting to RGBA are stages on separate threads, connected by bounded queues, so
+	each block of rows is unfiltered and converted as soon as it has been inflated. The
+	calling thread runs the last stage. With fewer threads, stages share one: with two,
+	the inflating thread also reads the file, and with fewer than four (or when no
+	conversion is needed) the calling thread both unfilters and converts.
+*/
+
+#define PNG_PIPE_QUEUE		4		/* items per queue, and blocks of rows in circulation */
+#define PNG_PIPE_BLOCK_SIZE	(64*1024)	/* approximate bytes of filtered data per block */
+
+/* an IDAT chunk's data and length, or a block of rows and the number of rows */
+typedef struct
+{
+	unsigned char*		data;
+	unsigned		length;
+	unsigned		size;		/* bytes allocated for an IDAT chunk's data */
+} png_item_t;
+
+typedef struct
+{
+	png_item_t		items[PNG_PIPE_QUEUE];
+	unsigned		head;
+	unsigned		count;
+	int			closed;		/* set once no more items will be put */
+	pthread_cond_t		changed;
+} png_queue_t;
+
+typedef struct
+{
+	png_t*			png;
+	unsigned char*		data;
+	png_convert_row_t	convert;
+	int			swap;
+	unsigned		block_rows;
+	int			reading;	/* set if the IDAT chunks are read by a separate thread */
+	png_item_t		chunk;		/* IDAT data being inflated, if so */
+	png_item_t		spare;		/* an inflated chunk's buffer, for reading the next one into */
+	unsigned char*		lastrow;	/* last row unfiltered by the unfiltering thread */
+	png_queue_t		chunks;		/* IDAT chunks to inflate */
+	png_queue_t		filtered;	/* inflated blocks to unfilter */
+	png_queue_t		free_filtered;
+	png_queue_t		unfiltered;	/* unfiltered blocks to convert */
+	png_queue_t		free_unfiltered;
+	unsigned char*		blocks[2 * PNG_PIPE_QUEUE];
+	int			result;		/* set when the pipeline stops early */
+	pthread_mutex_t		lock;
+} png_pipe_t;
+
+static void png_queue_init(png_queue_t* q)
+{
+	memset(q, 0, sizeof(*q));
+	pthread_cond_init(&q->changed, 0);
+}
+
+/* put item on q, waiting for room; fails once the pipeline has been stopped */
+static int png_queue_put(png_pipe_t* pipe, png_queue_t* q, png_item_t item)
+{
+	int result;
+
+	pthread_mutex_lock(&pipe->lock);
+
+	while(q->count == PNG_PIPE_QUEUE && pipe->result == PNG_NO_ERROR)
+		pthread_cond_wait(&q->changed, &pipe->lock);
+
+	result = pipe->result;
+	if(result == PNG_NO_ERROR)
+	{
+		q->items[(q->head + q->count) % PNG_PIPE_QUEUE] = item;
+		q->count++;
+		pthread_cond_broadcast(&q->changed);
+	}
+
+	pthread_mutex_unlock(&pipe->lock);
+
+	return result;
+}
+
+/* take the next item from q, waiting for one; returns PNG_DONE once q is closed and empty */
+static int png_queue_get(png_pipe_t* pipe, png_queue_t* q, png_item_t* item)
+{
+	int result;
+
+	pthread_mutex_lock(&pipe->lock);
+
+	while(q->count == 0 && !q->closed && pipe->result == PNG_NO_ERROR)
+		pthread_cond_wait(&q->changed, &pipe->lock);
+
+	result = pipe->result;
+	if(result == PNG_NO_ERROR && q->count == 0)
+	{
+		result = PNG_DONE;
+	}
+	else if(result == PNG_NO_ERROR)
+	{
+		*item = q->items[q->head];
+		q->head = (q->head + 1) % PNG_PIPE_QUEUE;
+		q->count--;
+		pthread_cond_broadcast(&q->changed);
+	}
+
+	pthread_mutex_unlock(&pipe->lock);
+
+	return result;
+}
+
+static void png_queue_close(png_pipe_t* pipe, png_queue_t* q)
+{
+	pthread_mutex_lock(&pipe->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->changed);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+/* stop the pipeline with result (unless it has already stopped), waking every waiting thread */
+static void png_pipe_stop(png_pipe_t* pipe, int result)
+{
+	pthread_mutex_lock(&pipe->lock);
+	if(pipe->result == PNG_NO_ERROR)
+		pipe->result = result;
+	pthread_cond_broadcast(&pipe->chunks.changed);
+	pthread_cond_broadcast(&pipe->filtered.changed);
+	pthread_cond_broadcast(&pipe->free_filtered.changed);
+	pthread_cond_broadcast(&pipe->unfiltered.changed);
+	pthread_cond_broadcast(&pipe->free_unfiltered.changed);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+/* reading stage: queue up the data of each IDAT chunk */
+static void* png_pipe_read(void* arg)
+{
+	png_pipe_t* pipe = arg;
+	png_t* png = pipe->png;
+	png_item_t chunk;
+	int result;
+
+	for(;;)
+	{
+		result = png_next_idat(png, &chunk.data, &chunk.length, 0);
+		if(result == PNG_DONE)
+		{
+			png_queue_close(pipe, &pipe->chunks);
+			break;
+		}
+		if(result != PNG_NO_ERROR)
+		{
+			png_pipe_stop(pipe, result);
+			break;
+		}
+
+		/* hand over png->readbuf, and read the next chunk into the spare buffer if there is one */
+		chunk.size = png->readbuflen;
+
+		pthread_mutex_lock(&pipe->lock);
+		png->readbuf = pipe->spare.data;
+		png->readbuflen = pipe->spare.size;
+		pipe->spare.data = 0;
+		pthread_mutex_unlock(&pipe->lock);
+
+		if(png_queue_put(pipe, &pipe->chunks, chunk) != PNG_NO_ERROR)
+		{
+			png_free(png, chunk.data);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* png_input_t which takes the next IDAT chunk from the reading stage */
+static int png_pipe_input(png_t* png, void* arg)
+{
+	png_pipe_t* pipe = arg;
+	png_item_t chunk;
+	int result;
+	z_stream *stream = png->zs;
+
+	/* keep the inflated chunk's buffer for reading another into */
+	pthread_mutex_lock(&pipe->lock);
+	if(!pipe->spare.data)
+	{
+		pipe->spare = pipe->chunk;
+		pipe->chunk.data = 0;
+	}
+	pthread_mutex_unlock(&pipe->lock);
+
+	png_free(png, pipe->chunk.data);
+	pipe->chunk.data = 0;
+
+	result = png_queue_get(pipe, &pipe->chunks, &chunk);
+	if(result == PNG_DONE)
+		return PNG_EOF_ERROR;
+	if(result != PNG_NO_ERROR)
+		return result;
+
+	pipe->chunk = chunk;
+	stream->next_in = chunk.data;
+	stream->avail_in = chunk.length;
+
+	return PNG_NO_ERROR;
+}
+
+/* inflating stage: fill blocks with the filtered rows, then check the adler32 */
+static void* png_pipe_inflate(void* arg)
+{
+	png_pipe_t* pipe = arg;
+	png_t* png = pipe->png;
+	png_input_t input = pipe->reading ? png_pipe_input : png_read_input;
+	unsigned rowlen = png_row_bytes(png);
+	unsigned row;
+	png_item_t block;
+	int result = PNG_NO_ERROR;
+
+	for(row = 0; row < png->height && result == PNG_NO_ERROR; row += block.length)
+	{
+		result = png_queue_get(pipe, &pipe->free_filtered, &block);
+		if(result != PNG_NO_ERROR)
+			return 0;
+
+		block.length = png->height - row < pipe->block_rows ? png->height - row : pipe->block_rows;
+
+		result = png_inflate_rows(png, block.data, block.length * (rowlen + 1), input, pipe);
+		if(result == PNG_NO_ERROR)
+			result = png_queue_put(pipe, &pipe->filtered, block);
+	}
+
+	if(result == PNG_NO_ERROR)
+		result = png_inflate_rows(png, 0, 0, input, pipe);
+
+	if(result == PNG_NO_ERROR)
+		png_queue_close(pipe, &pipe->filtered);
+	else
+		png_pipe_stop(pipe, result);
+
+	return 0;
+}
+
+/* unfilter a block of rows starting at row, into data if no conversion is needed, else converting each row into data */
+static int png_pipe_unfilter_block(png_pipe_t* pipe, unsigned row, png_item_t block)
+{
+	png_t* png = pipe->png;
+	unsigned rowlen = png_row_bytes(png);
+	unsigned char* filtered = block.data;
+	unsigned char* out;
+	unsigned char* tmp;
+	unsigned i;
+	int result = PNG_NO_ERROR;
+
+	for(i = 0; i < block.length && result == PNG_NO_ERROR; i++, row++, filtered += rowlen + 1)
+	{
+		if(!pipe->convert)
+		{
+			out = pipe->data + (size_t)row * rowlen;
+			result = png_unfilter_filtered_row(png, filtered, out, row ? out - rowlen : 0, 1);
+			continue;
+		}
+
+		result = png_unfilter_filtered_row(png, filtered, png->currow, row ? png->prevrow : 0, 0);
+		pipe->convert(png, png->currow, pipe->data + (size_t)row * png->width * 4, png->width, pipe->swap);
+
+		tmp = png->prevrow;
+		png->prevrow = png->currow;
+		png->currow = tmp;
+	}
+
+	return result;
+}
+
+/* unfiltering stage, when conversion is a separate stage: unfilter each block of rows into a block for it */
+static void* png_pipe_unfilter(void* arg)
+{
+	png_pipe_t* pipe = arg;
+	png_t* png = pipe->png;
+	unsigned rowlen = png_row_bytes(png);
+	unsigned row = 0;
+	unsigned i;
+	png_item_t block, out;
+	unsigned char* prev;
+	int result;
+
+	for(;;)
+	{
+		result = png_queue_get(pipe, &pipe->filtered, &block);
+		if(result == PNG_DONE)
+		{
+			png_queue_close(pipe, &pipe->unfiltered);
+			break;
+		}
+		if(result != PNG_NO_ERROR)
+			break;
+
+		result = png_queue_get(pipe, &pipe->free_unfiltered, &out);
+		if(result != PNG_NO_ERROR)
+			break;
+
+		out.length = block.length;
+		prev = row ? pipe->lastrow : 0;
+
+		for(i = 0; i < block.length && result == PNG_NO_ERROR; i++, row++)
+		{
+			result = png_unfilter_filtered_row(png, block.data + i * (rowlen + 1), out.data + i * rowlen, prev, 0);
+			prev = out.data + i * rowlen;
+		}
+
+		if(result != PNG_NO_ERROR)
+		{
+			png_pipe_stop(pipe, result);
+			break;
+		}
+
+		memcpy(pipe->lastrow, prev, rowlen);
+
+		if(png_queue_put(pipe, &pipe->free_filtered, block) != PNG_NO_ERROR ||
+			png_queue_put(pipe, &pipe->unfiltered, out) != PNG_NO_ERROR)
+			break;
+	}
+
+	return 0;
+}
+
+/* decode the whole image into data with a pipeline of up to png->threads threads */
+static int png_read_pipelined(png_t* png, unsigned char* data, png_convert_row_t convert, int swap)
+{
+	png_pipe_t pipe;
+	pthread_t reader, inflater, unfilterer;
+	int reading, unfiltering;
+	int inflating = 0;
+	unsigned rowlen = png_row_bytes(png);
+	unsigned row = 0;
+	unsigned i;
+	png_item_t block;
+	int result = PNG_NO_ERROR;
+
+	memset(&pipe, 0, sizeof(pipe));
+	pipe.png = png;
+	pipe.data = data;
+	pipe.convert = convert;
+	pipe.swap = swap;
+	pipe.block_rows = PNG_PIPE_BLOCK_SIZE / (rowlen + 1);
+	if(pipe.block_rows == 0)
+		pipe.block_rows = 1;
+
+	/* a mapped file has nothing to read, so its CRCs are checked as each chunk is inflated */
+	reading = png->threads >= 3 && png->read_fun != png_map_read;
+	unfiltering = png->threads >= 4 && convert;
+
+	pthread_mutex_init(&pipe.lock, 0);
+	png_queue_init(&pipe.chunks);
+	png_queue_init(&pipe.filtered);
+	png_queue_init(&pipe.free_filtered);
+	png_queue_init(&pipe.unfiltered);
+	png_queue_init(&pipe.free_unfiltered);
+
+	/* all of the blocks start out free */
+	for(i = 0; i < PNG_PIPE_QUEUE; i++)
+	{
+		block.length = 0;
+
+		block.data = pipe.blocks[i] = png_alloc(png, pipe.block_rows * (rowlen + 1));
+		pipe.free_filtered.items[pipe.free_filtered.count++] = block;
+		if(!block.data)
+			result = PNG_MEMORY_ERROR;
+
+		if(unfiltering)
+		{
+			block.data = pipe.blocks[PNG_PIPE_QUEUE + i] = png_alloc(png, pipe.block_rows * rowlen);
+			pipe.free_unfiltered.items[pipe.free_unfiltered.count++] = block;
+			if(!block.data)
+				result = PNG_MEMORY_ERROR;
+		}
+	}
+
+	if(unfiltering)
+	{
+		pipe.lastrow = png_alloc(png, rowlen);
+		if(!pipe.lastrow)
+			result = PNG_MEMORY_ERROR;
+	}
+
+	if(result == PNG_NO_ERROR)
+	{
+		/* png_begin_rows read the first IDAT chunk; the reading thread reads the rest */
+		if(reading)
+		{
+			pipe.reading = 1;
+			pipe.chunk.data = png->readbuf;
+			pipe.chunk.size = png->readbuflen;
+			png->readbuf = 0;
+			png->readbuflen = 0;
+			reading = pthread_create(&reader, 0, png_pipe_read, &pipe) == 0;
+		}
+		inflating = pthread_create(&inflater, 0, png_pipe_inflate, &pipe) == 0;
+		if(unfiltering)
+			unfiltering = pthread_create(&unfilterer, 0, png_pipe_unfilter, &pipe) == 0;
+
+		if(!inflating || reading != pipe.reading || (pipe.lastrow && !unfiltering))
+			png_pipe_stop(&pipe, PNG_MEMORY_ERROR);
+	}
+
+	/* the last stage: either convert, or unfilter and convert */
+	while(result == PNG_NO_ERROR)
+	{
+		if(pipe.lastrow)
+		{
+			result = png_queue_get(&pipe, &pipe.unfiltered, &block);
+			if(result != PNG_NO_ERROR)
+				break;
+
+			for(i = 0; i < block.length; i++, row++)
+				convert(png, block.data + i * rowlen, data + (size_t)row * png->width * 4, png->width, swap);
+
+			result = png_queue_put(&pipe, &pipe.free_unfiltered, block);
+		}
+		else
+		{
+			result = png_queue_get(&pipe, &pipe.filtered, &block);
+			if(result != PNG_NO_ERROR)
+				break;
+
+			result = png_pipe_unfilter_block(&pipe, row, block);
+			row += block.length;
+
+			if(result == PNG_NO_ERROR)
+				result = png_queue_put(&pipe, &pipe.free_filtered, block);
+			else
+				png_pipe_stop(&pipe, result);
+		}
+	}
+
+	if(result == PNG_DONE && row != png->height)
+		result = PNG_ZLIB_ERROR;
+
+	/* the inflating thread checks the adler32 after the last block, so wait for it
+	   before stopping the reading thread, which may be waiting to queue more data */
+	if(inflating)
+		pthread_join(inflater, 0);
+	if(unfiltering)
+		pthread_join(unfilterer, 0);
+	png_pipe_stop(&pipe, PNG_DONE);
+	if(reading)
+		pthread_join(reader, 0);
+
+	if(pipe.result != PNG_DONE)
+		result = pipe.result;
+	else if(result == PNG_DONE)
+		result = PNG_NO_ERROR;
+
+	/* chunks read but not inflated */
+	for(i = 0; i < pipe.chunks.count; i++)
+		png_free(png, pipe.chunks.items[(pipe.chunks.head + i) % PNG_PIPE_QUEUE].data);
+
+	for(i = 0; i < 2 * PNG_PIPE_QUEUE; i++)
+		png_free(png, pipe.blocks[i]);
+	png_free(png, pipe.chunk.data);
+	png_free(png, pipe.spare.data);
+	png_free(png, pipe.lastrow);
+
+	pthread_cond_destroy(&pipe.chunks.changed);
+	pthread_cond_destroy(&pipe.filtered.changed);
+	pthread_cond_destroy(&pipe.free_filtered.changed);
+	pthread_cond_destroy(&pipe.unfiltered.changed);
+	pthread_cond_destroy(&pipe.free_unfiltered.changed);
+	pthread_mutex_destroy(&pipe.lock);
+
+	return result;
+}
+#endif
+
+/* decode the whole image into data, on up to png->threads threads */
+static int png_read_data(png_t* png, unsigned char* data, int rgba, int swap)
+{
+	int result = png_begin_rows(png, png->threads > 1);
+
+#if USE_THREADS
+	/* the segments are inflated into one buffer of png_datalen bytes, so files whose
+	   filtered data does not fit in an unsigned are decoded without the restart points */
+	if(result == PNG_NO_ERROR && png->restarts &&
+		((unsigned long long)png_row_bytes(png) + 1) * png->height <= UINT_MAX)
+	{
+		result = png_read_segments(png, data, rgba, swap);
+	}
+	else if(result == PNG_NO_ERROR && png->threads > 1)
+	{
+		png_convert_row_t convert = rgba ? png_get_rgba_converter(png) : 0;
+
+		/* already in the requested format */
+		if(png_is_rgba(png) && !swap)
+			convert = 0;
+
+		result = png_read_pipelined(png, data, convert, swap);
+	}
+	else
+#endif
+	if(result == PNG_NO_ERROR)
+	{
+		result = rgba ? png_read_rows_rgba(png, data, png->height, swap) : png_read_rows(png, data, png->height);
+		if(result > 0)
+			result = PNG_NO_ERROR;
+	}
+
+	png_read_rows_end(png);
+
+	return result;
+}
+
+int png_get_data(png_t* png, unsigned char* data)
+{
+	return png_read_data(png, data, 0, 0);
+}
+
+int png_get_data_rgba(png_t* png, unsigned char* data, int swap)
+{
+	if(!png_get_rgba_converter(png))
+		return PNG_NOT_SUPPORTED;
+
+	return png_read_data(png, data, 1, swap);
+}
+
+static int png_write_chunk(png_t* png, const char* type, unsigned char* data, unsigned length)
+{
+	unsigned long crc;
+
+	crc = crc32(0L, Z_NULL, 0);
+	crc = crc32(crc, (const unsigned char*)type, 4);
+	if(length)
+		crc = crc32(crc, data, length);
+
+	if(file_write_ul(png, length) != PNG_NO_ERROR)
+		return PNG_FILE_ERROR;
+	if(file_write(png, (void*)type, 1, 4) != 4)
+		return PNG_FILE_ERROR;
+	if(length && file_write(png, data, 1, length) != length)
+		return PNG_FILE_ERROR;
+
+	return file_write_ul(png, crc);
+}
+
+/*
+	Encoder-side filtering. raw and prior are the current and previous unfiltered rows.
+	Both must be preceded by at least bpp zero bytes, so that the bytes to the left of
+	the first pixel read as 0 (and prior is all zeros for the first row). Each function
+	writes the row filtered with the given filter type to out, and returns the sum of
+	the filtered bytes' absolute values taken as signed, which the adaptive heuristic
+	minimizes.
+*/
+
+#define PNG_ROW_PAD	16
+
+typedef unsigned (*png_filter_row_t)(int type, int bpp, const unsigned char* raw, const unsigned char* prior, unsigned char* out, unsigned len);
+
+static unsigned png_filter_row_range(int type, int bpp, const unsigned char* raw, const unsigned char* prior, unsigned char* out, unsigned start, unsigned len)
+{
+	const unsigned char *left = raw - bpp;
+	const unsigned char *upleft = prior - bpp;
+	unsigned sum = 0;
+	unsigned i;
+
+	switch(type)
+	{
+	case 0: /* none */
+		for(i = start; i < len; i++)
+			out[i] = raw[i];
+		break;
+	case 1: /* sub */
+		for(i = start; i < len; i++)
+			out[i] = raw[i] - left[i];
+		break;
+	case 2: /* up */
+		for(i = start; i < len; i++)
+			out[i] = raw[i] - prior[i];
+		break;
+	case 3: /* average */
+		for(i = start; i < len; i++)
+			out[i] = raw[i] - ((left[i] + prior[i]) >> 1);
+		break;
+	case 4: /* paeth */
+		for(i = start; i < len; i++)
+			out[i] = raw[i] - png_paeth(left[i], prior[i], upleft[i]);
+		break;
+	}
+
+	for(i = start; i < len; i++)
+		sum += out[i] < 128 ? out[i] : 256 - out[i];
+
+	return sum;
+}
+
+#if !USE_SSE2
+static unsigned png_filter_row_c(int type, int bpp, const unsigned char* raw, const unsigned char* prior, unsigned char* out, unsigned len)
+{
+	return png_filter_row_range(type, bpp, raw, prior, out, 0, len);
+}
+#endif
+
+#if USE_SSE2
+static unsigned png_filter_row_sse2(int type, int bpp, const unsigned char* raw, const unsigned char* prior, unsigned char* out, unsigned len)
+{
+	const unsigned char *left = raw - bpp;
+	const unsigned char *upleft = prior - bpp;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+	__m128i acc = zero;
+	unsigned i;
+
+	for(i = 0; i + 16 <= len; i += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i*)(raw + i));
+		__m128i a, b, c, pred, d;
+
+		switch(type)
+		{
+		case 1:
+			pred = _mm_loadu_si128((const __m128i*)(left + i));
+			break;
+		case 2:
+			pred = _mm_loadu_si128((const __m128i*)(prior + i));
+			break;
+		case 3:
+			a = _mm_loadu_si128((const __m128i*)(left + i));
+			b = _mm_loadu_si128((const __m128i*)(prior + i));
+			/* avg_epu8 rounds up, the average filter rounds down */
+			pred = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+			break;
+		case 4:
+			a = _mm_loadu_si128((const __m128i*)(left + i));
+			b = _mm_loadu_si128((const __m128i*)(prior + i));
+			c = _mm_loadu_si128((const __m128i*)(upleft + i));
+			pred = _mm_packus_epi16(
+				png_paeth_epi16_sse2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero)),
+				png_paeth_epi16_sse2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero)));
+			break;
+		default:
+			pred = zero;
+			break;
+		}
+
+		d = _mm_sub_epi8(x, pred);
+		_mm_storeu_si128((__m128i*)(out + i), d);
+
+		/* min(d, 256 - d) is the absolute value of d taken as signed */
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_min_epu8(d, _mm_sub_epi8(zero, d)), zero));
+	}
+
+	return _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8))
+		+ png_filter_row_range(type, bpp, raw, prior, out, i, len);
+}
+#endif
+
+#if USE_AVX2
+__attribute__((target("avx2")))
+static __m256i png_paeth_epi16_avx2(__m256i a, __m256i b, __m256i c)
+{
+	__m256i pa = _mm256_abs_epi16(_mm256_sub_epi16(b, c));
+	__m256i pb = _mm256_abs_epi16(_mm256_sub_epi16(a, c));
+	__m256i pc = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_add_epi16(a, b), _mm256_add_epi16(c, c)));
+	__m256i not_a = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb), _mm256_cmpgt_epi16(pa, pc));
+	__m256i bc = _mm256_blendv_epi8(b, c, _mm256_cmpgt_epi16(pb, pc));
+
+	return _mm256_blendv_epi8(a, bc, not_a);
+}
+
+__attribute__((target("avx2")))
+static unsigned png_filter_row_avx2(int type, int bpp, const unsigned char* raw, const unsigned char* prior, unsigned char* out, unsigned len)
+{
+	const unsigned char *left = raw - bpp;
+	const unsigned char *upleft = prior - bpp;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi8(1);
+	__m256i acc = zero;
+	__m128i sum;
+	unsigned i;
+
+	for(i = 0; i + 32 <= len; i += 32)
+	{
+		__m256i x = _mm256_loadu_si256((const __m256i*)(raw + i));
+		__m256i a, b, c, pred, d;
+
+		switch(type)
+		{
+		case 1:
+			pred = _mm256_loadu_si256((const __m256i*)(left + i));
+			break;
+		case 2:
+			pred = _mm256_loadu_si256((const __m256i*)(prior + i));
+			break;
+		case 3:
+			a = _mm256_loadu_si256((const __m256i*)(left + i));
+			b = _mm256_loadu_si256((const __m256i*)(prior + i));
+			pred = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one));
+			break;
+		case 4:
+			/* unpack and pack work within 128-bit lanes, so the byte order is preserved */
+			a = _mm256_loadu_si256((const __m256i*)(left + i));
+			b = _mm256_loadu_si256((const __m256i*)(prior + i));
+			c = _mm256_loadu_si256((const __m256i*)(upleft + i));
+			pred = _mm256_packus_epi16(
+				png_paeth_epi16_avx2(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(c, zero)),
+				png_paeth_epi16_avx2(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(c, zero)));
+			break;
+		default:
+			pred = zero;
+			break;
+		}
+
+		d = _mm256_sub_epi8(x, pred);
+		_mm256_storeu_si256((__m256i*)(out + i), d);
+
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_min_epu8(d, _mm256_sub_epi8(zero, d)), zero));
+	}
+
+	sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+
+	return _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8))
+		+ png_filter_row_range(type, bpp, raw, prior, out, i, len);
+}
+#endif
+
+static png_filter_row_t png_get_filter_fun(void)
+{
+#if USE_AVX2
+	if(__builtin_cpu_supports("avx2"))
+		return png_filter_row_avx2;
+#endif
+#if USE_SSE2
+	return png_filter_row_sse2;
+#else
+	return png_filter_row_c;
+#endif
+}
+
+/*
+	Streaming IDAT encoding. Each row is given its filter byte (and converted, if
+	necessary) in png->rowbuf, then fed to deflate, so the full filtered image is
+	never held in memory. The compressed output is collected in png->writebuf, which
+	is written out as an IDAT chunk every time it fills up, so memory use does not
+	depend on the image size.
+
+	If png->restart_interval is set, a restart point is started every restart_interval
+	rows: deflate is fully flushed (so that decoding can start there without the earlier
+	data), and the first row of each segment is filtered without reference to the row
+	above it. The restart points are listed in an rsTR chunk, which is written before
+	the IDAT chunks, so the compressed data is all held in png->writebuf until the end.
+	The rsTR chunk has one 8-byte entry for each restart point after the start of the
+	image: the row number and the offset of the point within the zlib stream (the
+	concatenated IDAT data), both as 4-byte big-endian values.
+*/
+
+static int png_begin_restarts(png_t* png)
+{
+	png->restarts = 0;
+	png->num_restarts = 0;
+
+	if(!png->restart_interval || png->height <= png->restart_interval)
+		return PNG_NO_ERROR;
+
+	png->num_restarts = (png->height - 1) / png->restart_interval;
+	png->restarts = png_alloc(png, png->num_restarts * 2 * sizeof(unsigned));
+
+	return png->restarts ? PNG_NO_ERROR : PNG_MEMORY_ERROR;
+}
+
+/* record restart point index (counting from 0 for the first one after the start) at the current end of png->writebuf */
+static void png_set_restart(png_t* png, unsigned index, unsigned row)
+{
+	png->restarts[2 * index] = row;
+	png->restarts[2 * index + 1] = png->writebuflen;
+}
+
+/* make room in the full png->writebuf, by writing it out as an IDAT chunk unless restart points are being recorded */
+static int png_flush_writebuf(png_t* png)
+{
+	int result;
+
+	if(png->restart_interval)
+		return png_grow_writebuf(png);
+
+	result = png_write_chunk(png, "IDAT", png->writebuf, png->writebuflen);
+	if(result != PNG_NO_ERROR)
+		return result;
+
+	png->writebuflen = 0;
+
+	return PNG_NO_ERROR;
+}
+
+/* write out the compressed data left in png->writebuf, after the rsTR chunk if restart points were recorded */
+static int png_write_final_idats(png_t* png)
+{
+	unsigned char* entries;
+	unsigned pos;
+	unsigned i;
+	int result = PNG_NO_ERROR;
+
+	if(!png->restart_interval)
+		return png->writebuflen ? png_write_chunk(png, "IDAT", png->writebuf, png->writebuflen) : PNG_NO_ERROR;
+
+	if(png->num_restarts)
+	{
+		entries = png_alloc(png, png->num_restarts * 8);
+		if(!entries)
+			return PNG_MEMORY_ERROR;
+
+		for(i = 0; i < png->num_restarts * 2; i++)
+			set_ul(entries + i * 4, png->restarts[i]);
+
+		result = png_write_chunk(png, "rsTR", entries, png->num_restarts * 8);
+
+		png_free(png, entries);
+	}
+
+	for(pos = 0; pos < png->writebuflen && result == PNG_NO_ERROR; pos += png->idat_size)
+	{
+		unsigned len = png->writebuflen - pos;
+
+		if(len > png->idat_size)
+			len = png->idat_size;
+
+		result = png_write_chunk(png, "IDAT", png->writebuf + pos, len);
+	}
+
+	return result;
+}
+
+static int png_begin_idats(png_t* png)
+{
+	unsigned rowlen = png_row_bytes(png);
+
+	png->zs = 0;
+	png->writebuflen = 0;
+	png->writebufsize = png->idat_size;
+	png->writebuf = png_alloc(png, png->writebufsize);
+	png->rowbuf = png_alloc(png, rowlen + 1);
+	png->candbuf = png_alloc(png, rowlen + 1);
+	png->filterbuf = png_alloc(png, 2 * (rowlen + PNG_ROW_PAD));
+
+	if(!png->writebuf || !png->rowbuf || !png->candbuf || !png->filterbuf)
+		return PNG_MEMORY_ERROR;
+
+	if(png_begin_restarts(png) != PNG_NO_ERROR)
+		return PNG_MEMORY_ERROR;
+
+	/* previous and current unfiltered rows, each preceded by zero padding */
+	memset(png->filterbuf, 0, 2 * (rowlen + PNG_ROW_PAD));
+	png->prevrow = png->filterbuf + PNG_ROW_PAD;
+	png->currow = png->prevrow + rowlen + PNG_ROW_PAD;
+
+	return png_init_deflate(png, 0, 0);
+}
+
+static int png_deflate_idat_data(png_t* png, unsigned char* data, unsigned len, int flush)
+{
+	z_stream *stream = png->zs;
+	int written;
+	int result;
+
+	stream->next_in = data;
+	stream->avail_in = len;
+
+	do
+	{
+		if(png->writebuflen == png->writebufsize)
+		{
+			result = png_flush_writebuf(png);
+			if(result != PNG_NO_ERROR)
+				return result;
+		}
+
+		result = png_deflate(png, (char*)png->writebuf + png->writebuflen,
+			png->writebufsize - png->writebuflen, &written, flush);
+		if(result != Z_OK && result != Z_STREAM_END)
+			return result;
+
+		png->writebuflen += written;
+	} while(stream->avail_in > 0 || (flush == Z_FINISH && result != Z_STREAM_END) ||
+		(flush != Z_NO_FLUSH && stream->avail_out == 0));
+
+	return PNG_NO_ERROR;
+}
+
+static void png_free_idats(png_t* png)
+{
+	if(png->zs)
+	{
+		png_end_deflate(png);
+		png->zs = 0;
+	}
+
+	png_free(png, png->writebuf);
+	png_free(png, png->rowbuf);
+	png_free(png, png->candbuf);
+	png_free(png, png->filterbuf);
+	png_free(png, png->restarts);
+	png->writebuf = 0;
+	png->rowbuf = 0;
+	png->candbuf = 0;
+	png->filterbuf = 0;
+	png->restarts = 0;
+}
+
+static int png_end_idats(png_t* png, int result)
+{
+	if(result == PNG_NO_ERROR)
+		result = png_deflate_idat_data(png, 0, 0, Z_FINISH);
+
+	if(result == PNG_NO_ERROR)
+		result = png_write_final_idats(png);
+
+	if(result == PNG_NO_ERROR)
+		result = png_write_chunk(png, "IEND", 0, 0);
+
+	png_free_idats(png);
+
+	return result;
+}
+
+static int png_deflate_row(png_t* png, unsigned char filter, unsigned char* row)
+{
+	int result = png_deflate_idat_data(png, &filter, 1, Z_NO_FLUSH);
+
+	if(result == PNG_NO_ERROR)
+		result = png_deflate_idat_data(png, row, png_row_bytes(png), Z_NO_FLUSH);
+
+	return result;
+}
+
+/*
+	Filter one unfiltered row, as selected by png->filter_heuristic, into png->rowbuf
+	(filter type byte first), and make it the previous row for the next call. If restart
+	is set, only the none and sub filters, which do not use the row above, are used.
+*/
+static void png_filter_row(png_t* png, unsigned char* row, int restart)
+{
+	unsigned len = png_row_bytes(png);
+	int last_type = restart ? PNG_FILTER_SUB : PNG_FILTER_PAETH;
+	png_filter_row_t filter_fun;
+	unsigned char *tmp;
+
+	if(png->filter_heuristic == PNG_FILTER_NONE)
+	{
+		png->rowbuf[0] = 0;
+		memcpy(png->rowbuf + 1, row, len);
+		return;
+	}
+
+	if(row != png->currow)
+		memcpy(png->currow, row, len);
+
+	filter_fun = png_get_filter_fun();
+
+	if(png->filter_heuristic == PNG_FILTER_ADAPTIVE)
+	{
+		unsigned best = ~0U;
+		int type;
+
+		/* keep the filtered row with the smallest sum in rowbuf */
+		for(type = 0; type <= last_type; type++)
+		{
+			unsigned sum = filter_fun(type, png->bpp, png->currow, png->prevrow, png->candbuf + 1, len);
+
+			if(sum < best)
+			{
+				best = sum;
+				png->candbuf[0] = type;
+				tmp = png->rowbuf;
+				png->rowbuf = png->candbuf;
+				png->candbuf = tmp;
+			}
+		}
+	}
+	else
+	{
+		int type = png->filter_heuristic > last_type ? last_type : png->filter_heuristic;
+
+		png->rowbuf[0] = type;
+		filter_fun(type, png->bpp, png->currow, png->prevrow, png->rowbuf + 1, len);
+	}
+
+	tmp = png->prevrow;
+	png->prevrow = png->currow;
+	png->currow = tmp;
+}
+
+/* filter (as selected by png->filter_heuristic) and deflate one unfiltered row */
+static int png_encode_row(png_t* png, unsigned char* row, int restart)
+{
+	/* with no filtering, the row can be deflated without copying it */
+	if(png->filter_heuristic == PNG_FILTER_NONE)
+		return png_deflate_row(png, 0, row);
+
+	png_filter_row(png, row, restart);
+
+	return png_deflate_idat_data(png, png->rowbuf, png_row_bytes(png) + 1, Z_NO_FLUSH);
+}
+
+/* encode row y of the image, starting a restart point before it if one is due */
+static int png_encode_image_row(png_t* png, unsigned y, unsigned char* row)
+{
+	int restart = png->restart_interval && y % png->restart_interval == 0;
+
+	if(restart && y > 0)
+	{
+		int result = png_deflate_idat_data(png, 0, 0, Z_FULL_FLUSH);
+		if(result != PNG_NO_ERROR)
+			return result;
+
+		png_set_restart(png, y / png->restart_interval - 1, y);
+	}
+
+	return png_encode_row(png, row, restart);
+}
+
+#if USE_THREADS
+/*
+	Parallel IDAT encoding, in the style of pigz. The rows are split into segments of
+	about PNG_SEGMENT_SIZE bytes, which worker threads filter and deflate independently.
+	Each segment is ended with a full flush (or, for the last one, finished), so the
+	compressed segments, stripped of their zlib headers and trailers, can be concatenated
+	into one deflate stream. The main thread writes them out in order as IDAT chunks,
+	between a zlib header and the adler32 of all the filtered data, which is combined from
+	the adler32s of the segments. Each worker primes deflate with the last 32 KiB of the
+	filtered data before its segment, so little compression is lost at the boundaries.
+	The output does not depend on the number of threads.
+*/
+
+#define PNG_SEGMENT_SIZE	(256*1024)
+#define PNG_WINDOW_SIZE		32768
+
+typedef struct
+{
+	unsigned char*		buf;	/* compressed data, with its zlib header and trailer */
+	unsigned char*		data;	/* start of the deflate data within buf */
+	unsigned		len;
+	unsigned long		adler;	/* adler32 of the filtered rows */
+	unsigned		rawlen;	/* length of the filtered rows */
+	int			result;
+	int			done;
+} png_segment_t;
+
+typedef struct
+{
+	png_t*			png;
+	png_t			settings;	/* copy of *png made before the workers start */
+	unsigned char*		data;	/* image data */
+	size_t			stride;	/* bytes from the start of one row of data to the next */
+	png_convert_row_t	convert;	/* if not 0, applied to each row of data, which then has 4-byte pixels */
+	int			swap;
+	unsigned		seg_rows;
+	unsigned		num_segs;
+	png_segment_t*		segs;
+	unsigned		next_seg;	/* next segment for a worker to encode */
+	unsigned		written;	/* number of segments written out */
+	unsigned		max_ahead;	/* how far workers may get ahead of the writer */
+	int			abort;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+} png_parallel_t;
+
+/* write callback for segments, whose compressed data must never be flushed as an IDAT chunk */
+static unsigned png_segment_overflow(void* input, size_t size, size_t numel, void* user_pointer)
+{
+	(void)input;
+	(void)size;
+	(void)numel;
+	(void)user_pointer;
+
+	return 0;
+}
+
+/* get unfiltered row y of the image, converting it into buf if necessary */
+static unsigned char* png_parallel_row(png_parallel_t* par, unsigned y, unsigned char* buf)
+{
+	png_t* png = &par->settings;
+	unsigned char* row = par->data + y * par->stride;
+
+	if(!par->convert)
+		return row;
+
+	par->convert(png, row, buf, png->width, par->swap);
+
+	return buf;
+}
+
+static int png_encode_segment(png_parallel_t* par, unsigned index)
+{
+	png_t seg = par->settings;
+	png_segment_t* s = &par->segs[index];
+	unsigned rowlen = png_row_bytes(&seg);
+	unsigned first = index * par->seg_rows;
+	unsigned last = first + par->seg_rows;
+	int restart = seg.restart_interval != 0;
+	unsigned dict_rows;
+	unsigned y;
+	z_stream* stream;
+	int result;
+
+	if(last > seg.height)
+		last = seg.height;
+
+	/* enough rows before the segment to fill the deflate window, unless the
+	   segment is a restart point, which must not depend on earlier data */
+	dict_rows = restart ? 0 : (PNG_WINDOW_SIZE + rowlen) / (rowlen + 1);
+	if(dict_rows > first)
+		dict_rows = first;
+
+	s->rawlen = (last - first) * (rowlen + 1);
+
+	seg.write_fun = png_segment_overflow;
+	seg.idat_size = compressBound(s->rawlen) + 64;
+	seg.restart_interval = 0;
+
+	result = png_begin_idats(&seg);
+	stream = seg.zs;
+
+	if(result == PNG_NO_ERROR && dict_rows)
+	{
+		unsigned char* dict = png_alloc(&seg, dict_rows * (rowlen + 1));
+		unsigned dict_len = dict_rows * (rowlen + 1);
+		unsigned skip = dict_len > PNG_WINDOW_SIZE ? dict_len - PNG_WINDOW_SIZE : 0;
+
+		if(!dict)
+			result = PNG_MEMORY_ERROR;
+
+		/* filter the rows as the previous segment did */
+		if(result == PNG_NO_ERROR && first - dict_rows > 0)
+		{
+			unsigned char* row = png_parallel_row(par, first - dict_rows - 1, seg.prevrow);
+
+			if(row != seg.prevrow)
+				memcpy(seg.prevrow, row, rowlen);
+		}
+
+		for(y = first - dict_rows; y < first && result == PNG_NO_ERROR; y++)
+		{
+			png_filter_row(&seg, png_parallel_row(par, y, seg.currow), 0);
+			memcpy(dict + (y - (first - dict_rows)) * (rowlen + 1), seg.rowbuf, rowlen + 1);
+		}
+
+		if(result == PNG_NO_ERROR && deflateSetDictionary(stream, dict + skip, dict_len - skip) != Z_OK)
+			result = PNG_ZLIB_ERROR;
+
+		png_free(&seg, dict);
+	}
+
+	for(y = first; y < last && result == PNG_NO_ERROR; y++)
+		result = png_encode_row(&seg, png_parallel_row(par, y, seg.currow), restart && y == first);
+
+	if(result == PNG_NO_ERROR)
+		result = png_deflate_idat_data(&seg, 0, 0, last == seg.height ? Z_FINISH : Z_FULL_FLUSH);
+
+	if(result == PNG_NO_ERROR)
+	{
+		/* the zlib header is 2 bytes, plus 4 for the dictionary id if there is one */
+		unsigned header = dict_rows ? 6 : 2;
+		unsigned trailer = last == seg.height ? 4 : 0;
+
+		s->adler = stream->adler;
+		s->buf = seg.writebuf;
+		s->data = seg.writebuf + header;
+		s->len = seg.writebuflen - header - trailer;
+		seg.writebuf = 0;
+	}
+
+	png_free_idats(&seg);
+
+	return result;
+}
+
+static void* png_parallel_worker(void* arg)
+{
+	png_parallel_t* par = arg;
+	unsigned index;
+	int result;
+
+	pthread_mutex_lock(&par->lock);
+
+	for(;;)
+	{
+		while(!par->abort && par->next_seg < par->num_segs && par->next_seg >= par->written + par->max_ahead)
+			pthread_cond_wait(&par->cond, &par->lock);
+
+		if(par->abort || par->next_seg >= par->num_segs)
+			break;
+
+		index = par->next_seg++;
+		pthread_mutex_unlock(&par->lock);
+
+		result = png_encode_segment(par, index);
+
+		pthread_mutex_lock(&par->lock);
+		par->segs[index].result = result;
+		par->segs[index].done = 1;
+		pthread_cond_broadcast(&par->cond);
+	}
+
+	pthread_mutex_unlock(&par->lock);
+
+	return 0;
+}
+
+/* append data to the IDAT data in png->writebuf, writing an IDAT chunk whenever it fills up */
+static int png_write_idat_bytes(png_t* png, const unsigned char* data, unsigned len)
+{
+	while(len > 0)
+	{
+		unsigned n = png->writebufsize - png->writebuflen;
+
+		if(n > len)
+			n = len;
+
+		memcpy(png->writebuf + png->writebuflen, data, n);
+		png->writebuflen += n;
+		data += n;
+		len -= n;
+
+		if(png->writebuflen == png->writebufsize)
+		{
+			int result = png_flush_writebuf(png);
+			if(result != PNG_NO_ERROR)
+				return result;
+		}
+	}
+
+	return PNG_NO_ERROR;
+}
+
+static int png_write_segments(png_parallel_t* par)
+{
+	png_t* png = par->png;
+	unsigned long adler = adler32(0L, Z_NULL, 0);
+	unsigned char header[2];
+	unsigned char trailer[4];
+	int level = png->deflate_level;
+	unsigned i;
+	int result;
+
+	/* zlib header: deflate with a 32 KiB window, and the compression level as a hint */
+	header[0] = 0x78;
+	header[1] = (level == Z_DEFAULT_COMPRESSION || level == 6) ? 2 : level < 2 ? 0 : level < 6 ? 1 : 3;
+	header[1] <<= 6;
+	header[1] += 31 - (header[0] * 256 + header[1]) % 31;
+
+	result = png_write_idat_bytes(png, header, 2);
+
+	for(i = 0; i < par->num_segs && result == PNG_NO_ERROR; i++)
+	{
+		png_segment_t* s = &par->segs[i];
+
+		pthread_mutex_lock(&par->lock);
+		while(!s->done)
+			pthread_cond_wait(&par->cond, &par->lock);
+		pthread_mutex_unlock(&par->lock);
+
+		result = s->result;
+
+		/* with restart points, each segment is one restart interval */
+		if(png->restart_interval && i > 0)
+			png_set_restart(png, i - 1, i * par->seg_rows);
+
+		if(result == PNG_NO_ERROR)
+			result = png_write_idat_bytes(png, s->data, s->len);
+
+		adler = adler32_combine(adler, s->adler, s->rawlen);
+
+		png_free(png, s->buf);
+		s->buf = 0;
+
+		pthread_mutex_lock(&par->lock);
+		par->written++;
+		pthread_cond_broadcast(&par->cond);
+		pthread_mutex_unlock(&par->lock);
+	}
+
+	if(result == PNG_NO_ERROR)
+	{
+		set_ul(trailer, adler);
+		result = png_write_idat_bytes(png, trailer, 4);
+	}
+
+	return result;
+}
+
+/*
+	Write the IDAT chunks for data in parallel. Returns PNG_DONE, without writing anything,
+	if the image is too small to split or no worker threads could be started, in which
+	case the caller should encode it serially.
+*/
+static int png_write_idats_parallel(png_t* png, unsigned char* data, size_t stride, png_convert_row_t convert, int swap)
+{
+	png_parallel_t par;
+	pthread_t* threads;
+	unsigned num_threads = png->threads;
+	unsigned started = 0;
+	unsigned rowlen = png_row_bytes(png);
+	unsigned i;
+	int result;
+
+	memset(&par, 0, sizeof(par));
+	par.png = png;
+	par.data = data;
+	par.stride = stride;
+	par.convert = convert;
+	par.swap = swap;
+	par.seg_rows = png->restart_interval ? png->restart_interval : (PNG_SEGMENT_SIZE + rowlen) / (rowlen + 1);
+	par.num_segs = (png->height + par.seg_rows - 1) / par.seg_rows;
+
+	if(num_threads < 2 || par.num_segs < 2)
+		return PNG_DONE;
+
+	if(num_threads > par.num_segs)
+		num_threads = par.num_segs;
+	par.max_ahead = 2 * num_threads;
+
+	par.segs = png_alloc(png, par.num_segs * sizeof(png_segment_t));
+	threads = png_alloc(png, num_threads * sizeof(pthread_t));
+	png->writebuflen = 0;
+	png->writebufsize = png->idat_size;
+	png->writebuf = png_alloc(png, png->writebufsize);
+	result = png_begin_restarts(png);
+
+	if(!par.segs || !threads || !png->writebuf || result != PNG_NO_ERROR)
+	{
+		png_free(png, par.segs);
+		png_free(png, threads);
+		png_free(png, png->writebuf);
+		png_free(png, png->restarts);
+		png->writebuf = 0;
+		png->restarts = 0;
+		return PNG_MEMORY_ERROR;
+	}
+
+	memset(par.segs, 0, par.num_segs * sizeof(png_segment_t));
+	par.settings = *png;
+	pthread_mutex_init(&par.lock, 0);
+	pthread_cond_init(&par.cond, 0);
+
+	while(started < num_threads && pthread_create(&threads[started], 0, png_parallel_worker, &par) == 0)
+		started++;
+
+	if(started)
+	{
+		result = png_write_segments(&par);
+
+		if(result != PNG_NO_ERROR)
+		{
+			pthread_mutex_lock(&par.lock);
+			par.abort = 1;
+			pthread_cond_broadcast(&par.cond);
+			pthread_mutex_unlock(&par.lock);
+		}
+
+		for(i = 0; i < started; i++)
+			pthread_join(threads[i], 0);
+
+		/* segments left over after an error */
+		for(i = 0; i < par.num_segs; i++)
+			png_free(png, par.segs[i].buf);
+
+		if(result == PNG_NO_ERROR)
+			result = png_write_final_idats(png);
+
+		if(result == PNG_NO_ERROR)
+			result = png_write_chunk(png, "IEND", 0, 0);
+	}
+	else
+	{
+		result = PNG_DONE;
+	}
+
+	pthread_cond_destroy(&par.cond);
+	pthread_mutex_destroy(&par.lock);
+	png_free(png, par.segs);
+	png_free(png, threads);
+	png_free(png, png->writebuf);
+	png_free(png, png->restarts);
+	png->writebuf = 0;
+	png->restarts = 0;
+
+	return result;
+}
+#endif
+
+int png_set_restart_interval(png_t* png, unsigned rows)
+{
+	png->restart_interval = rows;
+
+	return PNG_NO_ERROR;
+}
+
+int png_set_threads(png_t* png, unsigned threads)
+{
+	png->threads = threads ? threads : 1;
+
+	return PNG_NO_ERROR;
+}
+
+int png_set_filter(png_t* png, int filter)
+{
+	if(filter < PNG_FILTER_NONE || filter > PNG_FILTER_ADAPTIVE)
+		return PNG_WRONG_ARGUMENTS;
+
+	png->filter_heuristic = (unsigned char)filter;
+
+	return PNG_NO_ERROR;
+}
+
+int png_set_compression(png_t* png, int level, int strategy, unsigned idat_size)
+{
+	static const int zlib_strategies[] = { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE };
+
+	if(level < -1 || level > 9 || strategy < PNG_STRATEGY_DEFAULT || strategy > PNG_STRATEGY_RLE)
+		return PNG_WRONG_ARGUMENTS;
+
+	png->deflate_level = level;
+	png->deflate_strategy = zlib_strategies[strategy];
+	png->idat_size = idat_size ? idat_size : PNG_IDAT_CHUNK_SIZE;
+
+	return PNG_NO_ERROR;
+}
+
+/* set up png for an image of the given format, and write the signature and IHDR chunk */
+static int png_write_header(png_t* png, unsigned width, unsigned height, char depth, int color)
+{
+	png->width = width;
+	png->height = height;
+	png->depth = depth;
+	png->color_type = color;
+	png->bpp = png_get_bpp(png);
+
+	return png_write_ihdr(png);
+}
+
+/* set up encoding rows with png_write_rows, freeing everything on failure */
+static int png_begin_write(png_t* png)
+{
+	int result = png_begin_idats(png);
+
+	if(result != PNG_NO_ERROR)
+		png_free_idats(png);
+
+	png->next_row = 0;
+
+	return result;
+}
+
+/* encode rows rows from data, stride bytes apart, converting each into png->currow with convert first if it is not 0 */
+static int png_write_rows_convert(png_t* png, unsigned char* data, size_t stride, unsigned rows, png_convert_row_t convert, int swap)
+{
+	unsigned y;
+	int result = PNG_NO_ERROR;
+
+	if(!png->rowbuf || rows > png->height - png->next_row)
+		return PNG_WRONG_ARGUMENTS;
+
+	for(y = 0; y < rows && result == PNG_NO_ERROR; y++)
+	{
+		if(convert)
+		{
+			convert(png, data + y * stride, png->currow, png->width, swap);
+			result = png_encode_image_row(png, png->next_row, png->currow);
+		}
+		else
+		{
+			/* no conversion needed, so encode straight from data */
+			result = png_encode_image_row(png, png->next_row, data + y * stride);
+		}
+
+		png->next_row++;
+	}
+
+	if(result != PNG_NO_ERROR)
+		png_free_idats(png);
+
+	return result;
+}
+
+int png_write_begin(png_t* png, unsigned width, unsigned height, char depth, int color)
+{
+	png_write_header(png, width, height, depth, color);
+
+	return png_begin_write(png);
+}
+
+int png_write_rows(png_t* png, unsigned char* data, unsigned rows)
+{
+	return png_write_rows_convert(png, data, png_row_bytes(png), rows, 0, 0);
+}
+
+int png_write_rows_rgba(png_t* png, unsigned char* data, unsigned rows, int swap)
+{
+	if(png->color_type != PNG_TRUECOLOR_ALPHA || png->depth != 8)
+		return PNG_WRONG_ARGUMENTS;
+
+	/* reversing the bytes of each pixel is its own inverse, so the
+	   decode-side converter also converts back to PNG byte order */
+	return png_write_rows_convert(png, data, (size_t)png->width * 4, rows, swap ? png_get_rgba_converter(png) : 0, swap);
+}
+
+int png_write_end(png_t* png)
+{
+	if(!png->rowbuf)
+		return PNG_WRONG_ARGUMENTS;
+
+	return png_end_idats(png, png->next_row == png->height ? PNG_NO_ERROR : PNG_WRONG_ARGUMENTS);
+}
+
+/*
+	Writing 4-byte RGBA pixels with the smallest color type which holds them losslessly: without
+	alpha if every pixel is opaque, and greyscale if every pixel's red, green and blue are equal.
+	As when reading, if swap is set the bytes of each pixel are in reverse order (A,B,G,R).
+*/
+
+/* pixels scanned between checks for whether there is anything left to find */
+#define PNG_SCAN_BLOCK		4096
+
+/* clear *opaque and *grey if any of the count pixels of data is not opaque or not grey */
+static void png_rgba_scan(const unsigned char* data, size_t count, int swap, int* opaque, int* grey)
+{
+	unsigned a = swap ? 0 : 3, r = swap ? 3 : 0;
+	size_t i = 0, end;
+
+	/* stop early once a pixel has been found which is neither opaque nor grey */
+	while(i < count && (*opaque || *grey))
+	{
+		end = count - i < PNG_SCAN_BLOCK ? count : i + PNG_SCAN_BLOCK;
+
+#if USE_SSE2
+		{
+			const __m128i ones = _mm_set1_epi32(-1);
+			const __m128i not_alpha = _mm_set1_epi32(swap ? (int)0xffffff00 : 0x00ffffff);
+			const __m128i colors = _mm_set1_epi32(swap ? 0x00ffff00 : 0x0000ffff);
+			__m128i all = ones;
+			__m128i diff = _mm_setzero_si128();
+
+			/* AND the pixels together, and OR together each byte XORed with the next (so red with
+			   green and green with blue), then check the alpha and color bytes of the results */
+			for(; i + 4 <= end; i += 4)
+			{
+				__m128i v = _mm_loadu_si128((const __m128i*)(data + i * 4));
+				all = _mm_and_si128(all, v);
+				diff = _mm_or_si128(diff, _mm_xor_si128(v, _mm_srli_epi32(v, 8)));
+			}
+
+			if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(all, not_alpha), ones)) != 0xffff)
+				*opaque = 0;
+			if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(diff, colors), _mm_setzero_si128())) != 0xffff)
+				*grey = 0;
+		}
+#endif
+
+		for(; i < end; i++)
+		{
+			const unsigned char* p = data + i * 4;
+
+			if(p[a] != 255)
+				*opaque = 0;
+			if(p[1] != p[2] || p[r] != p[1])
+				*grey = 0;
+		}
+	}
+}
+
+/* find the smallest color type which holds the width*height pixels of data, whose rows are stride bytes apart, losslessly */
+static int png_rgba_color_type(const unsigned char* data, unsigned width, unsigned height, size_t stride, int swap)
+{
+	int opaque = 1, grey = 1;
+	unsigned y;
+
+	/* contiguous rows are scanned as one */
+	if(stride == (size_t)width * 4)
+		png_rgba_scan(data, (size_t)width * height, swap, &opaque, &grey);
+	else
+	{
+		for(y = 0; y < height && (opaque || grey); y++)
+			png_rgba_scan(data + y * stride, width, swap, &opaque, &grey);
+	}
+
+	if(grey)
+		return opaque ? PNG_GREYSCALE : PNG_GREYSCALE_ALPHA;
+
+	return opaque ? PNG_TRUECOLOR : PNG_TRUECOLOR_ALPHA;
+}
+
+static void png_reduce_rgb(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned i;
+
+	for(i = 0; i < width; i++, in += 4, out += 3)
+	{
+		out[0] = in[swap ? 3 : 0];
+		out[1] = in[swap ? 2 : 1];
+		out[2] = in[swap ? 1 : 2];
+	}
+}
+
+static void png_reduce_grey(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned i;
+
+	for(i = 0; i < width; i++, in += 4, out++)
+		out[0] = in[swap ? 3 : 0];
+}
+
+static void png_reduce_grey_alpha(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned i;
+
+	for(i = 0; i < width; i++, in += 4, out += 2)
+	{
+		out[0] = in[swap ? 3 : 0];
+		out[1] = in[swap ? 0 : 3];
+	}
+}
+
+#if USE_SSSE3
+__attribute__((target("ssse3")))
+static void png_reduce_rgb_ssse3(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned i = 0;
+	const __m128i shuf = swap ?
+		_mm_setr_epi8(3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, -1, -1, -1, -1) :
+		_mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+	/* each step packs 4 pixels, but stores 16 bytes, so stop while 6 pixels remain */
+	for(; i + 6 <= width; i += 4)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(in + i*4));
+		_mm_storeu_si128((__m128i*)(out + i*3), _mm_shuffle_epi8(v, shuf));
+	}
+
+	png_reduce_rgb(png, in + i*4, out + i*3, width - i, swap);
+}
+
+__attribute__((target("ssse3")))
+static void png_reduce_grey_ssse3(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned i = 0;
+	const __m128i shuf = swap ?
+		_mm_setr_epi8(3, 7, 11, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1) :
+		_mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+
+	/* each step packs 16 pixels, 4 from each load */
+	for(; i + 16 <= width; i += 16)
+	{
+		__m128i v0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i*4)), shuf);
+		__m128i v1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i*4 + 16)), shuf);
+		__m128i v2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i*4 + 32)), shuf);
+		__m128i v3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i*4 + 48)), shuf);
+		__m128i v = _mm_unpacklo_epi64(_mm_unpacklo_epi32(v0, v1), _mm_unpacklo_epi32(v2, v3));
+		_mm_storeu_si128((__m128i*)(out + i), v);
+	}
+
+	png_reduce_grey(png, in + i*4, out + i, width - i, swap);
+}
+
+__attribute__((target("ssse3")))
+static void png_reduce_grey_alpha_ssse3(png_t* png, const unsigned char* in, unsigned char* out, unsigned width, int swap)
+{
+	unsigned i = 0;
+	const __m128i shuf = swap ?
+		_mm_setr_epi8(3, 0, 7, 4, 11, 8, 15, 12, -1, -1, -1, -1, -1, -1, -1, -1) :
+		_mm_setr_epi8(0, 3, 4, 7, 8, 11, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1);
+
+	/* each step packs 8 pixels, 4 from each load */
+	for(; i + 8 <= width; i += 8)
+	{
+		__m128i v0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i*4)), shuf);
+		__m128i v1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + i*4 + 16)), shuf);
+		_mm_storeu_si128((__m128i*)(out + i*2), _mm_unpacklo_epi64(v0, v1));
+	}
+
+	png_reduce_grey_alpha(png, in + i*4, out + i*2, width - i, swap);
+}
+#endif
+
+/* get the row conversion from 4-byte pixels to png's color type, or 0 if none is needed */
+static png_convert_row_t png_get_rgba_reducer(png_t* png, int swap)
+{
+	if(png->color_type == PNG_TRUECOLOR_ALPHA)
+		return swap ? png_get_rgba_converter(png) : 0;
+
+#if USE_SSSE3
+	if(__builtin_cpu_supports("ssse3"))
+	{
+		if(png->color_type == PNG_TRUECOLOR)
+			return png_reduce_rgb_ssse3;
+		if(png->color_type == PNG_GREYSCALE)
+			return png_reduce_grey_ssse3;
+		return png_reduce_grey_alpha_ssse3;
+	}
+#endif
+
+	if(png->color_type == PNG_TRUECOLOR)
+		return png_reduce_rgb;
+	if(png->color_type == PNG_GREYSCALE)
+		return png_reduce_grey;
+
+	return png_reduce_grey_alpha;
+}
+
+int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data)
+{
+	int result;
+
+	png_write_header(png, width, height, depth, color);
+
+#if USE_THREADS
+	result = png_write_idats_parallel(png, data, png_row_bytes(png), 0, 0);
+	if(result != PNG_DONE)
+		return result;
+#endif
+
+	result = png_begin_write(png);
+
+	if(result == PNG_NO_ERROR)
+		result = png_write_rows(png, data, height);
+
+	if(result == PNG_NO_ERROR)
+		result = png_write_end(png);
+
+	return result;
+}
+
+int png_set_data_rgba(png_t* png, unsigned width, unsigned height, unsigned char* data, int swap)
+{
+	return png_set_data_rgba_stride(png, width, height, data, (size_t)width * 4, swap);
+}
+
+int png_set_data_rgba_stride(png_t* png, unsigned width, unsigned height, unsigned char* data, size_t stride, int swap)
+{
+	png_convert_row_t reduce;
+	int result;
+
+	png_write_header(png, width, height, 8, png_rgba_color_type(data, width, height, stride, swap));
+	reduce = png_get_rgba_reducer(png, swap);
+
+#if USE_THREADS
+	result = png_write_idats_parallel(png, data, stride, reduce, swap);
+	if(result != PNG_DONE)
+		return result;
+#endif
+
+	result = png_begin_write(png);
+
+	if(result == PNG_NO_ERROR)
+		result = png_write_rows_convert(png, data, stride, height, reduce, swap);
+
+	if(result == PNG_NO_ERROR)
+		result = png_write_end(png);
+
+	return result;
+}
+
 char* png_error_string(int error)
 {
 	switch(error)
@@ -73,6 +73,35 @@ enum
 	PNG_TRUECOLOR_ALPHA		= 6
 };
 
+/*
+	Row filter selection when writing, see png_set_filter. PNG_FILTER_NONE through PNG_FILTER_PAETH use that
+	filter type for every row. PNG_FILTER_ADAPTIVE picks the filter type for each row that minimizes the sum of
+	the absolute values of the filtered bytes (taken as signed).
+*/
+
+enum
+{
+	PNG_FILTER_NONE			= 0,
+	PNG_FILTER_SUB			= 1,
+	PNG_FILTER_UP			= 2,
+	PNG_FILTER_AVERAGE		= 3,
+	PNG_FILTER_PAETH		= 4,
+	PNG_FILTER_ADAPTIVE		= 5
+};
+
+/*
+	Deflate strategies for png_set_compression. These correspond to zlib's Z_DEFAULT_STRATEGY, Z_FILTERED,
+	Z_HUFFMAN_ONLY and Z_RLE.
+*/
+
+enum
+{
+	PNG_STRATEGY_DEFAULT		= 0,
+	PNG_STRATEGY_FILTERED		= 1,
+	PNG_STRATEGY_HUFFMAN_ONLY	= 2,
+	PNG_STRATEGY_RLE		= 3
+};
+
 /*
 	Typedefs for callbacks.
 */
@@ -82,12 +111,17 @@ typedef unsigned (*png_read_callback_t)(void* output, size_t size, size_t numel,
 typedef void (*png_free_t)(void* p);
 typedef void * (*png_alloc_t)(size_t s);
 
+typedef struct png_cache png_cache_t;
+
 typedef struct
 {
 	void*				zs;				/* pointer to z_stream */
 	png_read_callback_t		read_fun;
 	png_write_callback_t		write_fun;
 	void*				user_pointer;
+	png_alloc_t			alloc_fun;	/* allocator for everything this png allocates */
+	png_free_t			free_fun;
+	png_cache_t*			cache;		/* buffers and zlib streams to reuse, or 0 */
 
 	unsigned char*			png_data;
 	unsigned			png_datalen;
@@ -99,10 +133,33 @@ typedef struct
 	unsigned char			compression_method;
 	unsigned char			filter_method;
 	unsigned char			interlace_method;
-	unsigned char			bpp;
+	unsigned char			bpp;		/* bytes per pixel, at least 1 (the filters' byte distance) */
+
+	unsigned char			palette[256][4];	/* R,G,B,A of each entry, from the PLTE and tRNS chunks */
+	unsigned			palette_size;
+	unsigned short			trns_key[3];	/* grey, or R,G,B, sample value shown transparent */
+	unsigned char			has_trns_key;	/* set by a tRNS chunk for greyscale or truecolor */
 
 	unsigned char*			readbuf;
 	unsigned			readbuflen;
+
+	unsigned char			filter_heuristic;
+	unsigned char*			rowbuf;		/* filter byte + one row, when writing or reading rows */
+	unsigned char*			candbuf;	/* candidate filtered row, when writing */
+	unsigned char*			filterbuf;	/* storage for prevrow and currow */
+	unsigned char*			prevrow;	/* previous unfiltered row, when writing or reading rows */
+	unsigned char*			currow;		/* current unfiltered row, when writing or reading rows */
+	unsigned char*			writebuf;	/* compressed IDAT data, when writing or decoding segments */
+	unsigned			writebuflen;
+	unsigned			writebufsize;
+	int				deflate_level;
+	int				deflate_strategy;
+	unsigned			idat_size;	/* max bytes of compressed data per IDAT chunk */
+	unsigned			threads;	/* number of threads compressing or decompressing */
+	unsigned			restart_interval;	/* rows between restart points, when writing */
+	unsigned*			restarts;	/* row and offset of each restart point */
+	unsigned			num_restarts;
+	unsigned			next_row;	/* next row for png_read_rows or png_write_rows */
 } png_t;
 
 /*
@@ -112,6 +169,12 @@ typedef struct
 
 	> void* (*custom_alloc)(size_t s)
 	> void (*custom_free)(void* p)
+
+	These become the allocator of each png opened afterwards. Calling it is optional, since malloc and free are used
+	otherwise; if it is called, it should be before any png is opened, as it is not synchronized with other threads.
+	Apart from that, pnglite has no shared state, so different pngs can be read and written on different threads at
+	the same time.
+
 	Parameters:
 		pngalloc - Pointer to custom allocation routine. If 0 is passed, malloc from libc will be used.
 		pngfree - Pointer to custom free routine. If 0 is passed, free from libc will be used.
@@ -122,6 +185,63 @@ typedef struct
 
 int png_init(png_alloc_t pngalloc, png_free_t pngfree);
 
+/*
+	Function: png_set_allocator
+
+	Sets the memory allocation routines used for one png, in place of those given to png_init. Call it after opening
+	the png and before reading or writing any image data.
+
+	Parameters:
+		png - png_t struct
+		pngalloc - Pointer to custom allocation routine. If 0 is passed, malloc from libc will be used.
+		pngfree - Pointer to custom free routine. If 0 is passed, free from libc will be used.
+*/
+
+void png_set_allocator(png_t* png, png_alloc_t pngalloc, png_free_t pngfree);
+
+/*
+	Function: png_cache_create
+
+	Creates a cache of buffers and zlib streams which can be shared by many pngs (see png_set_cache). Buffers freed
+	by a png using the cache are kept for the next one, so the cache only grows, up to a fixed number of buffers;
+	inflate and deflate streams are kept too, and only need resetting to be reused. The cache is locked while it is
+	changed, so pngs on different threads can use it at the same time.
+
+	Parameters:
+		pngalloc - Allocation routine for the cache and the buffers in it. If 0 is passed, malloc from libc will be used.
+		pngfree - Free routine for the cache and the buffers in it. If 0 is passed, free from libc will be used.
+
+	Returns:
+		The cache, or 0 if it could not be allocated.
+*/
+
+png_cache_t* png_cache_create(png_alloc_t pngalloc, png_free_t pngfree);
+
+/*
+	Function: png_cache_destroy
+
+	Frees a cache and everything in it. No png may be using it.
+
+	Parameters:
+		cache - Cache created with png_cache_create, or 0.
+*/
+
+void png_cache_destroy(png_cache_t* cache);
+
+/*
+	Function: png_set_cache
+
+	Makes a png allocate its buffers and zlib streams from a cache, instead of with its own allocator, and return
+	them to the cache when it is done with them. Call it after opening the png and before reading or writing any
+	image data.
+
+	Parameters:
+		png - png_t struct
+		cache - Cache created with png_cache_create, or 0 for none.
+*/
+
+void png_set_cache(png_t* png, png_cache_t* cache);
+
 /*
 	Function: png_open_file
 
@@ -138,9 +258,42 @@ int png_init(png_alloc_t pngalloc, png_free_t pngfree);
 
 int png_open_file(png_t *png, const char* filename);
 
+/*
+	Function: png_open_file_read
+
+	Opens a png file for reading, reading its signature and header like png_open_read. On failure nothing is left
+	open; otherwise close it with png_close_file.
+
+	Parameters:
+		png - Empty png_t struct.
+		filename - Filename of the file to be opened.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
 int png_open_file_read(png_t *png, const char* filename);
+
 int png_open_file_write(png_t *png, const char* filename);
 
+/*
+	Function: png_open_file_map
+
+	Opens a png file for reading like png_open_file_read, but maps it into memory and reads it through a callback,
+	so that the compressed image data is inflated in place from the mapping instead of being copied into a read
+	buffer first. The mapping is advised to be read sequentially. Files which cannot be mapped, such as pipes, are
+	read with stdio instead. On failure nothing is left open; otherwise close it with png_close_file.
+
+	Parameters:
+		png - Empty png_t struct.
+		filename - Filename of the file to be opened.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_open_file_map(png_t *png, const char* filename);
+
 /*
 	Function: png_open
 
@@ -166,7 +319,8 @@ int png_open_file_write(png_t *png, const char* filename);
 		user_pointer - User pointer to be passed to read_fun.
 
 	Returns:
-		PNG_NO_ERROR on success, otherwise an error code.
+		PNG_NO_ERROR on success, otherwise an error code. PNG_NOT_SUPPORTED is returned for interlaced images, and
+		for color types and bit depths PNG does not allow.
 */
 
 int png_open(png_t* png, png_read_callback_t read_fun, void* user_pointer);
@@ -206,6 +360,8 @@ char* png_error_string(int error);
 
 	> width*height*(bytes per pixel)
 
+	except that rows of samples of less than 8 bits are packed into (width*depth+7)/8 bytes each.
+
 	Parameters:
 		data - Where to store result.
 
@@ -215,12 +371,298 @@ char* png_error_string(int error);
 
 int png_get_data(png_t* png, unsigned char* data);
 
+/*
+	Function: png_get_data_rgba
+
+	This function decodes an opened png file of any color type and bit depth into 4-byte RGBA pixels, converting
+	each row as it is unfiltered, so no intermediate buffer is needed. Greyscale is copied to red, green and blue,
+	with samples of less than 8 bits scaled up; palette indices are looked up in the PLTE chunk, with the alpha of
+	the tRNS chunk; 16-bit samples keep their most significant byte; and images without alpha get an alpha of 255,
+	or of 0 for pixels matching the color key of a tRNS chunk. Common formats are expanded with SSSE3 shuffles.
+	data should be big enough to hold the decoded png. Required size will be:
+
+	> width*height*4
+
+	Parameters:
+		data - Where to store result.
+		swap - If nonzero, the bytes of each pixel are stored in reverse order (A,B,G,R), i.e., as 0xRRGGBBAA
+		       values on a little-endian host.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_get_data_rgba(png_t* png, unsigned char* data, int swap);
+
+/*
+	Function: png_get_data_rgba_sampled
+
+	This function is like png_get_data_rgba, but only stores every xstep-th pixel of every ystep-th row, starting
+	with the first, so it decodes the image downscaled by those factors. Every row up to the last one sampled is
+	still inflated and unfiltered, but the other pixels are not converted or stored. data should be big enough to
+	hold the downscaled image. Required size will be:
+
+	> (width/xstep)*(height/ystep)*4
+
+	Parameters:
+		data - Where to store result.
+		xstep - Horizontal sampling step, at least 1.
+		ystep - Vertical sampling step, at least 1.
+		swap - If nonzero, the bytes of each pixel are stored in reverse order (A,B,G,R).
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_get_data_rgba_sampled(png_t* png, unsigned char* data, unsigned xstep, unsigned ystep, int swap);
+
+/*
+	Function: png_read_rows
+
+	This function decodes the next rows of the opened png file into data, which should be big enough to hold
+	rows rows of width*(bytes per pixel) bytes each. The image data is inflated and unfiltered a row at a time as
+	the file is read, so besides data only one IDAT chunk and a few rows are held in memory, and the caller
+	can process each block of rows before the next one is decoded. Restart points are ignored.
+
+	Call it repeatedly until it returns 0. Once the last row has been decoded (or an error occurs) the decoding
+	state is freed; call png_read_rows_end to free it if you stop reading earlier.
+
+	Parameters:
+		data - Where to store result.
+		rows - Maximum number of rows to decode.
+
+	Returns:
+		The number of rows decoded, which is less than rows only for the last rows of the image, 0 once all of
+		the rows have been decoded, otherwise an error code.
+*/
+
+int png_read_rows(png_t* png, unsigned char* data, unsigned rows);
+
+/*
+	Function: png_read_rows_rgba
+
+	This function is like png_read_rows, but decodes rows into 4-byte RGBA pixels like png_get_data_rgba, so each
+	row of data is width*4 bytes.
+
+	Parameters:
+		data - Where to store result.
+		rows - Maximum number of rows to decode.
+		swap - If nonzero, the bytes of each pixel are stored in reverse order (A,B,G,R).
+
+	Returns:
+		The number of rows decoded, 0 once all of the rows have been decoded, otherwise an error code.
+*/
+
+int png_read_rows_rgba(png_t* png, unsigned char* data, unsigned rows, int swap);
+
+/*
+	Function: png_read_rows_end
+
+	This function frees the decoding state of png_read_rows and png_read_rows_rgba. It need only be called if
+	reading stops before all of the rows have been decoded, and may be called more than once. It does not
+	close the file.
+
+	Returns:
+		PNG_NO_ERROR
+*/
+
+int png_read_rows_end(png_t* png);
+
+/*
+	Function: png_set_filter
+
+	This function selects how rows are filtered by png_set_data and png_set_data_rgba. The default, set by
+	png_open_write, is PNG_FILTER_NONE.
+
+	Parameters:
+		png - png_t struct opened for writing.
+		filter - One of the PNG_FILTER_* values.
+
+	Returns:
+		PNG_NO_ERROR on success, PNG_WRONG_ARGUMENTS if filter is not valid.
+*/
+
+int png_set_filter(png_t* png, int filter);
+
+/*
+	Function: png_set_compression
+
+	This function selects how png_set_data and png_set_data_rgba compress the image data. The defaults, set by
+	png_open_write, are zlib's default level and strategy and 64 KiB IDAT chunks.
+
+	Parameters:
+		png - png_t struct opened for writing.
+		level - zlib compression level, from 0 (stored, no compression) to 9, or -1 for zlib's default.
+		strategy - One of the PNG_STRATEGY_* values.
+		idat_size - Maximum number of bytes of compressed data per IDAT chunk, or 0 for the default.
+
+	Returns:
+		PNG_NO_ERROR on success, PNG_WRONG_ARGUMENTS if level or strategy is not valid.
+*/
+
+int png_set_compression(png_t* png, int level, int strategy, unsigned idat_size);
+
+/*
+	Function: png_set_threads
+
+	This function sets the number of worker threads png_set_data and png_set_data_rgba use to filter and compress
+	the image data. With more than one thread, the image is split into segments of rows which are compressed
+	independently, so the output differs slightly from (and is a little larger than) the single-threaded output,
+	but does not depend on the number of threads.
+
+	When reading, png_get_data and png_get_data_rgba use up to this many threads (including the calling thread).
+	Files which have restart points (see png_set_restart_interval) are decoded a segment per thread. Other files
+	are decoded by a pipeline whose stages (reading, inflating, unfiltering and converting) run on up to four
+	threads, so rows are unfiltered while later ones are still being inflated.
+
+	The default, set by png_open_read and png_open_write, is 1.
+
+	Parameters:
+		png - png_t struct.
+		threads - Number of threads. 0 is treated as 1.
+
+	Returns:
+		PNG_NO_ERROR
+*/
+
+int png_set_threads(png_t* png, unsigned threads);
+
+/*
+	Function: png_set_restart_interval
+
+	This function makes png_set_data and png_set_data_rgba insert a restart point every rows rows, so that the
+	image can be decoded in parallel. At each restart point deflate is fully flushed, and the row is filtered
+	with the none or sub filter, which do not use the row above. The restart points are listed in a private
+	ancillary "rsTR" chunk before the IDAT chunks, which other decoders ignore. This means the compressed data is
+	held in memory until it is all written. The default, set by png_open_write, is 0 (no restart points).
+
+	Parameters:
+		png - png_t struct opened for writing.
+		rows - Number of rows between restart points, or 0 for none.
+
+	Returns:
+		PNG_NO_ERROR
+*/
+
+int png_set_restart_interval(png_t* png, unsigned rows);
+
 int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data);
 
+/*
+	Function: png_set_data_rgba
+
+	This function writes 4-byte RGBA pixels as an 8-bit png of the smallest color type which holds them losslessly:
+	without alpha if every pixel is opaque, and greyscale if every pixel's red, green and blue are equal. The pixels are scanned for this first, which is cheap next to compressing them. Rows are converted
+	and compressed one at a time, so no copy of the image data is made.
+
+	Parameters:
+		png - png_t struct opened for writing.
+		width - Image width.
+		height - Image height.
+		data - width*height*4 bytes of pixel data.
+		swap - If nonzero, the bytes of each pixel in data are in reverse order (A,B,G,R), i.e., 0xRRGGBBAA
+		       values on a little-endian host.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_set_data_rgba(png_t* png, unsigned width, unsigned height, unsigned char* data, int swap);
+
+/*
+	Function: png_set_data_rgba_stride
+
+	This function is like png_set_data_rgba, but the rows of data need not be contiguous, e.g. for a
+	rectangle within a larger image.
+
+	Parameters:
+		png - png_t struct opened for writing.
+		width - Image width.
+		height - Image height.
+		data - height rows of width*4 bytes of pixel data.
+		stride - Number of bytes from the start of one row of data to the start of the next.
+		swap - As for png_set_data_rgba.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_set_data_rgba_stride(png_t* png, unsigned width, unsigned height, unsigned char* data, size_t stride, int swap);
+
+/*
+	Function: png_write_begin
+
+	This function starts writing a png a block of rows at a time, for when the rows are produced incrementally.
+	It writes the header; the rows are then passed to png_write_rows (or png_write_rows_rgba), which filters and
+	compresses them as they arrive, and png_write_end finishes the file. The filter and compression settings apply
+	as with png_set_data, but the rows are always encoded on the calling thread. With restart points (see
+	png_set_restart_interval), the compressed data is held in memory until png_write_end, since the restart
+	points must be written before it.
+
+	Parameters:
+		png - png_t struct opened for writing.
+		width - Image width.
+		height - Image height.
+		depth - Bit depth of the image.
+		color - Color type of the image. Use PNG_TRUECOLOR_ALPHA and a depth of 8 for png_write_rows_rgba.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_write_begin(png_t* png, unsigned width, unsigned height, char depth, int color);
+
+/*
+	Function: png_write_rows
+
+	This function encodes the next rows of an image started with png_write_begin. If it fails, the encoding state
+	is freed and png_write_end need not be called.
+
+	Parameters:
+		png - png_t struct passed to png_write_begin.
+		data - rows rows of width*(bytes per pixel) bytes each.
+		rows - Number of rows, at most the number of rows not yet written.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_write_rows(png_t* png, unsigned char* data, unsigned rows);
+
+/*
+	Function: png_write_rows_rgba
+
+	This function is like png_write_rows, but takes 4-byte pixels like png_set_data_rgba.
+
+	Parameters:
+		png - png_t struct passed to png_write_begin with PNG_TRUECOLOR_ALPHA and a depth of 8.
+		data - rows rows of width*4 bytes each.
+		rows - Number of rows, at most the number of rows not yet written.
+		swap - If nonzero, the bytes of each pixel in data are in reverse order (A,B,G,R).
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_write_rows_rgba(png_t* png, unsigned char* data, unsigned rows, int swap);
+
+/*
+	Function: png_write_end
+
+	This function finishes writing an image started with png_write_begin and frees the encoding state. It does
+	not close the file.
+
+	Returns:
+		PNG_NO_ERROR on success, PNG_WRONG_ARGUMENTS if not all of the rows were written, otherwise an error code.
+*/
+
+int png_write_end(png_t* png);
+
 /*
 	Function: png_close_file
 
-	Closes an open png file pointer. Should only be used when the png has been opened with png_open_file.
+	Closes an open png file pointer, or unmaps a mapped file. Should only be used when the png has been opened with
+	png_open_file or png_open_file_map.
 
 	Parameters:
 		png - png to close.
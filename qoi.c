@@ -0,0 +1,414 @@
+/*  qoi.c - Reading and writing QOI ("Quite OK Image") files
+	See qoi.h
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qoi.h"
+
+#define QOI_OP_INDEX	0x00	/* 00xxxxxx: pixel from the index */
+#define QOI_OP_DIFF	0x40	/* 01rrggbb: small difference from the previous pixel */
+#define QOI_OP_LUMA	0x80	/* 10gggggg rrrrbbbb: green difference, and red and blue relative to it */
+#define QOI_OP_RUN	0xc0	/* 11xxxxxx: run of 1 to 62 copies of the previous pixel */
+#define QOI_OP_RGB	0xfe
+#define QOI_OP_RGBA	0xff
+#define QOI_MASK_2	0xc0
+
+#define QOI_HEADER_SIZE	14
+#define QOI_MAX_RUN	62
+
+/* the specification's limit, which keeps width*height*4 well within 32 bits */
+#define QOI_PIXELS_MAX	400000000u
+
+/* the longest op, which every op is decoded or encoded with room for */
+#define QOI_MAX_OP	5
+
+#define QOI_HASH(p)	(((p)[0] * 3 + (p)[1] * 5 + (p)[2] * 7 + (p)[3] * 11) % 64)
+
+static const unsigned char qoi_padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+static unsigned qoi_get_ul(const unsigned char* p)
+{
+	return ((unsigned)p[0] << 24) | ((unsigned)p[1] << 16) | ((unsigned)p[2] << 8) | p[3];
+}
+
+static void qoi_put_ul(unsigned char* p, unsigned v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static void qoi_start(qoi_t* qoi)
+{
+	qoi->next_row = 0;
+	qoi->px[0] = qoi->px[1] = qoi->px[2] = 0;
+	qoi->px[3] = 255;
+	memset(qoi->index, 0, sizeof(qoi->index));
+	qoi->run = 0;
+	qoi->buflen = 0;
+	qoi->bufpos = 0;
+}
+
+/* make at least want bytes available to decode, unless the file ends first; returns the number available */
+static unsigned qoi_fill(qoi_t* qoi, unsigned want)
+{
+	unsigned avail = qoi->buflen - qoi->bufpos;
+
+	if(avail >= want)
+		return avail;
+
+	memmove(qoi->buf, qoi->buf + qoi->bufpos, avail);
+	qoi->buflen = avail + (unsigned)fread(qoi->buf + avail, 1, QOI_BUFFER_SIZE - avail, qoi->fp);
+	qoi->bufpos = 0;
+
+	return qoi->buflen;
+}
+
+/* write out the encoded bytes in buf */
+static int qoi_flush(qoi_t* qoi)
+{
+	if(qoi->buflen && fwrite(qoi->buf, 1, qoi->buflen, qoi->fp) != qoi->buflen)
+		return QOI_FILE_ERROR;
+
+	qoi->buflen = 0;
+
+	return QOI_NO_ERROR;
+}
+
+int qoi_open_file_read(qoi_t* qoi, const char* filename)
+{
+	unsigned char* h;
+
+	qoi->writing = 0;
+	qoi->fp = fopen(filename, "rb");
+	if(!qoi->fp)
+		return QOI_FILE_ERROR;
+
+	qoi->buf = malloc(QOI_BUFFER_SIZE);
+	if(!qoi->buf)
+	{
+		fclose(qoi->fp);
+		return QOI_MEMORY_ERROR;
+	}
+
+	qoi_start(qoi);
+
+	if(qoi_fill(qoi, QOI_HEADER_SIZE) < QOI_HEADER_SIZE || memcmp(qoi->buf, "qoif", 4) != 0)
+	{
+		qoi_close_file(qoi);
+		return QOI_HEADER_ERROR;
+	}
+
+	h = qoi->buf;
+	qoi->width = qoi_get_ul(h + 4);
+	qoi->height = qoi_get_ul(h + 8);
+	qoi->channels = h[12];
+	qoi->colorspace = h[13];
+	qoi->bufpos = QOI_HEADER_SIZE;
+
+	if(qoi->width == 0 || qoi->height == 0 || (unsigned long long)qoi->width * qoi->height > QOI_PIXELS_MAX ||
+		(qoi->channels != 3 && qoi->channels != 4) || qoi->colorspace > 1)
+	{
+		qoi_close_file(qoi);
+		return QOI_HEADER_ERROR;
+	}
+
+	return QOI_NO_ERROR;
+}
+
+int qoi_read_rows(qoi_t* qoi, unsigned char* data, unsigned rows, int swap)
+{
+	unsigned char px[4];
+	unsigned run = qoi->run;
+	unsigned count, i;
+
+	if(qoi->writing)
+		return QOI_WRONG_ARGUMENTS;
+
+	if(rows > qoi->height - qoi->next_row)
+		rows = qoi->height - qoi->next_row;
+	if(rows == 0)
+		return 0;
+
+	memcpy(px, qoi->px, 4);
+	count = rows * qoi->width;
+
+	for(i = 0; i < count; i++, data += 4)
+	{
+		if(run)
+		{
+			run--;
+		}
+		else
+		{
+			unsigned avail = qoi->buflen - qoi->bufpos;
+			unsigned char* p;
+			unsigned char b1;
+			unsigned len;
+
+			if(avail < QOI_MAX_OP)
+				avail = qoi_fill(qoi, QOI_MAX_OP);
+			if(avail == 0)
+				return QOI_DATA_ERROR;
+
+			p = qoi->buf + qoi->bufpos;
+			b1 = p[0];
+
+			if(b1 == QOI_OP_RGB)
+			{
+				len = 4;
+				if(avail < len)
+					return QOI_DATA_ERROR;
+				px[0] = p[1];
+				px[1] = p[2];
+				px[2] = p[3];
+			}
+			else if(b1 == QOI_OP_RGBA)
+			{
+				len = 5;
+				if(avail < len)
+					return QOI_DATA_ERROR;
+				memcpy(px, p + 1, 4);
+			}
+			else
+			{
+				len = 1;
+				switch(b1 & QOI_MASK_2)
+				{
+				case QOI_OP_INDEX:
+					memcpy(px, qoi->index[b1], 4);
+					break;
+				case QOI_OP_DIFF:
+					px[0] += ((b1 >> 4) & 0x03) - 2;
+					px[1] += ((b1 >> 2) & 0x03) - 2;
+					px[2] += (b1 & 0x03) - 2;
+					break;
+				case QOI_OP_LUMA:
+				{
+					int vg = (b1 & 0x3f) - 32;
+
+					len = 2;
+					if(avail < len)
+						return QOI_DATA_ERROR;
+					px[0] += vg - 8 + ((p[1] >> 4) & 0x0f);
+					px[1] += vg;
+					px[2] += vg - 8 + (p[1] & 0x0f);
+					break;
+				}
+				default:
+					/* this pixel, and b1 & 0x3f more */
+					run = b1 & 0x3f;
+					break;
+				}
+			}
+
+			qoi->bufpos += len;
+			memcpy(qoi->index[QOI_HASH(px)], px, 4);
+		}
+
+		if(swap)
+		{
+			data[0] = px[3];
+			data[1] = px[2];
+			data[2] = px[1];
+			data[3] = px[0];
+		}
+		else
+		{
+			memcpy(data, px, 4);
+		}
+	}
+
+	memcpy(qoi->px, px, 4);
+	qoi->run = run;
+	qoi->next_row += rows;
+
+	/* a run past the last pixel, or a missing end marker, means the file is corrupt or truncated */
+	if(qoi->next_row == qoi->height &&
+		(run || qoi_fill(qoi, sizeof(qoi_padding)) < sizeof(qoi_padding) ||
+			memcmp(qoi->buf + qoi->bufpos, qoi_padding, sizeof(qoi_padding)) != 0))
+		return QOI_DATA_ERROR;
+
+	return (int)rows;
+}
+
+int qoi_open_file_write(qoi_t* qoi, const char* filename, unsigned width, unsigned height, unsigned channels)
+{
+	if(width == 0 || height == 0 || (unsigned long long)width * height > QOI_PIXELS_MAX ||
+		(channels != 3 && channels != 4))
+		return QOI_WRONG_ARGUMENTS;
+
+	qoi->writing = 1;
+	qoi->width = width;
+	qoi->height = height;
+	qoi->channels = (unsigned char)channels;
+	qoi->colorspace = 0;
+
+	qoi->fp = fopen(filename, "wb");
+	if(!qoi->fp)
+		return QOI_FILE_ERROR;
+
+	qoi->buf = malloc(QOI_BUFFER_SIZE);
+	if(!qoi->buf)
+	{
+		fclose(qoi->fp);
+		return QOI_MEMORY_ERROR;
+	}
+
+	qoi_start(qoi);
+
+	memcpy(qoi->buf, "qoif", 4);
+	qoi_put_ul(qoi->buf + 4, width);
+	qoi_put_ul(qoi->buf + 8, height);
+	qoi->buf[12] = qoi->channels;
+	qoi->buf[13] = qoi->colorspace;
+	qoi->buflen = QOI_HEADER_SIZE;
+
+	return QOI_NO_ERROR;
+}
+
+int qoi_write_rows(qoi_t* qoi, const unsigned char* data, unsigned rows, int swap)
+{
+	unsigned char prev[4];
+	unsigned char px[4];
+	unsigned char* out;
+	unsigned run = qoi->run;
+	unsigned count, i;
+
+	if(!qoi->writing || rows > qoi->height - qoi->next_row)
+		return QOI_WRONG_ARGUMENTS;
+
+	memcpy(prev, qoi->px, 4);
+	count = rows * qoi->width;
+
+	for(i = 0; i < count; i++, data += 4)
+	{
+		if(swap)
+		{
+			px[0] = data[3];
+			px[1] = data[2];
+			px[2] = data[1];
+			px[3] = data[0];
+		}
+		else
+		{
+			memcpy(px, data, 4);
+		}
+
+		if(memcmp(px, prev, 4) == 0)
+		{
+			run++;
+			if(run < QOI_MAX_RUN)
+				continue;
+		}
+
+		if(qoi->buflen > QOI_BUFFER_SIZE - 2 * QOI_MAX_OP && qoi_flush(qoi) != QOI_NO_ERROR)
+			return QOI_FILE_ERROR;
+
+		out = qoi->buf + qoi->buflen;
+
+		/* a run ends either because it is as long as it can be, or at a different pixel */
+		if(run)
+		{
+			*out++ = (unsigned char)(QOI_OP_RUN | (run - 1));
+			if(run == QOI_MAX_RUN && memcmp(px, prev, 4) == 0)
+			{
+				run = 0;
+				qoi->buflen = (unsigned)(out - qoi->buf);
+				continue;
+			}
+			run = 0;
+		}
+
+		{
+			int hash = QOI_HASH(px);
+
+			if(memcmp(qoi->index[hash], px, 4) == 0)
+			{
+				*out++ = (unsigned char)(QOI_OP_INDEX | hash);
+			}
+			else
+			{
+				memcpy(qoi->index[hash], px, 4);
+
+				if(px[3] == prev[3])
+				{
+					signed char vr = (signed char)(px[0] - prev[0]);
+					signed char vg = (signed char)(px[1] - prev[1]);
+					signed char vb = (signed char)(px[2] - prev[2]);
+					signed char vg_r = (signed char)(vr - vg);
+					signed char vg_b = (signed char)(vb - vg);
+
+					if(vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+					{
+						*out++ = (unsigned char)(QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2));
+					}
+					else if(vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8)
+					{
+						*out++ = (unsigned char)(QOI_OP_LUMA | (vg + 32));
+						*out++ = (unsigned char)((vg_r + 8) << 4 | (vg_b + 8));
+					}
+					else
+					{
+						*out++ = QOI_OP_RGB;
+						*out++ = px[0];
+						*out++ = px[1];
+						*out++ = px[2];
+					}
+				}
+				else
+				{
+					*out++ = QOI_OP_RGBA;
+					memcpy(out, px, 4);
+					out += 4;
+				}
+			}
+		}
+
+		qoi->buflen = (unsigned)(out - qoi->buf);
+		memcpy(prev, px, 4);
+	}
+
+	memcpy(qoi->px, prev, 4);
+	qoi->run = run;
+	qoi->next_row += rows;
+
+	return QOI_NO_ERROR;
+}
+
+int qoi_write_end(qoi_t* qoi)
+{
+	if(!qoi->writing || qoi->next_row != qoi->height)
+		return QOI_WRONG_ARGUMENTS;
+
+	if(qoi->buflen > QOI_BUFFER_SIZE - 1 - sizeof(qoi_padding) && qoi_flush(qoi) != QOI_NO_ERROR)
+		return QOI_FILE_ERROR;
+
+	if(qoi->run)
+	{
+		qoi->buf[qoi->buflen++] = (unsigned char)(QOI_OP_RUN | (qoi->run - 1));
+		qoi->run = 0;
+	}
+
+	memcpy(qoi->buf + qoi->buflen, qoi_padding, sizeof(qoi_padding));
+	qoi->buflen += sizeof(qoi_padding);
+
+	return qoi_flush(qoi);
+}
+
+int qoi_close_file(qoi_t* qoi)
+{
+	int result = QOI_NO_ERROR;
+
+	if(fclose(qoi->fp) != 0 && qoi->writing)
+		result = QOI_FILE_ERROR;
+
+	free(qoi->buf);
+	qoi->fp = 0;
+	qoi->buf = 0;
+
+	return result;
+}
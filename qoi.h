@@ -0,0 +1,165 @@
+/*  qoi.h - Reading and writing QOI ("Quite OK Image") files
+
+	QOI is a simple lossless format for RGB and RGBA images, which encodes each pixel as
+	a run of the previous pixel, a reference to a recently seen pixel, a small difference
+	from the previous pixel, or the pixel itself. It compresses less than PNG, but reads
+	and writes many times faster, which makes it a good choice for intermediate files.
+	See https://qoiformat.org/qoi-specification.pdf
+
+	Like pnglite, pixels are read and written as R,G,B,A bytes, optionally byteswapped,
+	a block of rows at a time, so an image never has to be in memory as a whole.
+*/
+
+#ifndef _QOI_H_
+#define _QOI_H_
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+	Enumerations for error codes
+*/
+enum
+{
+	QOI_NO_ERROR		= 0,
+	QOI_FILE_ERROR		= -1,
+	QOI_HEADER_ERROR	= -2,	/* not a QOI file, or a header that does not make sense */
+	QOI_MEMORY_ERROR	= -3,
+	QOI_DATA_ERROR		= -4,	/* corrupt or truncated pixel data */
+	QOI_WRONG_ARGUMENTS	= -5
+};
+
+/* size of the buffer between the file and the encoder or decoder */
+#define QOI_BUFFER_SIZE		(64*1024)
+
+/*
+	The qoi_t struct
+*/
+typedef struct
+{
+	FILE*			fp;
+	int			writing;
+
+	unsigned		width;
+	unsigned		height;
+	unsigned char		channels;	/* 3 for RGB, 4 for RGBA */
+	unsigned char		colorspace;	/* 0 for sRGB with linear alpha, 1 for all linear */
+
+	unsigned		next_row;	/* next row for qoi_read_rows or qoi_write_rows */
+	unsigned char		px[4];		/* previous pixel */
+	unsigned char		index[64][4];	/* recently seen pixels */
+	unsigned		run;		/* repeats of px not yet read or written */
+
+	unsigned char*		buf;
+	unsigned		buflen;		/* bytes in buf */
+	unsigned		bufpos;		/* next byte of buf to decode, when reading */
+} qoi_t;
+
+/*
+	Function: qoi_open_file_read
+
+	Opens a QOI file for reading, and reads its header. On failure nothing is left open; otherwise close it with
+	qoi_close_file.
+
+	Parameters:
+		qoi - Empty qoi_t struct.
+		filename - Filename of the file to be opened.
+
+	Returns:
+		QOI_NO_ERROR on success, otherwise an error code.
+*/
+
+int qoi_open_file_read(qoi_t* qoi, const char* filename);
+
+/*
+	Function: qoi_read_rows
+
+	Decodes the next rows of a QOI file opened with qoi_open_file_read into data, as R,G,B,A bytes per pixel. RGB
+	files are read with an alpha of 255. After the last row, the end marker of the file is checked.
+
+	Parameters:
+		qoi - qoi_t struct.
+		data - Buffer with room for rows rows of width*4 bytes.
+		rows - Maximum number of rows to read.
+		swap - Reverse the bytes of each pixel (A,B,G,R) if nonzero.
+
+	Returns:
+		The number of rows read, which is less than rows only at the end of the image, 0 once all of the rows have
+		been read, or a (negative) error code.
+*/
+
+int qoi_read_rows(qoi_t* qoi, unsigned char* data, unsigned rows, int swap);
+
+/*
+	Function: qoi_open_file_write
+
+	Creates a QOI file, and writes its header. On failure nothing is left open; otherwise finish it with
+	qoi_write_end and close it with qoi_close_file.
+
+	Parameters:
+		qoi - Empty qoi_t struct.
+		filename - Filename of the file to be created.
+		width - Image width.
+		height - Image height.
+		channels - 3 if every pixel is opaque, otherwise 4. This is only recorded in the header; the pixels are
+			encoded the same way either way.
+
+	Returns:
+		QOI_NO_ERROR on success, otherwise an error code.
+*/
+
+int qoi_open_file_write(qoi_t* qoi, const char* filename, unsigned width, unsigned height, unsigned channels);
+
+/*
+	Function: qoi_write_rows
+
+	Encodes the next rows of a QOI file created with qoi_open_file_write.
+
+	Parameters:
+		qoi - qoi_t struct.
+		data - rows rows of width*4 bytes, R,G,B,A per pixel.
+		rows - Number of rows, at most the number not yet written.
+		swap - The bytes of each pixel are reversed (A,B,G,R) if nonzero.
+
+	Returns:
+		QOI_NO_ERROR on success, otherwise an error code.
+*/
+
+int qoi_write_rows(qoi_t* qoi, const unsigned char* data, unsigned rows, int swap);
+
+/*
+	Function: qoi_write_end
+
+	Writes the end of a QOI file created with qoi_open_file_write, once all of its rows have been written.
+
+	Parameters:
+		qoi - qoi_t struct.
+
+	Returns:
+		QOI_NO_ERROR on success, otherwise an error code (including QOI_WRONG_ARGUMENTS if not all of the rows
+		were written).
+*/
+
+int qoi_write_end(qoi_t* qoi);
+
+/*
+	Function: qoi_close_file
+
+	Closes a QOI file opened with qoi_open_file_read or qoi_open_file_write, and frees its buffer.
+
+	Parameters:
+		qoi - qoi_t struct.
+
+	Returns:
+		QOI_NO_ERROR on success, QOI_FILE_ERROR if a file being written could not be closed.
+*/
+
+int qoi_close_file(qoi_t* qoi);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,316 @@
+/*  rawimg.c - A trivial uncompressed container for RGBA images
+	See rawimg.h
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "rawimg.h"
+
+static const char rawimg_magic[8] = { 'R', 'A', 'W', 'I', 'M', 'G', '1', '\n' };
+
+/* the header is padded with zeros up to the first row */
+static const unsigned char rawimg_zeros[RAWIMG_PAGE_SIZE];
+
+/* rows swapped at a time when writing rows in the other byte order */
+#define RAWIMG_SWAP_SIZE	(64*1024)
+
+static unsigned rawimg_get_ul(const unsigned char* p)
+{
+	return p[0] | ((unsigned)p[1] << 8) | ((unsigned)p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+static void rawimg_put_ul(unsigned char* p, unsigned v)
+{
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+	p[2] = (unsigned char)(v >> 16);
+	p[3] = (unsigned char)(v >> 24);
+}
+
+/* read len bytes at offset, however many calls it takes; returns 0 at the end of the file */
+static int rawimg_pread(int fd, void* buf, size_t len, off_t offset)
+{
+	while(len)
+	{
+		ssize_t n = pread(fd, buf, len, offset);
+
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return 0;
+
+		buf = (unsigned char*)buf + n;
+		len -= n;
+		offset += n;
+	}
+
+	return 1;
+}
+
+/* write the buffers of iov (which it changes) at offset, however many calls it takes */
+static int rawimg_pwritev(int fd, struct iovec* iov, int count, off_t offset)
+{
+	while(count)
+	{
+		ssize_t n = pwritev(fd, iov, count, offset);
+
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return 0;
+
+		offset += n;
+		while(count && (size_t)n >= iov->iov_len)
+		{
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if(count)
+		{
+			iov->iov_base = (unsigned char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 1;
+}
+
+/* reverse the bytes of each of count pixels */
+static void rawimg_swap(unsigned char* dst, const unsigned char* src, size_t count)
+{
+	size_t i;
+
+	for(i = 0; i < count; i++, dst += 4, src += 4)
+	{
+		unsigned char r = src[0], g = src[1];
+
+		dst[0] = src[3];
+		dst[1] = src[2];
+		dst[2] = g;
+		dst[3] = r;
+	}
+}
+
+int rawimg_open_read(rawimg_t* raw, const char* filename)
+{
+	unsigned char h[RAWIMG_HEADER_SIZE];
+	struct stat st;
+
+	raw->writing = 0;
+	raw->next_row = 0;
+	raw->fd = open(filename, O_RDONLY);
+	if(raw->fd < 0)
+		return RAWIMG_FILE_ERROR;
+
+	if(!rawimg_pread(raw->fd, h, sizeof(h), 0) || memcmp(h, rawimg_magic, sizeof(rawimg_magic)) != 0)
+	{
+		close(raw->fd);
+		return RAWIMG_HEADER_ERROR;
+	}
+
+	raw->width = rawimg_get_ul(h + 8);
+	raw->height = rawimg_get_ul(h + 12);
+	raw->byte_order = rawimg_get_ul(h + 16);
+	raw->stride = rawimg_get_ul(h + 20);
+	raw->data_offset = rawimg_get_ul(h + 24);
+
+	if(raw->width == 0 || raw->height == 0 || raw->width > 0x3fffffff || raw->stride < raw->width * 4 || raw->stride % 4 != 0 ||
+		raw->byte_order > RAWIMG_ABGR || raw->data_offset < RAWIMG_HEADER_SIZE ||
+		raw->data_offset % RAWIMG_PAGE_SIZE != 0)
+	{
+		close(raw->fd);
+		return RAWIMG_HEADER_ERROR;
+	}
+
+	if(fstat(raw->fd, &st) != 0 ||
+		(unsigned long long)st.st_size < raw->data_offset + (unsigned long long)raw->stride * raw->height)
+	{
+		close(raw->fd);
+		return RAWIMG_DATA_ERROR;
+	}
+
+	return RAWIMG_NO_ERROR;
+}
+
+int rawimg_map(rawimg_t* raw, void** mapping, size_t* size)
+{
+	size_t len = raw->data_offset + (size_t)raw->stride * raw->height;
+	void* p;
+
+	if(raw->writing)
+		return RAWIMG_WRONG_ARGUMENTS;
+
+	p = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, raw->fd, 0);
+	if(p == MAP_FAILED)
+		return RAWIMG_MEMORY_ERROR;
+
+	*mapping = p;
+	*size = len;
+
+	return RAWIMG_NO_ERROR;
+}
+
+void rawimg_unmap(void* mapping, size_t size)
+{
+	munmap(mapping, size);
+}
+
+int rawimg_read_rows(rawimg_t* raw, unsigned char* data, unsigned rows, unsigned byte_order)
+{
+	size_t rowlen = (size_t)raw->width * 4;
+	off_t offset = raw->data_offset + (off_t)raw->stride * raw->next_row;
+	unsigned i;
+
+	if(raw->writing)
+		return RAWIMG_WRONG_ARGUMENTS;
+
+	if(rows > raw->height - raw->next_row)
+		rows = raw->height - raw->next_row;
+	if(rows == 0)
+		return 0;
+
+	/* rows without padding are read with a single call */
+	if(raw->stride == rowlen)
+	{
+		if(!rawimg_pread(raw->fd, data, rowlen * rows, offset))
+			return RAWIMG_DATA_ERROR;
+	}
+	else
+	{
+		for(i = 0; i < rows; i++)
+		{
+			if(!rawimg_pread(raw->fd, data + rowlen * i, rowlen, offset + (off_t)raw->stride * i))
+				return RAWIMG_DATA_ERROR;
+		}
+	}
+
+	if(byte_order != raw->byte_order)
+		rawimg_swap(data, data, (size_t)raw->width * rows);
+
+	raw->next_row += rows;
+
+	return (int)rows;
+}
+
+int rawimg_open_write(rawimg_t* raw, const char* filename, unsigned width, unsigned height, unsigned byte_order)
+{
+	if(width == 0 || height == 0 || width > 0x3fffffff || byte_order > RAWIMG_ABGR)
+		return RAWIMG_WRONG_ARGUMENTS;
+
+	raw->writing = 1;
+	raw->next_row = 0;
+	raw->width = width;
+	raw->height = height;
+	raw->byte_order = byte_order;
+	raw->stride = width * 4;
+	raw->data_offset = RAWIMG_PAGE_SIZE;
+
+	raw->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(raw->fd < 0)
+		return RAWIMG_FILE_ERROR;
+
+	return RAWIMG_NO_ERROR;
+}
+
+int rawimg_write_rows(rawimg_t* raw, const unsigned char* data, unsigned rows, unsigned byte_order)
+{
+	unsigned char h[RAWIMG_HEADER_SIZE];
+	struct iovec iov[3];
+	int count = 0;
+	off_t offset = raw->data_offset + (off_t)raw->stride * raw->next_row;
+	size_t len = (size_t)raw->stride * rows;
+
+	if(!raw->writing || rows > raw->height - raw->next_row)
+		return RAWIMG_WRONG_ARGUMENTS;
+
+	/* the header goes out with the first rows */
+	if(raw->next_row == 0)
+	{
+		memcpy(h, rawimg_magic, sizeof(rawimg_magic));
+		rawimg_put_ul(h + 8, raw->width);
+		rawimg_put_ul(h + 12, raw->height);
+		rawimg_put_ul(h + 16, raw->byte_order);
+		rawimg_put_ul(h + 20, raw->stride);
+		rawimg_put_ul(h + 24, raw->data_offset);
+		rawimg_put_ul(h + 28, 0);
+
+		iov[0].iov_base = h;
+		iov[0].iov_len = sizeof(h);
+		iov[1].iov_base = (void*)rawimg_zeros;
+		iov[1].iov_len = raw->data_offset - sizeof(h);
+		count = 2;
+		offset = 0;
+	}
+
+	if(byte_order == raw->byte_order)
+	{
+		iov[count].iov_base = (void*)data;
+		iov[count].iov_len = len;
+		count++;
+
+		if(!rawimg_pwritev(raw->fd, iov, count, offset))
+			return RAWIMG_FILE_ERROR;
+	}
+	else
+	{
+		unsigned char* buf = malloc(RAWIMG_SWAP_SIZE);
+		size_t done, n;
+
+		if(!buf)
+			return RAWIMG_MEMORY_ERROR;
+
+		if(count && !rawimg_pwritev(raw->fd, iov, count, offset))
+		{
+			free(buf);
+			return RAWIMG_FILE_ERROR;
+		}
+		offset = raw->data_offset + (off_t)raw->stride * raw->next_row;
+
+		for(done = 0; done < len; done += n)
+		{
+			n = len - done < RAWIMG_SWAP_SIZE ? len - done : RAWIMG_SWAP_SIZE;
+			rawimg_swap(buf, data + done, n / 4);
+
+			iov[0].iov_base = buf;
+			iov[0].iov_len = n;
+			if(!rawimg_pwritev(raw->fd, iov, 1, offset + done))
+			{
+				free(buf);
+				return RAWIMG_FILE_ERROR;
+			}
+		}
+
+		free(buf);
+	}
+
+	raw->next_row += rows;
+
+	return RAWIMG_NO_ERROR;
+}
+
+int rawimg_write_end(rawimg_t* raw)
+{
+	if(!raw->writing || raw->next_row != raw->height)
+		return RAWIMG_WRONG_ARGUMENTS;
+
+	return RAWIMG_NO_ERROR;
+}
+
+int rawimg_close(rawimg_t* raw)
+{
+	int result = RAWIMG_NO_ERROR;
+
+	if(close(raw->fd) != 0 && raw->writing)
+		result = RAWIMG_FILE_ERROR;
+
+	raw->fd = -1;
+
+	return result;
+}
@@ -0,0 +1,201 @@
+/*  rawimg.h - A trivial uncompressed container for RGBA images
+
+	A raw image file is a header, padded to a page, followed by the pixel rows, which are
+	stored exactly as they are laid out in memory. Since the rows start on a page boundary,
+	a program can map the file and use the pixels in place, with no decoding at all, which
+	makes it suited to handing images between the stages of a pipeline on one machine.
+
+	The header is RAWIMG_HEADER_SIZE bytes of little-endian fields:
+
+	> offset 0:  "RAWIMG1\n"
+	> offset 8:  width in pixels
+	> offset 12: height in pixels
+	> offset 16: byte order of each pixel, RAWIMG_RGBA or RAWIMG_ABGR
+	> offset 20: row stride in bytes, a multiple of 4 and at least width*4
+	> offset 24: offset of the first row, a multiple of RAWIMG_PAGE_SIZE
+	> offset 28: 0
+*/
+
+#ifndef _RAWIMG_H_
+#define _RAWIMG_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+	Enumerations for error codes
+*/
+enum
+{
+	RAWIMG_NO_ERROR		= 0,
+	RAWIMG_FILE_ERROR	= -1,
+	RAWIMG_HEADER_ERROR	= -2,	/* not a raw image file, or a header that does not make sense */
+	RAWIMG_MEMORY_ERROR	= -3,
+	RAWIMG_DATA_ERROR	= -4,	/* the file is too short for its header */
+	RAWIMG_WRONG_ARGUMENTS	= -5
+};
+
+/*
+	Byte orders of a pixel
+*/
+enum
+{
+	RAWIMG_RGBA		= 0,	/* R,G,B,A at increasing addresses, as in PNG */
+	RAWIMG_ABGR		= 1	/* A,B,G,R, i.e. 0xRRGGBBAA in a little-endian uint32_t */
+};
+
+#define RAWIMG_HEADER_SIZE	32
+#define RAWIMG_PAGE_SIZE	4096
+
+/*
+	The rawimg_t struct
+*/
+typedef struct
+{
+	int			fd;
+	int			writing;
+
+	unsigned		width;
+	unsigned		height;
+	unsigned		byte_order;
+	unsigned		stride;
+	unsigned		data_offset;
+
+	unsigned		next_row;	/* next row for rawimg_read_rows or rawimg_write_rows */
+} rawimg_t;
+
+/*
+	Function: rawimg_open_read
+
+	Opens a raw image file for reading, reads its header, and checks that the file is long enough to hold all of
+	the rows. On failure nothing is left open; otherwise close it with rawimg_close.
+
+	Parameters:
+		raw - Empty rawimg_t struct.
+		filename - Filename of the file to be opened.
+
+	Returns:
+		RAWIMG_NO_ERROR on success, otherwise an error code.
+*/
+
+int rawimg_open_read(rawimg_t* raw, const char* filename);
+
+/*
+	Function: rawimg_map
+
+	Maps a raw image file opened with rawimg_open_read into memory, copy-on-write, so that the pixels can be used
+	(and changed) in place. The mapping outlives rawimg_close, and is released with rawimg_unmap.
+
+	Parameters:
+		raw - rawimg_t struct.
+		mapping - Set to the start of the mapping; the first row is at raw->data_offset from it.
+		size - Set to the size of the mapping.
+
+	Returns:
+		RAWIMG_NO_ERROR on success, otherwise an error code.
+*/
+
+int rawimg_map(rawimg_t* raw, void** mapping, size_t* size);
+
+/*
+	Function: rawimg_unmap
+
+	Releases a mapping made by rawimg_map.
+
+	Parameters:
+		mapping - Start of the mapping.
+		size - Size of the mapping.
+*/
+
+void rawimg_unmap(void* mapping, size_t size);
+
+/*
+	Function: rawimg_read_rows
+
+	Reads the next rows of a raw image file opened with rawimg_open_read into data, without their padding.
+
+	Parameters:
+		raw - rawimg_t struct.
+		data - Buffer with room for rows rows of width*4 bytes.
+		rows - Maximum number of rows to read.
+		byte_order - Byte order to store the pixels in, RAWIMG_RGBA or RAWIMG_ABGR.
+
+	Returns:
+		The number of rows read, which is less than rows only at the end of the image, 0 once all of the rows have
+		been read, or a (negative) error code.
+*/
+
+int rawimg_read_rows(rawimg_t* raw, unsigned char* data, unsigned rows, unsigned byte_order);
+
+/*
+	Function: rawimg_open_write
+
+	Creates a raw image file with a stride of width*4 bytes, and writes its header. On failure nothing is left open;
+	otherwise finish it with rawimg_write_end and close it with rawimg_close.
+
+	Parameters:
+		raw - Empty rawimg_t struct.
+		filename - Filename of the file to be created.
+		width - Image width.
+		height - Image height.
+		byte_order - Byte order of the pixels in the file, RAWIMG_RGBA or RAWIMG_ABGR.
+
+	Returns:
+		RAWIMG_NO_ERROR on success, otherwise an error code.
+*/
+
+int rawimg_open_write(rawimg_t* raw, const char* filename, unsigned width, unsigned height, unsigned byte_order);
+
+/*
+	Function: rawimg_write_rows
+
+	Writes the next rows of a raw image file created with rawimg_open_write. Rows in the file's byte order are
+	written with a single system call; rows in the other byte order are swapped a block at a time first.
+
+	Parameters:
+		raw - rawimg_t struct.
+		data - rows rows of width*4 bytes.
+		rows - Number of rows, at most the number not yet written.
+		byte_order - Byte order of the pixels in data, RAWIMG_RGBA or RAWIMG_ABGR.
+
+	Returns:
+		RAWIMG_NO_ERROR on success, otherwise an error code.
+*/
+
+int rawimg_write_rows(rawimg_t* raw, const unsigned char* data, unsigned rows, unsigned byte_order);
+
+/*
+	Function: rawimg_write_end
+
+	Checks that all of the rows of a raw image file created with rawimg_open_write have been written.
+
+	Parameters:
+		raw - rawimg_t struct.
+
+	Returns:
+		RAWIMG_NO_ERROR if so, otherwise RAWIMG_WRONG_ARGUMENTS.
+*/
+
+int rawimg_write_end(rawimg_t* raw);
+
+/*
+	Function: rawimg_close
+
+	Closes a raw image file opened with rawimg_open_read or rawimg_open_write.
+
+	Parameters:
+		raw - rawimg_t struct.
+
+	Returns:
+		RAWIMG_NO_ERROR on success, RAWIMG_FILE_ERROR if a file being written could not be closed.
+*/
+
+int rawimg_close(rawimg_t* raw);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,714 @@
+/*  tileimg.c - A tiled image format with independently compressed tiles
+	See tileimg.h
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "zlib.h"
+#include "tileimg.h"
+
+static const char tileimg_magic[8] = { 'T', 'I', 'L', 'E', 'I', 'M', 'G', '1' };
+
+/* largest tile size accepted when reading */
+#define TILEIMG_MAX_TILE_SIZE	4096
+
+/* tiles encoded per thread before their compressed data is written out */
+#define TILEIMG_TILES_PER_THREAD	4
+
+static unsigned tileimg_get_ul(const unsigned char* p)
+{
+	return p[0] | ((unsigned)p[1] << 8) | ((unsigned)p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+static void tileimg_put_ul(unsigned char* p, unsigned v)
+{
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+	p[2] = (unsigned char)(v >> 16);
+	p[3] = (unsigned char)(v >> 24);
+}
+
+static unsigned long long tileimg_get_ull(const unsigned char* p)
+{
+	return tileimg_get_ul(p) | ((unsigned long long)tileimg_get_ul(p + 4) << 32);
+}
+
+static void tileimg_put_ull(unsigned char* p, unsigned long long v)
+{
+	tileimg_put_ul(p, (unsigned)v);
+	tileimg_put_ul(p + 4, (unsigned)(v >> 32));
+}
+
+/* write len bytes at offset, however many calls it takes */
+static int tileimg_pwrite(int fd, const void* buf, size_t len, off_t offset)
+{
+	while(len)
+	{
+		ssize_t n = pwrite(fd, buf, len, offset);
+
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return 0;
+
+		buf = (const unsigned char*)buf + n;
+		len -= n;
+		offset += n;
+	}
+
+	return 1;
+}
+
+/* copy count pixels, reversing the bytes of each if swap is nonzero */
+static void tileimg_copy_pixels(unsigned char* dst, const unsigned char* src, size_t count, int swap)
+{
+	size_t i;
+
+	if(!swap)
+	{
+		memcpy(dst, src, count * 4);
+		return;
+	}
+
+	for(i = 0; i < count; i++, dst += 4, src += 4)
+	{
+		unsigned char r = src[0], g = src[1];
+
+		dst[0] = src[3];
+		dst[1] = src[2];
+		dst[2] = g;
+		dst[3] = r;
+	}
+}
+
+static unsigned tileimg_num_tiles(tileimg_t* tile)
+{
+	return tile->tiles_across * tile->tiles_down;
+}
+
+/* number of rows in row band of tiles */
+static unsigned tileimg_band_height(tileimg_t* tile, unsigned band)
+{
+	unsigned first = band * tile->tile_size;
+
+	return tile->height - first < tile->tile_size ? tile->height - first : tile->tile_size;
+}
+
+/* number of columns in column tx of tiles */
+static unsigned tileimg_tile_width(tileimg_t* tile, unsigned tx)
+{
+	unsigned first = tx * tile->tile_size;
+
+	return tile->width - first < tile->tile_size ? tile->width - first : tile->tile_size;
+}
+
+/*
+	Decoding and encoding tiles in parallel. Each task decodes or encodes one tile; workers take
+	the next task under the lock until there are none left or one has failed.
+*/
+
+typedef struct
+{
+	z_stream		stream;
+	int			stream_ready;
+	unsigned char*		scratch;	/* one tile of filtered rows */
+} tileimg_worker_t;
+
+typedef struct
+{
+	unsigned char*		buf;
+	unsigned		len;
+} tileimg_encoded_t;
+
+typedef struct tileimg_job tileimg_job_t;
+
+typedef int (*tileimg_task_t)(tileimg_job_t* job, tileimg_worker_t* worker, unsigned index);
+
+struct tileimg_job
+{
+	tileimg_t*		tile;
+	tileimg_task_t		task;
+	int			encoding;
+	unsigned		num_tasks;
+	unsigned		next_task;
+	int			result;
+	pthread_mutex_t		lock;
+
+	/* the tiles are those of columns first_tx to first_tx + across - 1, from row first_ty down */
+	unsigned		first_tx;
+	unsigned		first_ty;
+	unsigned		across;
+	int			swap;
+
+	/* decoding: the rectangle to decode into data */
+	unsigned char*		data;
+	unsigned		x;
+	unsigned		y;
+	unsigned		width;
+	unsigned		height;
+
+	/* encoding: the rows of the tiles, and their compressed data */
+	const unsigned char*	src;
+	tileimg_encoded_t*	encoded;
+};
+
+static int tileimg_decode_tile(tileimg_job_t* job, tileimg_worker_t* worker, unsigned index)
+{
+	tileimg_t* tile = job->tile;
+	unsigned tx = job->first_tx + index % job->across;
+	unsigned ty = job->first_ty + index / job->across;
+	unsigned t = ty * tile->tiles_across + tx;
+	unsigned px = tx * tile->tile_size;
+	unsigned py = ty * tile->tile_size;
+	unsigned tw = tileimg_tile_width(tile, tx);
+	unsigned th = tileimg_band_height(tile, ty);
+	unsigned x0 = px > job->x ? px : job->x;
+	unsigned x1 = px + tw < job->x + job->width ? px + tw : job->x + job->width;
+	unsigned y0 = py > job->y ? py : job->y;
+	unsigned y1 = py + th < job->y + job->height ? py + th : job->y + job->height;
+	z_stream* stream = &worker->stream;
+	unsigned i, y;
+
+	if(!worker->stream_ready)
+	{
+		memset(stream, 0, sizeof(*stream));
+		if(inflateInit(stream) != Z_OK)
+			return TILEIMG_ZLIB_ERROR;
+		worker->stream_ready = 1;
+	}
+	else if(inflateReset(stream) != Z_OK)
+	{
+		return TILEIMG_ZLIB_ERROR;
+	}
+
+	stream->next_in = tile->map + tile->offsets[t];
+	stream->avail_in = (uInt)(tile->offsets[t + 1] - tile->offsets[t]);
+	stream->next_out = worker->scratch;
+	stream->avail_out = tw * th * 4;
+
+	/* the whole tile is inflated, so that its adler32 is checked */
+	if(inflate(stream, Z_FINISH) != Z_STREAM_END || stream->avail_out != 0)
+		return TILEIMG_DATA_ERROR;
+
+	for(y = y0; y < y1; y++)
+	{
+		unsigned char* row = worker->scratch + (size_t)(y - py) * tw * 4;
+
+		/* undo the Sub filter up to the last column wanted */
+		for(i = 4; i < (x1 - px) * 4; i++)
+			row[i] += row[i - 4];
+
+		tileimg_copy_pixels(job->data + ((size_t)(y - job->y) * job->width + (x0 - job->x)) * 4,
+			row + (x0 - px) * 4, x1 - x0, job->swap);
+	}
+
+	return TILEIMG_NO_ERROR;
+}
+
+static int tileimg_encode_tile(tileimg_job_t* job, tileimg_worker_t* worker, unsigned index)
+{
+	tileimg_t* tile = job->tile;
+	unsigned tx = index % job->across;
+	unsigned ty = job->first_ty + index / job->across;
+	unsigned tw = tileimg_tile_width(tile, tx);
+	unsigned th = tileimg_band_height(tile, ty);
+	size_t rowlen = (size_t)tile->width * 4;
+	const unsigned char* src = job->src + (size_t)(index / job->across) * tile->tile_size * rowlen +
+		(size_t)tx * tile->tile_size * 4;
+	z_stream* stream = &worker->stream;
+	tileimg_encoded_t* out = &job->encoded[index];
+	unsigned len = tw * th * 4;
+	unsigned bound;
+	unsigned i, y;
+
+	/* convert each row to R,G,B,A and apply the Sub filter */
+	for(y = 0; y < th; y++)
+	{
+		unsigned char* row = worker->scratch + (size_t)y * tw * 4;
+
+		tileimg_copy_pixels(row, src + y * rowlen, tw, job->swap);
+		for(i = tw * 4 - 1; i >= 4; i--)
+			row[i] -= row[i - 4];
+	}
+
+	if(!worker->stream_ready)
+	{
+		memset(stream, 0, sizeof(*stream));
+		if(deflateInit(stream, tile->level) != Z_OK)
+			return TILEIMG_ZLIB_ERROR;
+		worker->stream_ready = 1;
+	}
+	else if(deflateReset(stream) != Z_OK)
+	{
+		return TILEIMG_ZLIB_ERROR;
+	}
+
+	bound = deflateBound(stream, len);
+	out->buf = malloc(bound);
+	if(!out->buf)
+		return TILEIMG_MEMORY_ERROR;
+
+	stream->next_in = worker->scratch;
+	stream->avail_in = len;
+	stream->next_out = out->buf;
+	stream->avail_out = bound;
+
+	if(deflate(stream, Z_FINISH) != Z_STREAM_END)
+		return TILEIMG_ZLIB_ERROR;
+
+	out->len = bound - stream->avail_out;
+
+	return TILEIMG_NO_ERROR;
+}
+
+static void* tileimg_worker(void* arg)
+{
+	tileimg_job_t* job = arg;
+	tileimg_worker_t worker;
+	unsigned index;
+	int result;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.scratch = malloc((size_t)job->tile->tile_size * job->tile->tile_size * 4);
+
+	for(;;)
+	{
+		pthread_mutex_lock(&job->lock);
+		if(!worker.scratch && job->result == TILEIMG_NO_ERROR)
+			job->result = TILEIMG_MEMORY_ERROR;
+		index = job->next_task++;
+		if(job->result != TILEIMG_NO_ERROR)
+			index = job->num_tasks;
+		pthread_mutex_unlock(&job->lock);
+
+		if(index >= job->num_tasks)
+			break;
+
+		result = job->task(job, &worker, index);
+
+		if(result != TILEIMG_NO_ERROR)
+		{
+			pthread_mutex_lock(&job->lock);
+			job->result = result;
+			pthread_mutex_unlock(&job->lock);
+		}
+	}
+
+	if(worker.stream_ready)
+	{
+		if(job->encoding)
+			deflateEnd(&worker.stream);
+		else
+			inflateEnd(&worker.stream);
+	}
+	free(worker.scratch);
+
+	return 0;
+}
+
+/* run the tasks of job on up to tile->threads threads (one of which is the calling thread) */
+static int tileimg_run(tileimg_job_t* job)
+{
+	pthread_t threads[64];
+	unsigned num_threads = job->tile->threads;
+	unsigned started = 0;
+	unsigned i;
+
+	if(num_threads > job->num_tasks)
+		num_threads = job->num_tasks;
+	if(num_threads > sizeof(threads) / sizeof(threads[0]))
+		num_threads = sizeof(threads) / sizeof(threads[0]);
+
+	job->next_task = 0;
+	job->result = TILEIMG_NO_ERROR;
+	pthread_mutex_init(&job->lock, 0);
+
+	while(started + 1 < num_threads && pthread_create(&threads[started], 0, tileimg_worker, job) == 0)
+		started++;
+
+	tileimg_worker(job);
+
+	for(i = 0; i < started; i++)
+		pthread_join(threads[i], 0);
+
+	pthread_mutex_destroy(&job->lock);
+
+	return job->result;
+}
+
+int tileimg_open_read(tileimg_t* tile, const char* filename, unsigned threads)
+{
+	unsigned long long across, down, num_tiles, start;
+	const unsigned char* h;
+	struct stat st;
+	unsigned i;
+	int result = TILEIMG_HEADER_ERROR;
+
+	memset(tile, 0, sizeof(*tile));
+	tile->threads = threads ? threads : 1;
+	tile->band_index = ~0U;
+
+	tile->fd = open(filename, O_RDONLY);
+	if(tile->fd < 0)
+		return TILEIMG_FILE_ERROR;
+
+	if(fstat(tile->fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		close(tile->fd);
+		return TILEIMG_FILE_ERROR;
+	}
+
+	if((unsigned long long)st.st_size < TILEIMG_HEADER_SIZE)
+	{
+		close(tile->fd);
+		return TILEIMG_HEADER_ERROR;
+	}
+
+	/* the tiles are inflated straight from the mapping, by any number of threads at once */
+	tile->map_size = st.st_size;
+	tile->map = mmap(0, tile->map_size, PROT_READ, MAP_SHARED, tile->fd, 0);
+	close(tile->fd);
+	tile->fd = -1;
+	if(tile->map == MAP_FAILED)
+	{
+		tile->map = 0;
+		return TILEIMG_MEMORY_ERROR;
+	}
+
+	h = tile->map;
+	tile->width = tileimg_get_ul(h + 8);
+	tile->height = tileimg_get_ul(h + 12);
+	tile->tile_size = tileimg_get_ul(h + 16);
+
+	if(memcmp(h, tileimg_magic, sizeof(tileimg_magic)) != 0 || tileimg_get_ul(h + 20) != 0 ||
+		tile->width == 0 || tile->height == 0 || tile->width > 0x3fffffff || tile->height > 0x3fffffff ||
+		tile->tile_size == 0 || tile->tile_size > TILEIMG_MAX_TILE_SIZE)
+		goto fail;
+
+	across = (tile->width + tile->tile_size - 1) / tile->tile_size;
+	down = (tile->height + tile->tile_size - 1) / tile->tile_size;
+	num_tiles = across * down;
+	start = TILEIMG_HEADER_SIZE + (num_tiles + 1) * 8;
+
+	/* the table has to fit in the file, which also bounds the memory it takes */
+	if(start > tile->map_size)
+		goto fail;
+
+	tile->tiles_across = (unsigned)across;
+	tile->tiles_down = (unsigned)down;
+	tile->offsets = malloc((size_t)(num_tiles + 1) * sizeof(unsigned long long));
+	if(!tile->offsets)
+	{
+		result = TILEIMG_MEMORY_ERROR;
+		goto fail;
+	}
+
+	for(i = 0; i <= num_tiles; i++)
+	{
+		tile->offsets[i] = tileimg_get_ull(h + TILEIMG_HEADER_SIZE + (size_t)i * 8);
+
+		if(tile->offsets[i] < (i ? tile->offsets[i - 1] : start) || tile->offsets[i] > tile->map_size ||
+			(i && tile->offsets[i] - tile->offsets[i - 1] > UINT_MAX))
+			goto fail;
+	}
+
+	return TILEIMG_NO_ERROR;
+
+fail:
+	tileimg_close(tile);
+	return result;
+}
+
+int tileimg_read_region(tileimg_t* tile, unsigned char* data, unsigned x, unsigned y, unsigned width,
+	unsigned height, int swap)
+{
+	tileimg_job_t job;
+	unsigned last_tx, last_ty;
+
+	if(tile->writing || (unsigned long long)x + width > tile->width ||
+		(unsigned long long)y + height > tile->height)
+		return TILEIMG_WRONG_ARGUMENTS;
+
+	if(width == 0 || height == 0)
+		return TILEIMG_NO_ERROR;
+
+	last_tx = (x + width - 1) / tile->tile_size;
+	last_ty = (y + height - 1) / tile->tile_size;
+
+	memset(&job, 0, sizeof(job));
+	job.tile = tile;
+	job.task = tileimg_decode_tile;
+	job.first_tx = x / tile->tile_size;
+	job.first_ty = y / tile->tile_size;
+	job.across = last_tx - job.first_tx + 1;
+	job.num_tasks = job.across * (last_ty - job.first_ty + 1);
+	job.swap = swap;
+	job.data = data;
+	job.x = x;
+	job.y = y;
+	job.width = width;
+	job.height = height;
+
+	return tileimg_run(&job);
+}
+
+int tileimg_read_rows(tileimg_t* tile, unsigned char* data, unsigned rows, int swap)
+{
+	size_t rowlen = (size_t)tile->width * 4;
+	unsigned done = 0;
+	int result;
+
+	if(tile->writing)
+		return TILEIMG_WRONG_ARGUMENTS;
+
+	if(rows > tile->height - tile->next_row)
+		rows = tile->height - tile->next_row;
+
+	while(done < rows)
+	{
+		unsigned band = tile->next_row / tile->tile_size;
+		unsigned first = band * tile->tile_size;
+		unsigned n = rows - done;
+
+		/* whole rows of tiles are decoded straight into data */
+		if(tile->next_row == first && tile->next_row + n < tile->height)
+			n -= n % tile->tile_size;
+
+		if(tile->next_row == first && n > 0)
+		{
+			result = tileimg_read_region(tile, data, 0, tile->next_row, tile->width, n, swap);
+			if(result != TILEIMG_NO_ERROR)
+				return result;
+		}
+		else
+		{
+			unsigned bh = tileimg_band_height(tile, band);
+
+			if(tile->band_index != band)
+			{
+				if(!tile->band)
+					tile->band = malloc(rowlen * tile->tile_size);
+				if(!tile->band)
+					return TILEIMG_MEMORY_ERROR;
+
+				result = tileimg_read_region(tile, tile->band, 0, first, tile->width, bh, 0);
+				if(result != TILEIMG_NO_ERROR)
+					return result;
+				tile->band_index = band;
+			}
+
+			n = rows - done;
+			if(n > first + bh - tile->next_row)
+				n = first + bh - tile->next_row;
+
+			tileimg_copy_pixels(data, tile->band + (tile->next_row - first) * rowlen, (size_t)tile->width * n, swap);
+		}
+
+		data += n * rowlen;
+		done += n;
+		tile->next_row += n;
+	}
+
+	return (int)rows;
+}
+
+int tileimg_open_write(tileimg_t* tile, const char* filename, unsigned width, unsigned height, int level,
+	unsigned threads)
+{
+	unsigned num_tiles;
+
+	if(width == 0 || height == 0 || width > 0x3fffffff || height > 0x3fffffff || level < -1 || level > 9)
+		return TILEIMG_WRONG_ARGUMENTS;
+
+	memset(tile, 0, sizeof(*tile));
+	tile->writing = 1;
+	tile->width = width;
+	tile->height = height;
+	tile->tile_size = TILEIMG_TILE_SIZE;
+	tile->tiles_across = (width + TILEIMG_TILE_SIZE - 1) / TILEIMG_TILE_SIZE;
+	tile->tiles_down = (height + TILEIMG_TILE_SIZE - 1) / TILEIMG_TILE_SIZE;
+	tile->threads = threads ? threads : 1;
+	tile->level = level;
+	tile->band_index = ~0U;
+
+	num_tiles = tileimg_num_tiles(tile);
+	tile->offsets = malloc((size_t)(num_tiles + 1) * sizeof(unsigned long long));
+	if(!tile->offsets)
+		return TILEIMG_MEMORY_ERROR;
+
+	/* the tiles follow the header and table, which are written last; until then the last entry is where the
+	   next tile goes */
+	tile->offsets[num_tiles] = TILEIMG_HEADER_SIZE + (unsigned long long)(num_tiles + 1) * 8;
+
+	tile->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(tile->fd < 0)
+	{
+		free(tile->offsets);
+		tile->offsets = 0;
+		return TILEIMG_FILE_ERROR;
+	}
+
+	return TILEIMG_NO_ERROR;
+}
+
+/* encode num_bands rows of tiles, starting with row band, from src, and write them out */
+static int tileimg_encode_bands(tileimg_t* tile, const unsigned char* src, unsigned band, unsigned num_bands,
+	int swap)
+{
+	unsigned num_tiles = tileimg_num_tiles(tile);
+	unsigned first = band * tile->tiles_across;
+	tileimg_job_t job;
+	unsigned i;
+	int result;
+
+	memset(&job, 0, sizeof(job));
+	job.tile = tile;
+	job.task = tileimg_encode_tile;
+	job.encoding = 1;
+	job.first_ty = band;
+	job.across = tile->tiles_across;
+	job.num_tasks = num_bands * tile->tiles_across;
+	job.swap = swap;
+	job.src = src;
+	job.encoded = calloc(job.num_tasks, sizeof(tileimg_encoded_t));
+	if(!job.encoded)
+		return TILEIMG_MEMORY_ERROR;
+
+	result = tileimg_run(&job);
+
+	/* the tiles are written in order, each where the last one ended */
+	for(i = 0; i < job.num_tasks; i++)
+	{
+		if(result == TILEIMG_NO_ERROR)
+		{
+			tile->offsets[first + i] = tile->offsets[num_tiles];
+			if(!tileimg_pwrite(tile->fd, job.encoded[i].buf, job.encoded[i].len, tile->offsets[num_tiles]))
+				result = TILEIMG_FILE_ERROR;
+			tile->offsets[num_tiles] += job.encoded[i].len;
+		}
+		free(job.encoded[i].buf);
+	}
+
+	free(job.encoded);
+
+	return result;
+}
+
+int tileimg_write_rows(tileimg_t* tile, const unsigned char* data, unsigned rows, int swap)
+{
+	size_t rowlen = (size_t)tile->width * 4;
+	unsigned max_bands = (tile->threads * TILEIMG_TILES_PER_THREAD + tile->tiles_across - 1) / tile->tiles_across;
+	int result;
+
+	if(!tile->writing || rows > tile->height - tile->next_row)
+		return TILEIMG_WRONG_ARGUMENTS;
+
+	while(rows)
+	{
+		unsigned band = tile->next_row / tile->tile_size;
+		unsigned bh = tileimg_band_height(tile, band);
+		unsigned n;
+
+		if(tile->band_rows == 0 && rows >= bh)
+		{
+			/* whole rows of tiles are encoded straight from data, a few at a time */
+			unsigned num_bands = 0;
+
+			n = 0;
+			while(num_bands < max_bands && band + num_bands < tile->tiles_down &&
+				n + tileimg_band_height(tile, band + num_bands) <= rows)
+			{
+				n += tileimg_band_height(tile, band + num_bands);
+				num_bands++;
+			}
+
+			result = tileimg_encode_bands(tile, data, band, num_bands, swap);
+			if(result != TILEIMG_NO_ERROR)
+				return result;
+		}
+		else
+		{
+			/* others are collected, in R,G,B,A order, until they are complete */
+			if(!tile->band)
+				tile->band = malloc(rowlen * tile->tile_size);
+			if(!tile->band)
+				return TILEIMG_MEMORY_ERROR;
+
+			n = bh - tile->band_rows < rows ? bh - tile->band_rows : rows;
+			tileimg_copy_pixels(tile->band + tile->band_rows * rowlen, data, (size_t)tile->width * n, swap);
+			tile->band_rows += n;
+
+			if(tile->band_rows == bh)
+			{
+				tile->band_rows = 0;
+				result = tileimg_encode_bands(tile, tile->band, band, 1, 0);
+				if(result != TILEIMG_NO_ERROR)
+					return result;
+			}
+		}
+
+		data += n * rowlen;
+		rows -= n;
+		tile->next_row += n;
+	}
+
+	return TILEIMG_NO_ERROR;
+}
+
+int tileimg_write_end(tileimg_t* tile)
+{
+	unsigned num_tiles = tileimg_num_tiles(tile);
+	size_t len = TILEIMG_HEADER_SIZE + (size_t)(num_tiles + 1) * 8;
+	unsigned char* h;
+	unsigned i;
+	int result = TILEIMG_NO_ERROR;
+
+	if(!tile->writing || tile->next_row != tile->height)
+		return TILEIMG_WRONG_ARGUMENTS;
+
+	h = malloc(len);
+	if(!h)
+		return TILEIMG_MEMORY_ERROR;
+
+	memcpy(h, tileimg_magic, sizeof(tileimg_magic));
+	tileimg_put_ul(h + 8, tile->width);
+	tileimg_put_ul(h + 12, tile->height);
+	tileimg_put_ul(h + 16, tile->tile_size);
+	tileimg_put_ul(h + 20, 0);
+	for(i = 0; i <= num_tiles; i++)
+		tileimg_put_ull(h + TILEIMG_HEADER_SIZE + (size_t)i * 8, tile->offsets[i]);
+
+	if(!tileimg_pwrite(tile->fd, h, len, 0))
+		result = TILEIMG_FILE_ERROR;
+
+	free(h);
+
+	return result;
+}
+
+int tileimg_close(tileimg_t* tile)
+{
+	int result = TILEIMG_NO_ERROR;
+
+	if(tile->fd >= 0 && close(tile->fd) != 0 && tile->writing)
+		result = TILEIMG_FILE_ERROR;
+	if(tile->map)
+		munmap(tile->map, tile->map_size);
+
+	free(tile->offsets);
+	free(tile->band);
+
+	tile->fd = -1;
+	tile->map = 0;
+	tile->offsets = 0;
+	tile->band = 0;
+
+	return result;
+}
@@ -0,0 +1,206 @@
+/*  tileimg.h - A tiled image format with independently compressed tiles
+
+	A tiled image file holds an RGBA image cut into square tiles, each of which is compressed
+	on its own, with a table of where each tile starts. A program can decode just the tiles
+	overlapping a region of a very large image, and can decode (or encode) the tiles of an
+	image on all of its processors at once, which neither PNG nor QOI allow.
+
+	All fields are little-endian:
+
+	> offset 0:  "TILEIMG1"
+	> offset 8:  width in pixels
+	> offset 12: height in pixels
+	> offset 16: tile size in pixels; the tiles in the last column and row are clipped to the image
+	> offset 20: 0
+	> offset 24: (number of tiles + 1) 64-bit offsets from the start of the file, one for each tile
+	>            in row-major order and one for the end of the last tile
+
+	Each tile is a zlib stream of its rows of R,G,B,A bytes, each byte stored as the difference
+	from the byte 4 before it in the row (PNG's Sub filter).
+*/
+
+#ifndef _TILEIMG_H_
+#define _TILEIMG_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/*
+	Enumerations for error codes
+*/
+enum
+{
+	TILEIMG_NO_ERROR	= 0,
+	TILEIMG_FILE_ERROR	= -1,
+	TILEIMG_HEADER_ERROR	= -2,	/* not a tiled image file, or a header or tile table that does not make sense */
+	TILEIMG_MEMORY_ERROR	= -3,
+	TILEIMG_DATA_ERROR	= -4,	/* corrupt tile data */
+	TILEIMG_ZLIB_ERROR	= -5,
+	TILEIMG_WRONG_ARGUMENTS	= -6
+};
+
+#define TILEIMG_HEADER_SIZE	24
+#define TILEIMG_TILE_SIZE	256	/* tile size of the files written */
+
+/*
+	The tileimg_t struct
+*/
+typedef struct
+{
+	int			fd;
+	int			writing;
+
+	unsigned		width;
+	unsigned		height;
+	unsigned		tile_size;
+	unsigned		tiles_across;
+	unsigned		tiles_down;
+	unsigned long long*	offsets;	/* tiles_across * tiles_down + 1 tile offsets */
+
+	unsigned char*		map;		/* the file, mapped, when reading */
+	size_t			map_size;
+
+	unsigned		threads;	/* number of threads to decode or encode tiles on */
+	int			level;		/* zlib compression level, when writing */
+
+	unsigned		next_row;	/* next row for tileimg_read_rows or tileimg_write_rows */
+	unsigned char*		band;		/* one row of tiles, decoded or waiting to be encoded */
+	unsigned		band_index;	/* row of tiles in band when reading, or ~0 for none */
+	unsigned		band_rows;	/* rows in band waiting to be encoded, when writing */
+} tileimg_t;
+
+/*
+	Function: tileimg_open_read
+
+	Opens a tiled image file for reading, maps it into memory, and reads and checks its header and tile table.
+	On failure nothing is left open; otherwise close it with tileimg_close.
+
+	Parameters:
+		tile - Empty tileimg_t struct.
+		filename - Filename of the file to be opened.
+		threads - Number of threads to decode tiles on, at least 1.
+
+	Returns:
+		TILEIMG_NO_ERROR on success, otherwise an error code.
+*/
+
+int tileimg_open_read(tileimg_t* tile, const char* filename, unsigned threads);
+
+/*
+	Function: tileimg_read_region
+
+	Decodes the pixels of a rectangle of a tiled image file opened with tileimg_open_read into data, as R,G,B,A
+	bytes per pixel. Only the tiles overlapping the rectangle are decoded, in parallel.
+
+	Parameters:
+		tile - tileimg_t struct.
+		data - Buffer with room for height rows of width*4 bytes.
+		x - Left edge of the rectangle.
+		y - Top edge of the rectangle.
+		width - Width of the rectangle, which must lie within the image.
+		height - Height of the rectangle.
+		swap - Reverse the bytes of each pixel (A,B,G,R) if nonzero.
+
+	Returns:
+		TILEIMG_NO_ERROR on success, otherwise an error code.
+*/
+
+int tileimg_read_region(tileimg_t* tile, unsigned char* data, unsigned x, unsigned y, unsigned width,
+	unsigned height, int swap);
+
+/*
+	Function: tileimg_read_rows
+
+	Decodes the next rows of a tiled image file opened with tileimg_open_read into data, as tileimg_read_region
+	does. Each row of tiles is decoded once, however many calls its rows are read in.
+
+	Parameters:
+		tile - tileimg_t struct.
+		data - Buffer with room for rows rows of width*4 bytes.
+		rows - Maximum number of rows to read.
+		swap - Reverse the bytes of each pixel (A,B,G,R) if nonzero.
+
+	Returns:
+		The number of rows read, which is less than rows only at the end of the image, 0 once all of the rows have
+		been read, or a (negative) error code.
+*/
+
+int tileimg_read_rows(tileimg_t* tile, unsigned char* data, unsigned rows, int swap);
+
+/*
+	Function: tileimg_open_write
+
+	Creates a tiled image file with tiles of TILEIMG_TILE_SIZE pixels. On failure nothing is left open; otherwise
+	finish it with tileimg_write_end and close it with tileimg_close.
+
+	Parameters:
+		tile - Empty tileimg_t struct.
+		filename - Filename of the file to be created.
+		width - Image width.
+		height - Image height.
+		level - zlib compression level, 0 to 9, or -1 for zlib's default.
+		threads - Number of threads to encode tiles on, at least 1.
+
+	Returns:
+		TILEIMG_NO_ERROR on success, otherwise an error code.
+*/
+
+int tileimg_open_write(tileimg_t* tile, const char* filename, unsigned width, unsigned height, int level,
+	unsigned threads);
+
+/*
+	Function: tileimg_write_rows
+
+	Writes the next rows of a tiled image file created with tileimg_open_write. Each row of tiles is encoded, in
+	parallel, once all of its rows have been written; whole rows of tiles are encoded straight from data, and
+	others are copied until they are complete.
+
+	Parameters:
+		tile - tileimg_t struct.
+		data - rows rows of width*4 bytes, R,G,B,A per pixel.
+		rows - Number of rows, at most the number not yet written.
+		swap - The bytes of each pixel are reversed (A,B,G,R) if nonzero.
+
+	Returns:
+		TILEIMG_NO_ERROR on success, otherwise an error code.
+*/
+
+int tileimg_write_rows(tileimg_t* tile, const unsigned char* data, unsigned rows, int swap);
+
+/*
+	Function: tileimg_write_end
+
+	Writes the header and tile table of a tiled image file created with tileimg_open_write, once all of its rows
+	have been written.
+
+	Parameters:
+		tile - tileimg_t struct.
+
+	Returns:
+		TILEIMG_NO_ERROR on success, otherwise an error code (including TILEIMG_WRONG_ARGUMENTS if not all of the
+		rows were written).
+*/
+
+int tileimg_write_end(tileimg_t* tile);
+
+/*
+	Function: tileimg_close
+
+	Closes a tiled image file opened with tileimg_open_read or tileimg_open_write, and frees its buffers.
+
+	Parameters:
+		tile - tileimg_t struct.
+
+	Returns:
+		TILEIMG_NO_ERROR on success, TILEIMG_FILE_ERROR if a file being written could not be closed.
+*/
+
+int tileimg_close(tileimg_t* tile);
+
+#ifdef __cplusplus
+}
+#endif
+#endif